@@ -14,19 +14,42 @@
  */
 
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE // copy_file_range(), SEEK_DATA and SEEK_HOLE, name_to_handle_at(), vmsplice()
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+
+#ifdef XORFS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef XORFS_WITH_LZ4
+#include <lz4.h>
+#endif
 
 #define XORFS_VERSION_MAJOR 0
 #define XORFS_VERSION_MINOR 1
@@ -40,37 +63,429 @@
 #define XORFS_LOG_LEVEL 5
 #define XORFS_DEBUG_FILE_NAME "debug.info"
 #define XORFS_SOURCE_FILE_EXTENSION ".xor"
+#define XORFS_PACKED_SOURCE_FILE_EXTENSION ".xorz"
+#define XORFS_PACKED_MAGIC "XORFSZ\0\0"
+#define XORFS_PACKED_VERSION 1
+#define XORFS_PACKED_DEFAULT_BLOCK_SIZE 4096
+#define XORFS_COMPRESSED_SOURCE_FILE_EXTENSION ".xorc"
+#define XORFS_COMPRESSED_MAGIC "XORFSC\0\0"
+#define XORFS_COMPRESSED_VERSION 1
+#define XORFS_COMPRESSED_DEFAULT_FRAME_SIZE (128 * 1024)
+#define XORFS_COMPRESSED_FRAME_STORED 1 // Frame flag - not compressed
+#define XORFS_MANIFEST_SOURCE_FILE_EXTENSION ".xorm"
+#define XORFS_MANIFEST_MAGIC "XORFSM\0\0"
+#define XORFS_MANIFEST_VERSION 1
+#define XORFS_BLOCK_STORE_FILE_NAME "blocks.xorb"
+#define XORFS_BLOCK_STORE_MAGIC "XORFSB\0\0"
+#define XORFS_BLOCK_STORE_VERSION 1
+#define XORFS_BLOCK_STORE_DEFAULT_BLOCK_SIZE 4096
+#define XORFS_BLOCK_INDEX_FILE_NAME "blocks.xori"
+#define XORFS_BLOCK_INDEX_MAGIC "XORFSI\0\0"
+#define XORFS_BLOCK_INDEX_VERSION 1
+#define XORFS_BLOCK_INDEX_INITIAL_SLOT_COUNT 1024
+#define XORFS_HASH_SIZE 32 // SHA-256
+#define XORFS_HISTORY_FILE_EXTENSION ".xorh"
+#define XORFS_HISTORY_MAGIC "XORFSH\0\0"
+#define XORFS_HISTORY_VERSION 1
+#define XORFS_HISTORY_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define XORFS_HISTORY_MAXIMUM_QUERY_COUNT 1024 // Numbers in a reply of the ioctl
+#define XORFS_IOCTL_BLOCK_HISTORY _IOWR('x', 1, struct xorfs_block_history)
+#define XORFS_NBD_MAGIC 0x4e42444d41474943ULL // "NBDMAGIC"
+#define XORFS_NBD_OPTION_MAGIC 0x49484156454f5054ULL // "IHAVEOPT"
+#define XORFS_NBD_OPTION_REPLY_MAGIC 0x0003e889045565a9ULL
+#define XORFS_NBD_REQUEST_MAGIC 0x25609513
+#define XORFS_NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define XORFS_NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define XORFS_NBD_CONNECTION_THREAD_COUNT 4 // Requests of one connection processed in parallel
+#define XORFS_NBD_MAXIMUM_PAYLOAD (32 * 1024 * 1024)
+#define XORFS_NBD_MAXIMUM_OPTION_LENGTH 4096
+#define XORFS_NBD_MAXIMUM_EXTENT_COUNT 1024 // In one block status reply
+#define XORFS_NBD_BASE_ALLOCATION_CONTEXT_ID 1
+#define XORFS_STREAM_SLOT_COUNT 4 // Chunks in the ring of a stream
+#define XORFS_STREAM_MEMORY (64 * 1024 * 1024) // Of all buffers of a stream, chunks get smaller for long chains
+#define XORFS_STREAM_MAXIMUM_CHUNK_SIZE (1024 * 1024)
+#define XORFS_STREAM_MINIMUM_CHUNK_SIZE (64 * 1024)
+#define XORFS_STREAM_MINIMUM_READ_SIZE (4 * 1024 * 1024) // Shorter reads are not worth starting the threads
+#define XORFS_COMPRESSED_MAXIMUM_READ_SIZE (8 * 1024 * 1024) // Consecutive frames are read with one pread() up to this size
+#define XORFS_ZSTD_LEVEL 3
+#define XORFS_FRAME_CACHE_SIZE (256 * 1024 * 1024) // bytes, default of -o frame_cache_size
+#define XORFS_FRAME_CACHE_BASE_PERCENTAGE 75 // Share of the cache reserved for frames of plain images
+#define XORFS_FRAME_CACHE_BUCKET_COUNT 4096
+#define XORFS_SET_CACHE_PERCENTAGE 100 // Share of the frame cache one backup set may hold, default of -o set_cache_share
+#define XORFS_CHECKPOINT_SIZE (16LL * 1024 * 1024 * 1024) // bytes, default of -o checkpoint_size
+#define XORFS_CHECKPOINT_INTERVAL 60 // s, default of -o checkpoint_interval
+#define XORFS_READAHEAD_SIZE 4096 // KiB, default of -o readahead
+#define XORFS_READAHEAD_QUEUE_LENGTH 16
+#define XORFS_SPLICE_MINIMUM_SIZE (64 * 1024) // Reads of at least this size are replied through a pipe
+#define XORFS_SPLICE_BUFFER_SIZE (1024 * 1024) // Of buffers and pipes of spliced replies, larger reads are replied from memory
+#define XORFS_INTERRUPT_CHECK_INTERVAL 10 // ms, of waits of reads for slots and frames
+#define XORFS_FUSE_FILE_HANDLE_TYPE 0x81 // FILEID_INO64_GEN
 #define XORFS_ROOT_PERMISSIONS 0755
 #define XORFS_FILE_PERMISSIONS 0644
+#define XORFS_TEMPORARY_FILE_SUFFIX ".tmp"
+#define XORFS_TOOL_CHUNK_SIZE (1024 * 1024)
+#define XORFS_NAME_CHUNK_SIZE (64 * 1024) // Of the pool of source file names of a catalog
+#define XORFS_SPARSE_BLOCK_SIZE 4096
+#define XORFS_PARENT_SAMPLE_COUNT 1024 // Blocks of XORFS_SPARSE_BLOCK_SIZE compared with each candidate parent of a new backup
+#define XORFS_PARENT_CANDIDATE_COUNT 4 // Latest backups of the set tried as parents, besides plain images
+#define XORFS_PARENT_SIZE_TOLERANCE 5 // %, more changed samples than the fewest, for a shorter chain
+#define XORFS_GUEST_CHUNK_SIZE (16 * 1024 * 1024) // Of guest filesystem extraction, longer used runs are streamed
+#define XORFS_SECTOR_SIZE 512
+#define XORFS_GPT_MAXIMUM_ENTRY_COUNT 128
+#define XORFS_EXT4_SUPERBLOCK_OFFSET 1024
+#define XORFS_EXT4_MAGIC 0xEF53
+#define XORFS_EXT4_ROOT_INODE 2
+#define XORFS_EXT4_INODE_READ_SIZE 128 // Fields used, of any inode size
+#define XORFS_EXT4_FEATURE_SPARSE_SUPER 0x1 // Read-only compatible
+#define XORFS_EXT4_FEATURE_META_BG 0x10 // Incompatible
+#define XORFS_EXT4_FEATURE_64BIT 0x80 // Incompatible
+#define XORFS_EXT4_GROUP_BLOCK_UNINIT 0x2
+#define XORFS_EXT4_INODE_ENCRYPTED 0x800
+#define XORFS_EXT4_INODE_EXTENTS 0x80000
+#define XORFS_EXT4_INODE_INLINE_DATA 0x10000000
+#define XORFS_EXT4_EXTENT_MAGIC 0xF30A
+#define XORFS_EXT4_MAXIMUM_EXTENT_DEPTH 5
+#define XORFS_EXT4_MAXIMUM_EXTENT_LENGTH 32768 // Longer ones are uninitialized
+
+// Read cost model used to choose between chains, see xorfs_get_source_file_cost()
+#define XORFS_PLANNING_READ_SIZE (128 * 1024) // bytes
+#define XORFS_PLANNING_FILE_COST 5 // us, system call and xoring
+#define XORFS_PLANNING_SSD_LATENCY 100 // us
+#define XORFS_PLANNING_SSD_BANDWIDTH 500 // bytes per us
+#define XORFS_PLANNING_HDD_LATENCY 8000 // us
+#define XORFS_PLANNING_HDD_BANDWIDTH 150 // bytes per us
+#define XORFS_PLANNING_KNOWN_DEVICE_COUNT 16
 
 const char* XORFS_LOG_LEVEL_NAMES[] = { "_NA", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
 
 struct xorfs_backup {
-   char *name;
+   char *name; // Interned, that of the set
+   unsigned int set; // Index in xorfs_backup_sets, backups of the same name
    unsigned int number;
    unsigned int xor_against_number;
    struct xorfs_source_file* xor_against_source_file;
+   unsigned int depth; // Number of xored images in the chain
+   double cost; // Estimated cost of reading a range through the chain, see xorfs_get_source_file_cost()
+   off_t size; // Logical size, that of the image in the backup's own source file - a parent may be shorter (zeros past its end) or longer
    time_t time;
-   char *output_file_name;
+   uint16_t output_name_length; // The output file name is this long start of the source file name and ".dat", see xorfs_get_output_file_name()
+   struct xorfs_source_file *checkpoint; // Plain image in the checkpoint directory, used instead of the chain once set
+   uint64_t read_bytes; // Read through the mount, decays, see xorfs_choose_checkpoint()
+   off_t next_read_offset; // End of the last read through the mount
+   off_t readahead_end; // Of the range pushed to the kernel, see xorfs_read_ahead()
+};
+
+enum xorfs_source_format {
+   XORFS_SOURCE_FORMAT_RAW, // .xor - the image itself, zero ranges may be holes
+   XORFS_SOURCE_FORMAT_PACKED, // .xorz - see struct xorfs_packed_header
+   XORFS_SOURCE_FORMAT_COMPRESSED, // .xorc - see struct xorfs_compressed_header
+   XORFS_SOURCE_FORMAT_MANIFEST, // .xorm - see struct xorfs_manifest_header
+};
+
+enum xorfs_codec {
+   XORFS_CODEC_NONE,
+   XORFS_CODEC_ZSTD,
+   XORFS_CODEC_LZ4,
+};
+
+const char* XORFS_CODEC_NAMES[] = { "none", "zstd", "lz4" };
+
+/**
+ * Header of a packed (.xorz) source file
+ *
+ * Followed by the block index - a little-endian uint32_t for every block
+ * of the image, 0 for a zero block, n for the n-th stored block. Stored
+ * blocks follow from the first multiple of block size after the index,
+ * each of full block size. Numbers are little-endian.
+ */
+struct xorfs_packed_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t block_size;
+   uint64_t size; // Of the image
+   uint64_t block_count;
+   uint64_t stored_block_count;
+};
+
+struct xorfs_packed_index {
+   uint32_t block_size;
+   uint64_t block_count;
+   off_t data_offset;
+   const uint32_t *blocks; // Points to the mapping
+   void *mapping; // Header and index mapped from the file
+   size_t mapping_size;
+};
+
+/**
+ * Header of a compressed (.xorc) source file
+ *
+ * The image is cut into frames of `frame_size` bytes (the last one may be
+ * shorter), each compressed on its own, so any range can be read without
+ * decompressing the rest. Followed by a struct xorfs_compressed_frame for
+ * every frame, then by the frames. Numbers are little-endian.
+ */
+struct xorfs_compressed_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t codec; // enum xorfs_codec
+   uint32_t frame_size;
+   uint32_t reserved;
+   uint64_t size; // Of the image
+   uint64_t frame_count;
+};
+
+struct xorfs_compressed_frame {
+   uint64_t offset; // In the file
+   uint32_t stored_size; // 0 for a zero frame
+   uint32_t flags; // XORFS_COMPRESSED_FRAME_*
+};
+
+struct xorfs_compressed_index {
+   enum xorfs_codec codec;
+   uint32_t frame_size;
+   uint64_t frame_count;
+   const struct xorfs_compressed_frame *frames; // Points to the mapping
+   void *mapping; // Header and frame index mapped from the file
+   size_t mapping_size;
+};
+
+/**
+ * Header of a manifest (.xorm) source file
+ *
+ * Followed by the SHA-256 hash of every block of the image, all zeros for
+ * a zero block. The blocks themselves are in the block store of the source
+ * directory, shared by all manifests, so a block found in several images
+ * (of any backup sets) is stored once. Numbers are little-endian.
+ */
+struct xorfs_manifest_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t block_size; // Of the block store
+   uint64_t size; // Of the image
+   uint64_t block_count;
+};
+
+struct xorfs_manifest {
+   uint32_t block_size;
+   uint64_t block_count;
+   struct xorfs_block_store *store; // Of the source files the manifest is in
+   const unsigned char (*hashes)[XORFS_HASH_SIZE]; // Points to the mapping
+   void *mapping; // Header and hashes mapped from the file
+   size_t mapping_size;
+};
+
+/**
+ * Header of the block store (blocks.xorb)
+ *
+ * Blocks follow from offset `block_size`, each of full block size, in order
+ * of adding. Blocks are only appended, never changed or removed.
+ */
+struct xorfs_block_store_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t block_size;
+};
+
+/**
+ * Header of the hash index of the block store (blocks.xori)
+ *
+ * Followed by `slot_count` (a power of two) slots of a hash table with open
+ * addressing - a block is looked up from the slot given by the first bytes
+ * of its hash on, up to the first empty slot.
+ */
+struct xorfs_block_index_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t reserved;
+   uint64_t slot_count;
+   uint64_t entry_count;
+};
+
+struct xorfs_block_index_slot {
+   unsigned char hash[XORFS_HASH_SIZE];
+   uint64_t block; // Number in the store + 1, 0 for an empty slot
+};
+
+/**
+ * Header of the block history index of a backup set (<name>.xorh)
+ *
+ * Lists for every block the numbers of backups which changed it - whose
+ * image differs there from that of the previous backup (or of the backup
+ * it is xored against, without a source file against the previous one),
+ * or for plain images, which have data there. Followed by `block_count + 1`
+ * uint64_t offsets into the list of numbers, then by the uint32_t numbers,
+ * increasing for each block. Numbers are little-endian.
+ */
+struct xorfs_history_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t block_size;
+   uint64_t block_count;
+   uint64_t entry_count;
+   uint32_t last_number; // Newest backup in the index
+   uint32_t reserved;
+};
+
+struct xorfs_history {
+   uint32_t block_size;
+   uint32_t last_number;
+   uint64_t block_count;
+   const uint64_t *offsets; // Points to the mapping
+   const uint32_t *numbers; // Points to the mapping
+   void *mapping; // NULL without an index
+   size_t mapping_size;
+};
+
+/**
+ * Argument of the XORFS_IOCTL_BLOCK_HISTORY ioctl on a backup file
+ */
+struct xorfs_block_history {
+   uint64_t offset; // In: of the block in the backup
+   uint32_t count; // Out: of backups which changed the block, the first XORFS_HISTORY_MAXIMUM_QUERY_COUNT in `numbers`
+   uint32_t last_number; // Out: newest backup in the index
+   uint32_t block_size; // Out
+   uint32_t numbers[XORFS_HISTORY_MAXIMUM_QUERY_COUNT];
+};
+
+struct xorfs_block_store {
+   int fd;
+   uint32_t block_size;
+   uint64_t block_count;
+   uint64_t slot_count;
+   uint64_t entry_count;
+   struct xorfs_block_index_slot *slots; // Points to the mapping, or allocated by tools which add blocks
+   void *mapping; // Hash index mapped from the file, NULL when allocated
+   size_t mapping_size;
+};
+
+/**
+ * Fields of struct stat in use, of the same names
+ */
+struct xorfs_source_file_stat {
+    off_t st_size; // Of the image, not of the file
+    blkcnt_t st_blocks;
+    dev_t st_dev;
+};
+
+/**
+ * Runs of stored and of zero units (blocks or frames) of a source file
+ * which is not raw, for seeking to data or holes without scanning its index
+ */
+struct xorfs_unit_runs {
+   uint64_t *starts; // First unit of each run, runs alternate between stored and zero
+   uint64_t count;
+   int is_first_stored;
+};
+
+/**
+ * Indexes of a source file which is not raw, allocated apart from the
+ * catalog entry - most source files are raw
+ */
+struct xorfs_source_file_indexes {
+    union {
+       struct xorfs_packed_index packed_index; // Packed format only
+       struct xorfs_compressed_index compressed_index; // Compressed format only
+       struct xorfs_manifest manifest; // Manifest format only
+    };
+    struct xorfs_unit_runs unit_runs;
 };
 
 struct xorfs_source_file {
-    char *name; // Allocated string
-    FILE *file_descriptor;
-    struct stat stat;
+    char *name; // In the name pool of the source files, or allocated for a checkpoint
+    int fd;
+    enum xorfs_source_format format;
+    struct xorfs_source_file_indexes *indexes; // Formats other than raw, NULL for raw
+    struct xorfs_source_file_stat stat;
     struct xorfs_backup backup;
+    int is_duplicate; // Another source file provides the same backup with a shorter chain, this one is not used
+};
+
+struct xorfs_lookup_slot {
+    uint32_t hash; // Of the output file name
+    uint32_t index; // Of the source file + 1, 0 for an empty slot
+};
+
+/**
+ * Names of source files are copied to chunks, which are freed with them
+ */
+struct xorfs_name_chunk {
+    struct xorfs_name_chunk *next;
+    size_t used_size;
+    char names[XORFS_NAME_CHUNK_SIZE];
 };
 
 struct xorfs_source_files {
     unsigned int count;
+    unsigned int allocated_count;
     struct xorfs_source_file* files;
+    struct xorfs_lookup_slot *lookup_slots; // Of used source files by output file name, open addressing
+    int *backup_slots; // Used source file + 1 by set and number, open addressing, see xorfs_find_backup_slot()
+    unsigned int lookup_slot_count; // Power of two, of both
+    struct xorfs_history *histories; // By backup set, see xorfs_open_histories()
+    unsigned int history_count;
+    struct xorfs_block_store *block_store; // Opened with the first manifest, or by tools adding blocks
+    struct xorfs_name_chunk *name_chunks; // The last one first
 };
 
 /* Maybe convert these to a structure? */
 char *xorfs_source_directory_path = NULL;
-struct xorfs_source_files xorfs_source_files = { 0, NULL };
+struct xorfs_source_files xorfs_source_files = { 0, 0, NULL, NULL, NULL, 0, NULL, 0, NULL, NULL };
+struct xorfs_source_files *xorfs_catalog = &xorfs_source_files; // Source files of the reads through the mount, see xorfs_enter_catalog()
+
+struct xorfs_backup_set {
+   char *name;
+   size_t cache_size; // Of frames charged to the set, under the frame cache mutex
+};
+
+struct xorfs_backup_sets {
+   unsigned int count;
+   struct xorfs_backup_set *sets;
+   unsigned int *slots; // Set + 1 by hash of the name, open addressing, 0 for an empty slot
+   unsigned int slot_count; // Power of two
+};
+
+struct xorfs_backup_sets xorfs_backup_sets = { 0, NULL, NULL, 0 };
 int xorfs_debug_file_fd = -1;
 
+/**
+ * The mount served by the fuse loop, none in tools
+ */
+struct xorfs_mount {
+   struct fuse *fuse;
+   struct fuse_chan *channel;
+   char *mountpoint; // Absolute
+};
+
+struct xorfs_mount xorfs_mount = { NULL, NULL, NULL };
+
+/**
+ * Mount options (-o name=value)
+ */
+struct xorfs_options {
+   unsigned long frame_cache_size; // MiB
+   unsigned int set_cache_share; // %
+   unsigned int io_slots; // Reads of backups in progress at once, 0 for the number of processors
+   char *checkpoint_directory; // Checkpoints are not written without it
+   unsigned long checkpoint_size; // MiB
+   unsigned int checkpoint_interval; // s
+   unsigned int rescan_interval; // s, 0 to never rescan
+   unsigned int readahead; // KiB, 0 to not push data ahead of sequential reads
+};
+
+struct xorfs_options xorfs_options = { XORFS_FRAME_CACHE_SIZE / (1024 * 1024), XORFS_SET_CACHE_PERCENTAGE, 0, NULL, XORFS_CHECKPOINT_SIZE / (1024 * 1024), XORFS_CHECKPOINT_INTERVAL, 0, XORFS_READAHEAD_SIZE };
+
+static const struct fuse_opt xorfs_option_specification[] = {
+   { "frame_cache_size=%lu", offsetof(struct xorfs_options, frame_cache_size), 0 },
+   { "set_cache_share=%u", offsetof(struct xorfs_options, set_cache_share), 0 },
+   { "io_slots=%u", offsetof(struct xorfs_options, io_slots), 0 },
+   { "checkpoint_directory=%s", offsetof(struct xorfs_options, checkpoint_directory), 0 },
+   { "checkpoint_size=%lu", offsetof(struct xorfs_options, checkpoint_size), 0 },
+   { "checkpoint_interval=%u", offsetof(struct xorfs_options, checkpoint_interval), 0 },
+   { "rescan_interval=%u", offsetof(struct xorfs_options, rescan_interval), 0 },
+   { "readahead=%u", offsetof(struct xorfs_options, readahead), 0 },
+   FUSE_OPT_END
+};
+
 
 int xorfs_log(int severity, const char *format, ...)
 {
@@ -88,13 +503,147 @@ int xorfs_log(int severity, const char *format, ...)
     return return_code;
 }
 
+/**
+ * Set while this thread serves a read of fuse - fuse_interrupted() has no
+ * request to look at in other threads (readahead, checkpoints, fetches)
+ */
+static __thread int xorfs_is_serving_request = 0;
+
+/**
+ * Whether the fuse request served by this thread has been interrupted
+ * (the reading process was killed, or the read timed out)
+ */
+int xorfs_is_interrupted()
+{
+   return xorfs_is_serving_request && fuse_interrupted();
+}
+
+/**
+ * Wait on `condition` for at most XORFS_INTERRUPT_CHECK_INTERVAL
+ */
+void xorfs_wait_for_interval(pthread_cond_t *condition, pthread_mutex_t *mutex)
+{
+   struct timespec deadline;
+
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_nsec += XORFS_INTERRUPT_CHECK_INTERVAL * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L)
+   {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+
+   pthread_cond_timedwait(condition, mutex, &deadline);
+}
+
+/**
+ * FNV-1a
+ */
+uint32_t xorfs_hash_name(const char *name, size_t length)
+{
+   uint32_t hash = 2166136261u;
+
+   for (size_t index = 0; index < length; index++)
+   {
+      hash = (hash ^ (unsigned char) name[index]) * 16777619u;
+   }
+
+   return hash;
+}
+
+/*
+ * Catalog
+ *
+ * Reads through the mount find source files in xorfs_catalog. A rescan
+ * builds a new catalog in xorfs_source_files, publishes it by swapping the
+ * pointer, and frees the old one once no operation which may have seen it
+ * is left (epoch based reclamation). Operations never wait for a rescan.
+ *
+ * An operation counts itself in the current epoch for its duration. After
+ * publishing, the rescan starts a new epoch and waits for the count of the
+ * previous one to drop to zero.
+ */
+
+struct xorfs_catalog_epochs {
+   uint64_t epoch;
+   unsigned int reader_counts[2]; // Of the current and of the previous epoch, by parity
+};
+
+struct xorfs_catalog_epochs xorfs_catalog_epochs = { 0, { 0, 0 } };
+
+/**
+ * Returns what to pass to xorfs_leave_catalog()
+ */
+unsigned int xorfs_enter_catalog()
+{
+   struct xorfs_catalog_epochs *epochs = &xorfs_catalog_epochs;
+
+   while (1)
+   {
+      uint64_t epoch = __atomic_load_n(&epochs->epoch, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&epochs->reader_counts[epoch % 2], 1, __ATOMIC_SEQ_CST);
+
+      // Counted before the epoch moved on, the rescan waits for this operation
+      if (__atomic_load_n(&epochs->epoch, __ATOMIC_SEQ_CST) == epoch)
+      {
+         return epoch % 2;
+      }
+
+      __atomic_sub_fetch(&epochs->reader_counts[epoch % 2], 1, __ATOMIC_SEQ_CST);
+   }
+}
+
+void xorfs_leave_catalog(unsigned int epoch_parity)
+{
+   __atomic_sub_fetch(&xorfs_catalog_epochs.reader_counts[epoch_parity], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until no operation can use the catalog published before the last one
+ */
+void xorfs_synchronize_catalog()
+{
+   struct xorfs_catalog_epochs *epochs = &xorfs_catalog_epochs;
+   uint64_t epoch = __atomic_load_n(&epochs->epoch, __ATOMIC_SEQ_CST);
+
+   __atomic_store_n(&epochs->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+   while (__atomic_load_n(&epochs->reader_counts[epoch % 2], __ATOMIC_ACQUIRE) != 0)
+   {
+      usleep(1000);
+   }
+}
+
+/**
+ * Write the output file name of the backup to `buffer` of NAME_MAX + 1 bytes
+ */
+void xorfs_get_output_file_name(struct xorfs_source_file *source_file, char *buffer)
+{
+   snprintf(buffer, NAME_MAX + 1, "%.*s.dat", (int) source_file->backup.output_name_length, source_file->name);
+}
+
 struct xorfs_source_file* xorfs_get_source_file_by_file_name(const char *requested_name)
 {
-   for (int index = 0; index < xorfs_source_files.count; index++)
+   struct xorfs_source_files *catalog = __atomic_load_n(&xorfs_catalog, __ATOMIC_ACQUIRE);
+   size_t length = strlen(requested_name);
+
+   if (length > 4 && strcmp(requested_name + length - 4, ".dat") == 0 && catalog->lookup_slot_count > 0)
    {
-      if (strcmp(xorfs_source_files.files[index].backup.output_file_name, requested_name) == 0)
+      size_t name_length = length - 4;
+      uint32_t hash = xorfs_hash_name(requested_name, name_length);
+      unsigned int mask = catalog->lookup_slot_count - 1;
+
+      // Hashes are compared in the slots, only a matching one touches its source file
+      for (unsigned int slot = hash & mask; catalog->lookup_slots[slot].index != 0; slot = (slot + 1) & mask)
       {
-         return xorfs_source_files.files + index;
+         struct xorfs_source_file *source_file = catalog->files + catalog->lookup_slots[slot].index - 1;
+
+         if (catalog->lookup_slots[slot].hash == hash
+             && source_file->backup.output_name_length == name_length
+             && memcmp(source_file->name, requested_name, name_length) == 0)
+         {
+            return source_file;
+         }
       }
    }
 
@@ -105,6 +654,7 @@ struct xorfs_source_file* xorfs_get_source_file_by_file_name(const char *request
 static int xorfs_operation_getattr( const char *path, struct stat *st )
 {
    xorfs_log(XORFS_LOG_DEBUG, "Operation 'getattr' on '%s'\n", path);
+   unsigned int epoch_parity = xorfs_enter_catalog();
 
    // Root directory
    if (strcmp(path, "/") == 0)
@@ -118,7 +668,7 @@ static int xorfs_operation_getattr( const char *path, struct stat *st )
       st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
       st->st_nlink = 1;
       st->st_mode = S_IFREG | XORFS_FILE_PERMISSIONS;
-      st->st_size = lseek(xorfs_debug_file_fd, 0, SEEK_END);
+      st->st_size = lseek(__atomic_load_n(&xorfs_debug_file_fd, __ATOMIC_ACQUIRE), 0, SEEK_END);
    }
    // A source file
    else
@@ -128,7 +678,8 @@ static int xorfs_operation_getattr( const char *path, struct stat *st )
       if (source_file != NULL)
       {
          // Copy from source file
-         *st = source_file->stat;
+         st->st_size = source_file->backup.size;
+         st->st_blocks = source_file->stat.st_blocks;
 
          // Overwrite some
          st->st_atime = time(NULL);
@@ -139,10 +690,13 @@ static int xorfs_operation_getattr( const char *path, struct stat *st )
       }
       else
       {
+         xorfs_leave_catalog(epoch_parity);
          return -ENOENT;
       }
    }
 
+   xorfs_leave_catalog(epoch_parity);
+
    // Common attributes
    st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
    st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted the filesystem
@@ -160,12 +714,24 @@ static int xorfs_operation_readdir( const char *path, void *buffer, fuse_fill_di
         // Root directory
         if ( strcmp( path, "/" ) == 0 )
         {
+           unsigned int epoch_parity = xorfs_enter_catalog();
+           struct xorfs_source_files *catalog = __atomic_load_n(&xorfs_catalog, __ATOMIC_ACQUIRE);
+
            // Source files
-           for (int index = 0; index < xorfs_source_files.count; index++)
+           for (int index = 0; index < catalog->count; index++)
            {
-              filler(buffer, xorfs_source_files.files[index].backup.output_file_name, NULL, 0);
+              if (catalog->files[index].is_duplicate)
+              {
+                 continue;
+              }
+
+              char output_file_name[NAME_MAX + 1];
+              xorfs_get_output_file_name(catalog->files + index, output_file_name);
+              filler(buffer, output_file_name, NULL, 0);
            }
 
+           xorfs_leave_catalog(epoch_parity);
+
            // Debug file
            filler(buffer, XORFS_DEBUG_FILE_NAME, NULL, 0);
 
@@ -175,393 +741,3857 @@ static int xorfs_operation_readdir( const char *path, void *buffer, fuse_fill_di
         return -ENOENT;
 }
 
-int xorfs_read_plain(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+int xorfs_is_zero_hash(const unsigned char *hash)
+{
+   return hash[0] == 0 && memcmp(hash, hash + 1, XORFS_HASH_SIZE - 1) == 0;
+}
+
+/**
+ * Size and number of units (blocks or frames) of a source file which is not raw
+ */
+void xorfs_get_unit_geometry(struct xorfs_source_file *source_file, uint64_t *unit_size, uint64_t *unit_count)
 {
-   // Set position
-   int fseek_result = fseek(source_file->file_descriptor, offset, SEEK_SET);
-   if (fseek_result < 0)
+   *unit_size = source_file->indexes->compressed_index.frame_size;
+   *unit_count = source_file->indexes->compressed_index.frame_count;
+
+   if (source_file->format == XORFS_SOURCE_FORMAT_PACKED)
    {
-      xorfs_log(XORFS_LOG_ERROR, "Cannot fseek file %s to offset %li: %s\n", source_file->name, offset, strerror(errno));
-      return -EINVAL;
+      *unit_size = source_file->indexes->packed_index.block_size;
+      *unit_count = source_file->indexes->packed_index.block_count;
+   }
+   else if (source_file->format == XORFS_SOURCE_FORMAT_MANIFEST)
+   {
+      *unit_size = source_file->indexes->manifest.block_size;
+      *unit_count = source_file->indexes->manifest.block_count;
    }
+}
 
-   // Read data
-   int read_bytes = fread(buffer, 1, size, source_file->file_descriptor);
+int xorfs_is_unit_stored(struct xorfs_source_file *source_file, uint64_t unit)
+{
+   if (source_file->format == XORFS_SOURCE_FORMAT_PACKED)
+   {
+      return source_file->indexes->packed_index.blocks[unit] != 0;
+   }
+   else if (source_file->format == XORFS_SOURCE_FORMAT_MANIFEST)
+   {
+      return !xorfs_is_zero_hash(source_file->indexes->manifest.hashes[unit]);
+   }
 
-   return read_bytes;
+   return source_file->indexes->compressed_index.frames[unit].stored_size != 0;
 }
 
-int xorfs_read_backup(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+/**
+ * Collect runs of stored and zero units of a source file which is not raw,
+ * once its index is open
+ */
+int xorfs_index_unit_runs(struct xorfs_source_file *source_file)
 {
-   xorfs_log(XORFS_LOG_DEBUG, "Read backup %s-%i, offset %li\n", source_file->backup.name, source_file->backup.number, offset);
+   struct xorfs_unit_runs *runs = &(source_file->indexes->unit_runs);
+   uint64_t allocated_count = 0;
+   uint64_t unit_size, unit_count;
+   int is_previous_stored = 0;
 
-   int read_bytes = 0;
+   xorfs_get_unit_geometry(source_file, &unit_size, &unit_count);
 
-   // Read from the requested file
+   for (uint64_t unit = 0; unit < unit_count; unit++)
    {
-      int r = xorfs_read_plain(source_file, buffer, offset, size);
-      if (r < 0)
+      int is_stored = xorfs_is_unit_stored(source_file, unit);
+
+      if (unit > 0 && is_stored == is_previous_stored)
       {
-         return r;
+         continue;
       }
 
-      read_bytes = r;
-   }
-
-   if (source_file->backup.xor_against_number == 0)
-   // Reading plain image
-   {
-      // Data is already in the buffer,
-      // just return the number of bytes
-      return read_bytes;
-   }
-   else
-   // Reading xored image
-   {
-      char *first_buffer = buffer;
-      char *second_buffer = NULL;
-
-      // Allocate second buffer
+      if (runs->count == allocated_count)
       {
-         second_buffer = malloc(size);
-         if (second_buffer == NULL)
+         allocated_count = allocated_count > 0 ? allocated_count * 2 : 64;
+         uint64_t *starts = realloc(runs->starts, allocated_count * sizeof (uint64_t));
+         if (starts == NULL)
          {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
             return -ENOMEM;
          }
-      }
 
-      // Read from the second file
-      {
-         int r = xorfs_read_backup(source_file->backup.xor_against_source_file, second_buffer, offset, read_bytes);
-         if (r < 0)
-         {
-            free(second_buffer);
-            return r;
-         }
-         else if (r != read_bytes)
-         {
-            xorfs_log(XORFS_LOG_ERROR, "Read mismatch: %i bytes were read from %s, but only %i from %s\n", read_bytes, source_file->name, r, source_file->backup.xor_against_source_file->name);
-            free(second_buffer);
-            return -EIO;
-         }
+         runs->starts = starts;
       }
 
-      // Xor buffers
+      if (unit == 0)
       {
-         int uintmax_size = sizeof (uintmax_t);
-         if ((size % uintmax_size) == 0)
-         // Use uintmax_t chunks
-         {
-            xorfs_log(XORFS_LOG_DEBUG, "Using uintmax_t chunks of size %i for the xoring\n", uintmax_size);
-
-            uintmax_t* first_buffer_maxint = (uintmax_t *) first_buffer;
-            uintmax_t* second_buffer_maxint = (uintmax_t *) second_buffer;
-
-            int size_in_uintmax_chunks = size / uintmax_size;
-            int i = 0;
-            while (i < size_in_uintmax_chunks)
-            {
-               first_buffer_maxint[i] ^= second_buffer_maxint[i];
-               i++;
-            }
-         }
-         else
-         // Go byte-by-byte
-         {
-            xorfs_log(XORFS_LOG_DEBUG, "Using byte-by-byte operation for the xoring\n", uintmax_size);
-
-            int i = 0;
-            while (i < size)
-            {
-               first_buffer[i] ^= second_buffer[i];
-               i++;
-            }
-         }
+         runs->is_first_stored = is_stored;
       }
 
-      free(second_buffer);
-      return read_bytes;
+      runs->starts[runs->count++] = unit;
+      is_previous_stored = is_stored;
    }
+
+   return 0;
 }
 
-static int xorfs_operation_read( const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi )
+/**
+ * lseek() with SEEK_DATA or SEEK_HOLE in the image of the source file
+ */
+off_t xorfs_seek_source_file(struct xorfs_source_file *source_file, off_t offset, int whence)
 {
-   xorfs_log(XORFS_LOG_DEBUG, "Operation read on '%s', offset %li, size %li\n", path, offset, size);
+   if (source_file->format == XORFS_SOURCE_FORMAT_RAW)
+   {
+      return lseek(source_file->fd, offset, whence);
+   }
 
-   // Reading debug file
-   if (strcmp(path + 1, XORFS_DEBUG_FILE_NAME) == 0)
+   struct xorfs_unit_runs *runs = &(source_file->indexes->unit_runs);
+
+   // Zero blocks or frames are holes
+   uint64_t unit_size, unit_count;
+   xorfs_get_unit_geometry(source_file, &unit_size, &unit_count);
+
+   if (offset >= source_file->stat.st_size)
    {
-     lseek(xorfs_debug_file_fd, offset, SEEK_SET);
-     ssize_t read_result = read(xorfs_debug_file_fd, buffer, size);
-     return read_result;
+      errno = ENXIO;
+      return -1;
    }
-   else
-   // Reading source file
+
+   if (runs->count > 0)
    {
-      struct xorfs_source_file *source_file = xorfs_get_source_file_by_file_name(path + 1 /* removing slash */);
-      if (source_file == NULL)
+      // Last run starting at or before the unit of the offset
+      uint64_t unit = offset / unit_size;
+      uint64_t low = 0;
+      uint64_t high = runs->count;
+
+      while (high - low > 1)
       {
-         return -ENOENT;
+         uint64_t middle = low + (high - low) / 2;
+
+         if (runs->starts[middle] <= unit) { low = middle; } else { high = middle; }
       }
 
-      return xorfs_read_backup(source_file, buffer, offset, size);
-   }
-}
-
-static struct fuse_operations operations = {
-    .getattr	= xorfs_operation_getattr,
-    .readdir	= xorfs_operation_readdir,
-    .read		= xorfs_operation_read,
-};
+      int is_stored = runs->is_first_stored ^ (int) (low & 1);
 
-static int xorfs_process_argument(void *data, const char *arg, int key, struct fuse_args *outargs)
-{
-    xorfs_log(XORFS_LOG_DEBUG, "Processing argument \"%s\", key %i\n", arg, key);
+      if (is_stored == (whence == SEEK_DATA))
+      {
+         return offset;
+      }
 
-    // Take the first non-option as source directory
-    if (key == FUSE_OPT_KEY_NONOPT && xorfs_source_directory_path == NULL)
-    {
-        xorfs_source_directory_path = strdup(arg);
+      if (low + 1 < runs->count)
+      {
+         return (off_t) (runs->starts[low + 1] * unit_size);
+      }
+   }
 
-        // Do not pass this argument to fuse itself
-        return 0;
-    }
+   // No more data, or the hole at the end
+   if (whence == SEEK_DATA)
+   {
+      errno = ENXIO;
+      return -1;
+   }
 
-    return 1;
+   return source_file->stat.st_size;
 }
 
-void xorfs_close_source_files ()
+int xorfs_read_packed(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
 {
-   // Close all files
-   for (int index = 0; index < xorfs_source_files.count; index++)
+   struct xorfs_packed_index *index = &(source_file->indexes->packed_index);
+   int fd = source_file->fd;
+
+   // Stop at the end of image
+   if (offset >= source_file->stat.st_size)
    {
-       char* file_name = xorfs_source_files.files[index].name;
-       char *backup_name = xorfs_source_files.files[index].backup.name;
-       char *backup_output_file_name = xorfs_source_files.files[index].backup.output_file_name;
-       FILE* file_descriptor = xorfs_source_files.files[index].file_descriptor;
+      return 0;
+   }
 
-       xorfs_log(XORFS_LOG_DEBUG, "Closing file '%s'\n", file_name);
+   if (size > source_file->stat.st_size - offset)
+   {
+      size = source_file->stat.st_size - offset;
+   }
+
+   // Runs of zero blocks, and of blocks stored one after another, at once
+   size_t position = 0;
+   while (position < size)
+   {
+      uint64_t block = (offset + position) / index->block_size;
+      size_t offset_in_block = (offset + position) % index->block_size;
+      uint32_t stored_block = le32toh(index->blocks[block]);
+      size_t length = index->block_size - offset_in_block;
+
+      for (uint64_t next_block = block + 1; position + length < size && next_block < index->block_count; next_block++)
+      {
+         uint32_t expected_stored_block = stored_block == 0 ? 0 : stored_block + (next_block - block);
+         if (le32toh(index->blocks[next_block]) != expected_stored_block)
+         {
+            break;
+         }
+
+         length += index->block_size;
+      }
+
+      if (length > size - position)
+      {
+         length = size - position;
+      }
+
+      if (stored_block == 0)
+      {
+         memset(buffer + position, 0, length);
+      }
+      else
+      {
+         off_t file_offset = index->data_offset + (off_t) (stored_block - 1) * index->block_size + offset_in_block;
+
+         ssize_t read_bytes = pread(fd, buffer + position, length, file_offset);
+         if (read_bytes != length)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Cannot read file %s at offset %li: %s\n", source_file->name, file_offset, read_bytes < 0 ? strerror(errno) : "file too short");
+            return -EIO;
+         }
+      }
 
-       free(file_name);
-       free(backup_name);
-       free(backup_output_file_name);
-       if (file_descriptor != NULL) { fclose(file_descriptor); }
+      position += length;
    }
 
-   // Free memory
-   free(xorfs_source_files.files);
+   return size;
 }
 
-struct xorfs_source_file* get_source_file_by_backup_name_and_number(const char* requested_name, unsigned int requested_number)
+/*
+ * Worker pool
+ *
+ * Threads running submitted tasks, started with the first task.
+ */
+
+struct xorfs_task {
+   void (*function)(void *argument);
+   void *argument;
+   struct xorfs_task *next;
+};
+
+struct xorfs_worker_pool {
+   pthread_mutex_t mutex;
+   pthread_cond_t task_available;
+   struct xorfs_task *first_task;
+   struct xorfs_task *last_task;
+   int thread_count;
+};
+
+struct xorfs_worker_pool xorfs_worker_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+int xorfs_get_default_thread_count()
 {
-   for (int index = 0; index < xorfs_source_files.count; index++)
+   long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+   return processor_count > 0 ? processor_count : 1;
+}
+
+void* xorfs_worker_pool_thread(void *data)
+{
+   struct xorfs_worker_pool *pool = data;
+
+   while (1)
    {
-      if (xorfs_source_files.files[index].backup.number == requested_number && strcmp(xorfs_source_files.files[index].backup.name, requested_name) == 0)
+      pthread_mutex_lock(&pool->mutex);
+      while (pool->first_task == NULL)
+      {
+         pthread_cond_wait(&pool->task_available, &pool->mutex);
+      }
+
+      struct xorfs_task *task = pool->first_task;
+      pool->first_task = task->next;
+      if (pool->first_task == NULL)
       {
-         return xorfs_source_files.files + index;
+         pool->last_task = NULL;
       }
+      pthread_mutex_unlock(&pool->mutex);
+
+      task->function(task->argument);
+      free(task);
    }
 
-   xorfs_log(XORFS_LOG_NOTICE, "Source file for backup %s-%i not found\n", requested_name, requested_number);
    return NULL;
 }
 
-int xorfs_create_debug_file(struct xorfs_source_files *source_files)
+/**
+ * Run the function in a worker thread, or in this one if that is not possible
+ */
+void xorfs_submit_task(void (*function)(void *), void *argument)
 {
-   char mkstemp_template[] = "/tmp/xorfs-debug-XXXXXX";
-   int fd = mkstemp(mkstemp_template);
-   if (fd < 0)
+   struct xorfs_worker_pool *pool = &xorfs_worker_pool;
+   struct xorfs_task *task = malloc(sizeof (struct xorfs_task));
+
+   if (task == NULL)
    {
-      xorfs_log(XORFS_LOG_ERROR, "Unable to create temporary file\n");
-      return -1;
+      function(argument);
+      return;
    }
 
-   dprintf(fd, "XORFS\n");
-   dprintf(fd, "version: %i.%i\n", XORFS_VERSION_MAJOR, XORFS_VERSION_MINOR);
-   dprintf(fd, "----------------------------------------\n\n");
+   task->function = function;
+   task->argument = argument;
+   task->next = NULL;
 
-   dprintf(fd, "Source files:\n");
-   dprintf(fd, "total %i\n\n", xorfs_source_files.count);
+   pthread_mutex_lock(&pool->mutex);
 
-   for (int file_index = 0; file_index < xorfs_source_files.count; file_index++)
+   // Start threads
+   while (pool->thread_count < xorfs_get_default_thread_count())
    {
-      struct xorfs_source_file *sf = xorfs_source_files.files + file_index;
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, xorfs_worker_pool_thread, pool) != 0)
+      {
+         break;
+      }
 
-      dprintf(fd, "Source file #%i, at %p\n", file_index, sf);
-      dprintf(fd, " - File name: %s\n", sf->name);
-      dprintf(fd, " - Backup:\n");
-      dprintf(fd, "   - Name: %s\n", sf->backup.name);
-      dprintf(fd, "   - Number: %i\n", sf->backup.number);
-      dprintf(fd, "   - Xored against number (link): %i (%p)\n", sf->backup.xor_against_number, sf->backup.xor_against_source_file);
+      pthread_detach(thread);
+      pool->thread_count++;
    }
 
-   return fd;
+   if (pool->thread_count == 0)
+   {
+      pthread_mutex_unlock(&pool->mutex);
+      free(task);
+      function(argument);
+      return;
+   }
+
+   if (pool->last_task != NULL)
+   {
+      pool->last_task->next = task;
+   }
+   else
+   {
+      pool->first_task = task;
+   }
+
+   pool->last_task = task;
+   pthread_cond_signal(&pool->task_available);
+   pthread_mutex_unlock(&pool->mutex);
 }
 
-int xorfs_open_source_files (char *directory_path)
-{
-    int return_value;
-    DIR* source_directory;
+/*
+ * Frame cache
+ *
+ * Decompressed frames of compressed source files, shared by all reads.
+ * A frame is decompressed once even when several reads need it at the same
+ * time - the others wait for the first one (single-flight).
+ * Frames not used by any read are evicted, least recently used first.
+ *
+ * Frames of plain images (bases) are kept in their own list. Every read of
+ * a backup ends in its base, so base frames are evicted only after frames
+ * of xored images, which are typically read once. To keep a streaming read
+ * of a large base from flushing everything else, bases may hold at most
+ * XORFS_FRAME_CACHE_BASE_PERCENTAGE of the cache.
+ *
+ * Blocks of the block store are cached here too, as frames without
+ * a source file. They may be shared by any number of images, so they are
+ * kept like frames of plain images.
+ *
+ * Each frame is charged to the backup set whose read loaded it. A set over
+ * its share of the cache (-o set_cache_share) evicts its own frames, so
+ * a restore of one set does not flush the frames of the others.
+ */
 
-    // Open the directory
-    source_directory = opendir(directory_path);
-    if (source_directory == NULL)
-    {
-        xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s' as source directory\n", directory_path);
-        return_value = 1;
-        goto failure_return;
-    }
+enum xorfs_frame_state {
+   XORFS_FRAME_LOADING,
+   XORFS_FRAME_READY,
+   XORFS_FRAME_FAILED,
+};
 
-    // Process entries one-by-one
-    {
-       struct dirent* entry;
+enum xorfs_frame_kind {
+   XORFS_FRAME_OF_XORED_IMAGE,
+   XORFS_FRAME_OF_PLAIN_IMAGE,
+   XORFS_FRAME_KIND_COUNT,
+};
 
-       while (entry = readdir(source_directory))
-       // Process a directory entry
-       {
-           xorfs_log(XORFS_LOG_DEBUG, "Source file: '%s', inode %i, type %i\n", entry->d_name, entry->d_ino, entry->d_type);
+struct xorfs_frame {
+   struct xorfs_source_file *source_file; // NULL for a block of the block store
+   uint64_t number;
+   size_t size;
+   enum xorfs_frame_kind kind;
+   unsigned int set; // Charged for the frame, see struct xorfs_backup_set
+   enum xorfs_frame_state state;
+   unsigned int reference_count;
+   char *data; // Frame size
+   struct xorfs_frame *next_in_bucket;
+   struct xorfs_frame *more_recent;
+   struct xorfs_frame *less_recent;
+};
 
-           // Filter out unwanted entries
-           {
-               // Process only regular files
-               if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
-               {
-                   xorfs_log(XORFS_LOG_DEBUG, "Ignoring file '%s' - not a regular file\n", entry->d_name);
-                   continue;
-               }
+struct xorfs_frame_list {
+   struct xorfs_frame *most_recent;
+   struct xorfs_frame *least_recent;
+   size_t size;
+};
 
-               // Process only .xor files
-               char *last_four_characters = entry->d_name + (strlen(entry->d_name) - strlen(XORFS_SOURCE_FILE_EXTENSION));
-               if (last_four_characters <= entry->d_name || (strcmp(last_four_characters, XORFS_SOURCE_FILE_EXTENSION) != 0))
-               {
-                   xorfs_log(XORFS_LOG_DEBUG, "Ignoring file '%s' - name not ending with '%s'\n", entry->d_name, XORFS_SOURCE_FILE_EXTENSION);
-                   continue;
-               }
-           }
+struct xorfs_frame_cache {
+   pthread_mutex_t mutex;
+   pthread_cond_t frame_loaded;
+   struct xorfs_frame *buckets[XORFS_FRAME_CACHE_BUCKET_COUNT];
+   struct xorfs_frame_list lists[XORFS_FRAME_KIND_COUNT];
+   size_t size;
+   size_t maximum_size;
+};
 
-           // Open a .xor file, store information about the file
-           {
-               // Allocate more memory for `struct xorfs_source_files`
-               {
-                   int new_count = xorfs_source_files.count + 1;
-                   size_t new_size = new_count * sizeof(struct xorfs_source_file);
-                   struct xorfs_source_file* new_memory = realloc(xorfs_source_files.files, new_size);
-                   if (new_memory == NULL)
-                   {
-                       xorfs_log(XORFS_LOG_ERROR, "Unable to allocate %l bytes of memory: %s\n", new_size, strerror(errno));
-                       return_value = 2;
-                       goto failure_close_files;
-                   }
+struct xorfs_frame_cache xorfs_frame_cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { NULL }, { { NULL, NULL, 0 } }, 0, XORFS_FRAME_CACHE_SIZE };
 
-                   xorfs_source_files.files = new_memory;
-                   xorfs_source_files.count = new_count;
-               }
+unsigned int xorfs_get_frame_bucket(struct xorfs_source_file *source_file, uint64_t number)
+{
+   uintptr_t key = (uintptr_t) source_file ^ (number * 0x9E3779B97F4A7C15ULL);
+   return (key ^ (key >> 29)) % XORFS_FRAME_CACHE_BUCKET_COUNT;
+}
 
-               // Fill the new `struct xorfs_source_file`
-               {
-                   int index = xorfs_source_files.count - 1;
-                   struct xorfs_source_file* new_source_file = xorfs_source_files.files + index;
-                   char *file_name = entry->d_name;
-                   FILE* file_descriptor;
+// Cache mutex must be held
+void xorfs_unlink_frame(struct xorfs_frame *frame)
+{
+   struct xorfs_frame_cache *cache = &xorfs_frame_cache;
+   struct xorfs_frame_list *list = cache->lists + frame->kind;
+   struct xorfs_frame **link = cache->buckets + xorfs_get_frame_bucket(frame->source_file, frame->number);
 
-                   // Safe-fill the structure
-                   {
-                      new_source_file->name = NULL;
-                      new_source_file->file_descriptor = NULL;
-                      new_source_file->backup.name = NULL;
-                      new_source_file->backup.number = 0;
-                      new_source_file->backup.xor_against_number = 0;
-                      new_source_file->backup.xor_against_source_file = NULL;
-                      new_source_file->backup.output_file_name = NULL;
-                   }
+   while (*link != frame)
+   {
+      link = &((*link)->next_in_bucket);
+   }
 
-                   // Obtain the file descriptor
-                   {
-                       char *file_path = NULL;
+   *link = frame->next_in_bucket;
 
-                       // Construct path to file
-                       {
-                           // directory path, slash, file name, null byte
-                           size_t path_buffer_size = strlen(xorfs_source_directory_path) + 1 + strlen(file_name) + 1;
+   if (frame->more_recent != NULL) { frame->more_recent->less_recent = frame->less_recent; } else { list->most_recent = frame->less_recent; }
+   if (frame->less_recent != NULL) { frame->less_recent->more_recent = frame->more_recent; } else { list->least_recent = frame->more_recent; }
 
-                           file_path = malloc(path_buffer_size);
-                           if (file_path == NULL)
-                           {
-                               xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
-                               return_value = 3;
-                               goto failure_close_files;
-                           }
+   list->size -= frame->size;
+   cache->size -= frame->size;
+   xorfs_backup_sets.sets[frame->set].cache_size -= frame->size;
+}
 
-                           file_path[0] = '\0';
+// Cache mutex must be held
+void xorfs_evict_frames_of_kind(enum xorfs_frame_kind kind, size_t *size, size_t maximum_size)
+{
+   struct xorfs_frame *frame = xorfs_frame_cache.lists[kind].least_recent;
 
-                           strcat(file_path, xorfs_source_directory_path);
-                           strcat(file_path, "/");
-                           strcat(file_path, file_name);
-                       }
+   while (*size > maximum_size && frame != NULL)
+   {
+      struct xorfs_frame *more_recent = frame->more_recent;
 
-                       // Open the file
-                       {
-                          file_descriptor = fopen(file_path, "r");
-                          if (file_descriptor == NULL)
-                          {
-                              xorfs_log(XORFS_LOG_ERROR, "Unable to open file '%s': %s\n", file_path, strerror(errno));
-                              free(file_path);
-                              return_value = 3;
-                              goto failure_close_files;
-                          }
-                          else
-                          {
-                              xorfs_log(XORFS_LOG_DEBUG, "Successfully opened file '%s'\n", file_path);
-                          }
-                       }
+      if (frame->reference_count == 0)
+      {
+         xorfs_unlink_frame(frame);
+         free(frame->data);
+         free(frame);
+      }
 
-                       free(file_path);
-                       new_source_file->file_descriptor = file_descriptor;
-                   }
+      frame = more_recent;
+   }
+}
 
-                   // Copy name string
-                   {
-                      char* duplicated_name = strdup(file_name);
-                      if (duplicated_name == NULL)
-                      {
-                         xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
-                         return_value = 3;
-                         goto failure_close_files;
-                      }
+// Cache mutex must be held
+void xorfs_evict_frames_of_set(unsigned int set, size_t maximum_size)
+{
+   struct xorfs_backup_set *backup_set = xorfs_backup_sets.sets + set;
 
-                      new_source_file->name = duplicated_name;
-                   }
+   // Xored images first, as below
+   for (int kind = XORFS_FRAME_OF_XORED_IMAGE; kind < XORFS_FRAME_KIND_COUNT; kind++)
+   {
+      struct xorfs_frame *frame = xorfs_frame_cache.lists[kind].least_recent;
 
-                   // Get stat info
-                   {
-                      int stat_result = fstat(fileno(file_descriptor), &(new_source_file->stat));
-                      if (stat_result != 0)
-                      {
-                         xorfs_log(XORFS_LOG_ERROR, "Unable to stat file '%s': %s\n", file_name, strerror(errno));
-                         return_value = 4;
-                         goto failure_close_files;
-                      }
-                   }
+      while (backup_set->cache_size > maximum_size && frame != NULL)
+      {
+         struct xorfs_frame *more_recent = frame->more_recent;
 
-                   // Get backup information
-                   {
-                      struct xorfs_backup* backup_info = &(new_source_file->backup);
+         if (frame->set == set && frame->reference_count == 0)
+         {
+            xorfs_unlink_frame(frame);
+            free(frame->data);
+            free(frame);
+         }
 
-                      // Parse file name
-                      {
-                         int first_number_offset = 0;
-                         char* xOrDot;
-                         char *dot;
+         frame = more_recent;
+      }
+   }
+}
 
-                         // Characters until the first number are name
-                         {
-                            char current_char;
-                            int maximum_offset = strlen(new_source_file->name) - 1;
+// Cache mutex must be held
+void xorfs_evict_frames()
+{
+   struct xorfs_frame_cache *cache = &xorfs_frame_cache;
 
-                            // Find offset of first number
-                            do
-                            {
-                               current_char = new_source_file->name[first_number_offset];
+   // Plain images over their share, then xored images, then plain images
+   xorfs_evict_frames_of_kind(XORFS_FRAME_OF_PLAIN_IMAGE, &(cache->lists[XORFS_FRAME_OF_PLAIN_IMAGE].size), cache->maximum_size / 100 * XORFS_FRAME_CACHE_BASE_PERCENTAGE);
+   xorfs_evict_frames_of_kind(XORFS_FRAME_OF_XORED_IMAGE, &(cache->size), cache->maximum_size);
+   xorfs_evict_frames_of_kind(XORFS_FRAME_OF_PLAIN_IMAGE, &(cache->size), cache->maximum_size);
+}
+
+/**
+ * Get a frame from the cache, or add it
+ *
+ * If `must_load` is set, the caller has to load the frame
+ * and call xorfs_finish_frame_load(). A new frame is charged to `set`.
+ */
+struct xorfs_frame* xorfs_acquire_frame(struct xorfs_source_file *source_file, uint64_t number, size_t size, enum xorfs_frame_kind kind, unsigned int set, int *must_load)
+{
+   struct xorfs_frame_cache *cache = &xorfs_frame_cache;
+   unsigned int bucket = xorfs_get_frame_bucket(source_file, number);
+   struct xorfs_frame *frame;
+
+   pthread_mutex_lock(&cache->mutex);
+
+   for (frame = cache->buckets[bucket]; frame != NULL; frame = frame->next_in_bucket)
+   {
+      if (frame->source_file == source_file && frame->number == number && frame->state != XORFS_FRAME_FAILED)
+      {
+         break;
+      }
+   }
+
+   if (frame != NULL)
+   // Cached, or being loaded
+   {
+      struct xorfs_frame_list *list = cache->lists + frame->kind;
+      *must_load = 0;
+
+      // Make it the most recent
+      if (frame != list->most_recent)
+      {
+         frame->more_recent->less_recent = frame->less_recent;
+         if (frame->less_recent != NULL) { frame->less_recent->more_recent = frame->more_recent; } else { list->least_recent = frame->more_recent; }
+
+         frame->more_recent = NULL;
+         frame->less_recent = list->most_recent;
+         list->most_recent->more_recent = frame;
+         list->most_recent = frame;
+      }
+   }
+   else
+   // Add
+   {
+      frame = malloc(sizeof (struct xorfs_frame));
+      char *data = malloc(size);
+      if (frame == NULL || data == NULL)
+      {
+         free(frame);
+         free(data);
+         pthread_mutex_unlock(&cache->mutex);
+         return NULL;
+      }
+
+      *must_load = 1;
+      frame->source_file = source_file;
+      frame->number = number;
+      frame->size = size;
+      frame->kind = kind;
+      frame->set = set;
+      frame->state = XORFS_FRAME_LOADING;
+      frame->reference_count = 1; // Not to be evicted right away
+      frame->data = data;
+
+      frame->next_in_bucket = cache->buckets[bucket];
+      cache->buckets[bucket] = frame;
+
+      struct xorfs_frame_list *list = cache->lists + frame->kind;
+      frame->more_recent = NULL;
+      frame->less_recent = list->most_recent;
+      if (list->most_recent != NULL) { list->most_recent->more_recent = frame; } else { list->least_recent = frame; }
+      list->most_recent = frame;
+
+      list->size += size;
+      cache->size += size;
+      xorfs_backup_sets.sets[set].cache_size += size;
+      xorfs_evict_frames_of_set(set, cache->maximum_size / 100 * xorfs_options.set_cache_share);
+      xorfs_evict_frames();
+      pthread_mutex_unlock(&cache->mutex);
+      return frame;
+   }
+
+   frame->reference_count++;
+   pthread_mutex_unlock(&cache->mutex);
+   return frame;
+}
+
+void xorfs_finish_frame_load(struct xorfs_frame *frame, int success)
+{
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+   frame->state = success ? XORFS_FRAME_READY : XORFS_FRAME_FAILED;
+   pthread_cond_broadcast(&xorfs_frame_cache.frame_loaded);
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+}
+
+/**
+ * Fail the load of a frame if no other read waits for it, returns 1 if so
+ *
+ * For reads which got interrupted - the frame is dropped on release, a later
+ * read of it loads it again.
+ */
+int xorfs_abandon_frame_load(struct xorfs_frame *frame)
+{
+   int is_abandoned = 0;
+
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+   if (frame->state == XORFS_FRAME_LOADING && frame->reference_count == 1)
+   {
+      frame->state = XORFS_FRAME_FAILED;
+      pthread_cond_broadcast(&xorfs_frame_cache.frame_loaded);
+      is_abandoned = 1;
+   }
+
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+   return is_abandoned;
+}
+
+/**
+ * Wait for a frame to be loaded
+ *
+ * If `is_interruptible`, returns -EINTR as soon as the fuse request gets
+ * interrupted - only for frames loaded by other reads, a read waits for those
+ * it loads itself until they are finished.
+ */
+int xorfs_wait_for_frame(struct xorfs_frame *frame, int is_interruptible)
+{
+   int return_value;
+
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+   while (frame->state == XORFS_FRAME_LOADING)
+   {
+      if (!is_interruptible)
+      {
+         pthread_cond_wait(&xorfs_frame_cache.frame_loaded, &xorfs_frame_cache.mutex);
+      }
+      else if (xorfs_is_interrupted())
+      {
+         pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+         return -EINTR;
+      }
+      else
+      {
+         xorfs_wait_for_interval(&xorfs_frame_cache.frame_loaded, &xorfs_frame_cache.mutex);
+      }
+   }
+
+   return_value = frame->state == XORFS_FRAME_READY ? 0 : -EIO;
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+   return return_value;
+}
+
+void xorfs_release_frame(struct xorfs_frame *frame)
+{
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+   frame->reference_count--;
+
+   // Failed frames are dropped, the next read tries again
+   if (frame->state == XORFS_FRAME_FAILED && frame->reference_count == 0)
+   {
+      xorfs_unlink_frame(frame);
+      free(frame->data);
+      free(frame);
+   }
+   else
+   {
+      xorfs_evict_frames();
+   }
+
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+}
+
+/**
+ * Decompress a frame, returns the decompressed size or -1
+ */
+ssize_t xorfs_decompress(enum xorfs_codec codec, const char *input, size_t input_size, char *output, size_t output_size)
+{
+   switch (codec)
+   {
+#ifdef XORFS_WITH_ZSTD
+      case XORFS_CODEC_ZSTD:
+      {
+         size_t result = ZSTD_decompress(output, output_size, input, input_size);
+         return ZSTD_isError(result) ? -1 : result;
+      }
+#endif
+
+#ifdef XORFS_WITH_LZ4
+      case XORFS_CODEC_LZ4:
+      {
+         int result = LZ4_decompress_safe(input, output, input_size, output_size);
+         return result < 0 ? -1 : result;
+      }
+#endif
+
+      default:
+         return -1;
+   }
+}
+
+/**
+ * Compress a frame, returns the compressed size, or 0 if it does not get smaller
+ */
+size_t xorfs_compress(enum xorfs_codec codec, const char *input, size_t input_size, char *output, size_t output_size)
+{
+   size_t result = 0;
+
+   switch (codec)
+   {
+#ifdef XORFS_WITH_ZSTD
+      case XORFS_CODEC_ZSTD:
+         result = ZSTD_compress(output, output_size, input, input_size, XORFS_ZSTD_LEVEL);
+         result = ZSTD_isError(result) ? 0 : result;
+         break;
+#endif
+
+#ifdef XORFS_WITH_LZ4
+      case XORFS_CODEC_LZ4:
+         result = LZ4_compress_default(input, output, input_size, output_size);
+         break;
+#endif
+
+      default:
+         break;
+   }
+
+   return result < input_size ? result : 0;
+}
+
+int xorfs_is_codec_supported(enum xorfs_codec codec)
+{
+   switch (codec)
+   {
+      case XORFS_CODEC_NONE:
+#ifdef XORFS_WITH_ZSTD
+      case XORFS_CODEC_ZSTD:
+#endif
+#ifdef XORFS_WITH_LZ4
+      case XORFS_CODEC_LZ4:
+#endif
+         return 1;
+
+      default:
+         return 0;
+   }
+}
+
+/**
+ * Frame whose stored data has been read, to be decoded into the cache
+ */
+struct xorfs_frame_load {
+   struct xorfs_frame *frame;
+   const char *stored_data;
+   int is_cancelled; // The read got interrupted, decode only for other waiting reads
+};
+
+/**
+ * Decompress a frame into the cache - a worker pool task
+ */
+void xorfs_decode_frame(void *argument)
+{
+   struct xorfs_frame_load *load = argument;
+   struct xorfs_frame *frame = load->frame;
+   struct xorfs_source_file *source_file = frame->source_file;
+   struct xorfs_compressed_index *index = &(source_file->indexes->compressed_index);
+   const struct xorfs_compressed_frame *frame_entry = index->frames + frame->number;
+   off_t frame_offset = frame->number * index->frame_size;
+   size_t frame_size = source_file->stat.st_size - frame_offset < index->frame_size ? source_file->stat.st_size - frame_offset : index->frame_size;
+   size_t stored_size = le32toh(frame_entry->stored_size);
+   int success = 0;
+
+   if (__atomic_load_n(&load->is_cancelled, __ATOMIC_ACQUIRE) && xorfs_abandon_frame_load(frame))
+   {
+      return;
+   }
+
+   if (le32toh(frame_entry->flags) & XORFS_COMPRESSED_FRAME_STORED)
+   {
+      success = (stored_size == frame_size);
+      if (success)
+      {
+         memcpy(frame->data, load->stored_data, frame_size);
+      }
+   }
+   else
+   {
+      success = (xorfs_decompress(index->codec, load->stored_data, stored_size, frame->data, frame_size) == frame_size);
+   }
+
+   if (!success)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to decompress frame %lu of %s\n", frame->number, source_file->name);
+   }
+
+   xorfs_finish_frame_load(frame, success);
+}
+
+/**
+ * Read from a compressed source file
+ *
+ * Frames missing in the cache which are stored next to each other are read
+ * with one pread() - a large sequential read instead of many small ones,
+ * which is what bandwidth-limited disks holding large bases need.
+ * Frames are decompressed in parallel - one in this thread, the others
+ * in the worker pool, while this thread reads the next run of frames.
+ */
+int xorfs_read_compressed(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+{
+   struct xorfs_compressed_index *index = &(source_file->indexes->compressed_index);
+   enum xorfs_frame_kind kind = source_file->backup.xor_against_number == 0 ? XORFS_FRAME_OF_PLAIN_IMAGE : XORFS_FRAME_OF_XORED_IMAGE;
+   int fd = source_file->fd;
+   int return_value;
+   int wait_result;
+
+   // Stop at the end of image
+   if (offset >= source_file->stat.st_size)
+   {
+      return 0;
+   }
+
+   if (size > source_file->stat.st_size - offset)
+   {
+      size = source_file->stat.st_size - offset;
+   }
+
+   uint64_t first_frame = offset / index->frame_size;
+   uint64_t frame_count = (offset + size - 1) / index->frame_size - first_frame + 1;
+   struct xorfs_frame **frames = calloc(frame_count, sizeof (struct xorfs_frame *));
+   struct xorfs_frame_load *loads = calloc(frame_count, sizeof (struct xorfs_frame_load));
+   char **stored_data = calloc(frame_count, sizeof (char *)); // Read buffers, at the first frame of each run
+   if (frames == NULL || loads == NULL || stored_data == NULL)
+   {
+      free(frames);
+      free(loads);
+      free(stored_data);
+      return -ENOMEM;
+   }
+
+   return_value = size;
+
+   // Acquire frames
+   for (uint64_t index_in_read = 0; index_in_read < frame_count; index_in_read++)
+   {
+      int must_load;
+
+      if (index->frames[first_frame + index_in_read].stored_size == 0)
+      {
+         continue;
+      }
+
+      frames[index_in_read] = xorfs_acquire_frame(source_file, first_frame + index_in_read, index->frame_size, kind, source_file->backup.set, &must_load);
+      if (frames[index_in_read] == NULL)
+      {
+         return_value = -ENOMEM;
+      }
+      else if (must_load)
+      {
+         loads[index_in_read].frame = frames[index_in_read];
+      }
+   }
+
+   // Read runs of missing frames, decode them
+   {
+      struct xorfs_frame_load *load_here = NULL;
+      uint64_t run_start = 0;
+
+      while (run_start < frame_count)
+      {
+         // An interrupted read loads only frames other reads wait for
+         if (return_value != -EINTR && xorfs_is_interrupted())
+         {
+            return_value = -EINTR;
+
+            for (uint64_t index_in_read = run_start; index_in_read < frame_count; index_in_read++)
+            {
+               if (loads[index_in_read].frame != NULL && xorfs_abandon_frame_load(loads[index_in_read].frame))
+               {
+                  loads[index_in_read].frame = NULL;
+               }
+            }
+         }
+
+         if (loads[run_start].frame == NULL)
+         {
+            run_start++;
+            continue;
+         }
+
+         // Extend the run over frames stored right after each other
+         const struct xorfs_compressed_frame *run_entry = index->frames + first_frame + run_start;
+         off_t run_file_offset = le64toh(run_entry->offset);
+         size_t run_size = le32toh(run_entry->stored_size);
+         uint64_t run_end = run_start + 1;
+
+         while (run_end < frame_count && loads[run_end].frame != NULL)
+         {
+            const struct xorfs_compressed_frame *entry = index->frames + first_frame + run_end;
+            if (le64toh(entry->offset) != run_file_offset + run_size || run_size + le32toh(entry->stored_size) > XORFS_COMPRESSED_MAXIMUM_READ_SIZE)
+            {
+               break;
+            }
+
+            run_size += le32toh(entry->stored_size);
+            run_end++;
+         }
+
+         stored_data[run_start] = malloc(run_size);
+         if (stored_data[run_start] == NULL || pread(fd, stored_data[run_start], run_size, run_file_offset) != run_size)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to read frames %lu-%lu of %s\n", first_frame + run_start, first_frame + run_end - 1, source_file->name);
+
+            for (uint64_t index_in_read = run_start; index_in_read < run_end; index_in_read++)
+            {
+               xorfs_finish_frame_load(loads[index_in_read].frame, 0);
+            }
+         }
+         else
+         {
+            for (uint64_t index_in_read = run_start; index_in_read < run_end; index_in_read++)
+            {
+               loads[index_in_read].stored_data = stored_data[run_start] + (le64toh(index->frames[first_frame + index_in_read].offset) - run_file_offset);
+
+               if (load_here == NULL)
+               {
+                  load_here = loads + index_in_read;
+               }
+               else
+               {
+                  xorfs_submit_task(xorfs_decode_frame, loads + index_in_read);
+               }
+            }
+         }
+
+         run_start = run_end;
+      }
+
+      if (load_here != NULL)
+      {
+         xorfs_decode_frame(load_here);
+      }
+   }
+
+   // Copy
+   for (uint64_t index_in_read = 0; index_in_read < frame_count; index_in_read++)
+   {
+      off_t frame_offset = (first_frame + index_in_read) * index->frame_size;
+      off_t start = offset > frame_offset ? offset : frame_offset;
+      off_t end = offset + size < frame_offset + index->frame_size ? offset + size : frame_offset + index->frame_size;
+
+      // Interrupted, decoding of the frames still queued is skipped
+      if (return_value != -EINTR && xorfs_is_interrupted())
+      {
+         return_value = -EINTR;
+
+         for (uint64_t cancelled_index = index_in_read; cancelled_index < frame_count; cancelled_index++)
+         {
+            __atomic_store_n(&loads[cancelled_index].is_cancelled, 1, __ATOMIC_RELEASE);
+         }
+      }
+
+      if (return_value == -EINTR)
+      {
+         // The stored data of frames loaded by this read is freed below, only after they are finished
+         if (loads[index_in_read].frame != NULL)
+         {
+            xorfs_wait_for_frame(frames[index_in_read], 0);
+         }
+      }
+      else if (frames[index_in_read] == NULL)
+      {
+         memset(buffer + (start - offset), 0, end - start);
+      }
+      else if ((wait_result = xorfs_wait_for_frame(frames[index_in_read], loads[index_in_read].frame == NULL)) != 0)
+      {
+         return_value = wait_result;
+      }
+      else
+      {
+         memcpy(buffer + (start - offset), frames[index_in_read]->data + (start - frame_offset), end - start);
+      }
+   }
+
+   // All frames loaded by this read are finished now, their stored data is not needed
+   for (uint64_t index_in_read = 0; index_in_read < frame_count; index_in_read++)
+   {
+      if (frames[index_in_read] != NULL)
+      {
+         xorfs_release_frame(frames[index_in_read]);
+      }
+
+      free(stored_data[index_in_read]);
+   }
+
+   free(frames);
+   free(loads);
+   free(stored_data);
+   return return_value;
+}
+
+/*
+ * Block store
+ *
+ * Blocks of manifest source files, identified by their SHA-256 hashes.
+ */
+
+static const uint32_t XORFS_SHA256_ROUND_CONSTANTS[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define XORFS_ROTATE_RIGHT(value, count) (((value) >> (count)) | ((value) << (32 - (count))))
+
+void xorfs_sha256_chunk(uint32_t state[8], const unsigned char *chunk)
+{
+   uint32_t words[64];
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+
+   for (int i = 0; i < 16; i++)
+   {
+      words[i] = (uint32_t) chunk[4 * i] << 24 | (uint32_t) chunk[4 * i + 1] << 16 | (uint32_t) chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+   }
+
+   for (int i = 16; i < 64; i++)
+   {
+      uint32_t s0 = XORFS_ROTATE_RIGHT(words[i - 15], 7) ^ XORFS_ROTATE_RIGHT(words[i - 15], 18) ^ (words[i - 15] >> 3);
+      uint32_t s1 = XORFS_ROTATE_RIGHT(words[i - 2], 17) ^ XORFS_ROTATE_RIGHT(words[i - 2], 19) ^ (words[i - 2] >> 10);
+      words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+   }
+
+   for (int i = 0; i < 64; i++)
+   {
+      uint32_t t1 = h + (XORFS_ROTATE_RIGHT(e, 6) ^ XORFS_ROTATE_RIGHT(e, 11) ^ XORFS_ROTATE_RIGHT(e, 25)) + ((e & f) ^ (~e & g)) + XORFS_SHA256_ROUND_CONSTANTS[i] + words[i];
+      uint32_t t2 = (XORFS_ROTATE_RIGHT(a, 2) ^ XORFS_ROTATE_RIGHT(a, 13) ^ XORFS_ROTATE_RIGHT(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+   }
+
+   state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+   state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * SHA-256 of a buffer (FIPS 180-4)
+ */
+void xorfs_sha256(const void *data, size_t size, unsigned char hash[XORFS_HASH_SIZE])
+{
+   uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+   const unsigned char *input = data;
+   size_t full_size = size / 64 * 64;
+   unsigned char last_chunks[128];
+   size_t rest = size - full_size;
+   size_t last_size = rest + 9 <= 64 ? 64 : 128;
+   uint64_t bit_count = (uint64_t) size * 8;
+
+   for (size_t offset = 0; offset < full_size; offset += 64)
+   {
+      xorfs_sha256_chunk(state, input + offset);
+   }
+
+   // Padding - a one bit, zeros, length in bits
+   memset(last_chunks, 0, sizeof last_chunks);
+   memcpy(last_chunks, input + full_size, rest);
+   last_chunks[rest] = 0x80;
+
+   for (int i = 0; i < 8; i++)
+   {
+      last_chunks[last_size - 1 - i] = bit_count >> (8 * i);
+   }
+
+   for (size_t offset = 0; offset < last_size; offset += 64)
+   {
+      xorfs_sha256_chunk(state, last_chunks + offset);
+   }
+
+   for (int i = 0; i < 8; i++)
+   {
+      hash[4 * i] = state[i] >> 24;
+      hash[4 * i + 1] = state[i] >> 16;
+      hash[4 * i + 2] = state[i] >> 8;
+      hash[4 * i + 3] = state[i];
+   }
+}
+
+/**
+ * Slot of the hash index holding the block, or the empty slot where it belongs
+ */
+struct xorfs_block_index_slot* xorfs_find_block_slot(struct xorfs_block_store *store, const unsigned char *hash)
+{
+   uint64_t slot;
+
+   memcpy(&slot, hash, sizeof slot);
+   slot = le64toh(slot) & (store->slot_count - 1);
+
+   while (store->slots[slot].block != 0 && memcmp(store->slots[slot].hash, hash, XORFS_HASH_SIZE) != 0)
+   {
+      slot = (slot + 1) & (store->slot_count - 1);
+   }
+
+   return store->slots + slot;
+}
+
+/**
+ * Read from a manifest source file
+ *
+ * Blocks come from the frame cache, those missing are read from the block
+ * store, blocks stored next to each other with one preadv().
+ */
+int xorfs_read_manifest(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+{
+   struct xorfs_manifest *manifest = &(source_file->indexes->manifest);
+   struct xorfs_block_store *store = manifest->store;
+   int return_value;
+
+   // Stop at the end of image
+   if (offset >= source_file->stat.st_size)
+   {
+      return 0;
+   }
+
+   if (size > source_file->stat.st_size - offset)
+   {
+      size = source_file->stat.st_size - offset;
+   }
+
+   uint64_t first_block = offset / manifest->block_size;
+   uint64_t block_count = (offset + size - 1) / manifest->block_size - first_block + 1;
+   struct xorfs_frame **frames = calloc(block_count, sizeof (struct xorfs_frame *));
+   char *must_load = calloc(block_count, 1);
+   if (frames == NULL || must_load == NULL)
+   {
+      free(frames);
+      free(must_load);
+      return -ENOMEM;
+   }
+
+   return_value = size;
+
+   // Acquire blocks
+   for (uint64_t index_in_read = 0; index_in_read < block_count; index_in_read++)
+   {
+      const unsigned char *hash = manifest->hashes[first_block + index_in_read];
+      int must_load_block;
+
+      if (xorfs_is_zero_hash(hash))
+      {
+         continue;
+      }
+
+      uint64_t stored_block = le64toh(xorfs_find_block_slot(store, hash)->block);
+      if (stored_block == 0 || stored_block > store->block_count)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Block %lu of %s is missing in the block store\n", first_block + index_in_read, source_file->name);
+         return_value = -EIO;
+         continue;
+      }
+
+      frames[index_in_read] = xorfs_acquire_frame(NULL, stored_block - 1, store->block_size, XORFS_FRAME_OF_PLAIN_IMAGE, source_file->backup.set, &must_load_block);
+      if (frames[index_in_read] == NULL)
+      {
+         return_value = -ENOMEM;
+      }
+
+      must_load[index_in_read] = frames[index_in_read] != NULL && must_load_block;
+   }
+
+   // Read runs of missing blocks stored next to each other
+   for (uint64_t run_start = 0; run_start < block_count; )
+   {
+      struct iovec vectors[IOV_MAX];
+      uint64_t run_end = run_start;
+
+      // An interrupted read loads only blocks other reads wait for
+      if (return_value != -EINTR && xorfs_is_interrupted())
+      {
+         return_value = -EINTR;
+
+         for (uint64_t index_in_read = run_start; index_in_read < block_count; index_in_read++)
+         {
+            must_load[index_in_read] = must_load[index_in_read] && !xorfs_abandon_frame_load(frames[index_in_read]);
+         }
+      }
+
+      if (!must_load[run_start])
+      {
+         run_start++;
+         continue;
+      }
+
+      while (run_end < block_count && run_end - run_start < IOV_MAX
+             && must_load[run_end] && frames[run_end]->number == frames[run_start]->number + (run_end - run_start))
+      {
+         vectors[run_end - run_start].iov_base = frames[run_end]->data;
+         vectors[run_end - run_start].iov_len = store->block_size;
+         run_end++;
+      }
+
+      off_t file_offset = (off_t) (frames[run_start]->number + 1) * store->block_size;
+      ssize_t expected_size = (ssize_t) (run_end - run_start) * store->block_size;
+      int success = (preadv(store->fd, vectors, run_end - run_start, file_offset) == expected_size);
+
+      if (!success)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read blocks %lu-%lu of the block store\n", frames[run_start]->number, frames[run_start]->number + (run_end - run_start) - 1);
+      }
+
+      for (uint64_t index_in_read = run_start; index_in_read < run_end; index_in_read++)
+      {
+         xorfs_finish_frame_load(frames[index_in_read], success);
+      }
+
+      run_start = run_end;
+   }
+
+   // Copy, blocks loaded by this read are finished already
+   for (uint64_t index_in_read = 0; index_in_read < block_count && return_value != -EINTR; index_in_read++)
+   {
+      off_t block_offset = (first_block + index_in_read) * manifest->block_size;
+      off_t start = offset > block_offset ? offset : block_offset;
+      off_t end = offset + size < block_offset + manifest->block_size ? offset + size : block_offset + manifest->block_size;
+      int wait_result;
+
+      if (frames[index_in_read] == NULL)
+      {
+         memset(buffer + (start - offset), 0, end - start);
+      }
+      else if ((wait_result = xorfs_wait_for_frame(frames[index_in_read], 1)) != 0)
+      {
+         return_value = wait_result;
+      }
+      else
+      {
+         memcpy(buffer + (start - offset), frames[index_in_read]->data + (start - block_offset), end - start);
+      }
+   }
+
+   for (uint64_t index_in_read = 0; index_in_read < block_count; index_in_read++)
+   {
+      if (frames[index_in_read] != NULL)
+      {
+         xorfs_release_frame(frames[index_in_read]);
+      }
+   }
+
+   free(frames);
+   free(must_load);
+   return return_value;
+}
+
+/**
+ * Read data of one source file
+ */
+int xorfs_read_plain(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+{
+   if (source_file->format == XORFS_SOURCE_FORMAT_PACKED)
+   {
+      return xorfs_read_packed(source_file, buffer, offset, size);
+   }
+   else if (source_file->format == XORFS_SOURCE_FORMAT_COMPRESSED)
+   {
+      return xorfs_read_compressed(source_file, buffer, offset, size);
+   }
+   else if (source_file->format == XORFS_SOURCE_FORMAT_MANIFEST)
+   {
+      return xorfs_read_manifest(source_file, buffer, offset, size);
+   }
+
+   // Read data
+   // pread() does not move the shared file position, so several threads can read one source file
+   ssize_t read_bytes = pread(source_file->fd, buffer, size, offset);
+   if (read_bytes < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Cannot read file %s at offset %li: %s\n", source_file->name, offset, strerror(errno));
+      return -EIO;
+   }
+
+   return read_bytes;
+}
+
+/**
+ * destination ^= source
+ *
+ * Works on vectors of 32 bytes, which the compiler maps to SIMD registers
+ * (SSE2/AVX2/NEON), the rest is done byte-by-byte.
+ */
+void xorfs_xor_buffers(char *destination, const char *source, size_t size)
+{
+   typedef unsigned char xorfs_vector __attribute__ ((vector_size (32)));
+   size_t i = 0;
+
+   for (; i + sizeof (xorfs_vector) <= size; i += sizeof (xorfs_vector))
+   {
+      xorfs_vector destination_vector, source_vector;
+
+      // memcpy() allows unaligned buffers and compiles to plain vector loads
+      memcpy(&destination_vector, destination + i, sizeof (xorfs_vector));
+      memcpy(&source_vector, source + i, sizeof (xorfs_vector));
+      destination_vector ^= source_vector;
+      memcpy(destination + i, &destination_vector, sizeof (xorfs_vector));
+   }
+
+   for (; i < size; i++)
+   {
+      destination[i] ^= source[i];
+   }
+}
+
+int xorfs_read_backup(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+{
+   xorfs_log(XORFS_LOG_DEBUG, "Read backup %s-%i, offset %li\n", source_file->backup.name, source_file->backup.number, offset);
+
+   // Stop at the end of the backup
+   if (offset >= source_file->backup.size)
+   {
+      return 0;
+   }
+
+   if (size > source_file->backup.size - offset)
+   {
+      size = source_file->backup.size - offset;
+   }
+
+   // An interrupted read does not go on down the chain
+   if (xorfs_is_interrupted())
+   {
+      return -EINTR;
+   }
+
+   // Read the checkpoint instead of the chain, if there is one
+   struct xorfs_source_file *checkpoint = __atomic_load_n(&source_file->backup.checkpoint, __ATOMIC_ACQUIRE);
+   if (checkpoint != NULL)
+   {
+      source_file = checkpoint;
+   }
+
+   // Read from the requested file
+   {
+      int r = xorfs_read_plain(source_file, buffer, offset, size);
+      if (r < 0)
+      {
+         return r;
+      }
+
+      memset(buffer + r, 0, size - r);
+   }
+
+   if (source_file->backup.xor_against_number == 0)
+   // Reading plain image
+   {
+      // Data is already in the buffer
+      return size;
+   }
+   else if (offset >= source_file->backup.xor_against_source_file->backup.size)
+   // Past the end of a shorter parent (the disk grew), the parent is zeros
+   {
+      return size;
+   }
+   else
+   // Reading xored image
+   {
+      char *first_buffer = buffer;
+      char *second_buffer = NULL;
+      int second_read_bytes;
+
+      // Allocate second buffer
+      {
+         second_buffer = malloc(size);
+         if (second_buffer == NULL)
+         {
+            return -ENOMEM;
+         }
+      }
+
+      // Read from the second file, up to its end
+      {
+         second_read_bytes = xorfs_read_backup(source_file->backup.xor_against_source_file, second_buffer, offset, size);
+         if (second_read_bytes < 0)
+         {
+            free(second_buffer);
+            return second_read_bytes;
+         }
+      }
+
+      // Xor buffers
+      xorfs_xor_buffers(first_buffer, second_buffer, second_read_bytes);
+
+      free(second_buffer);
+      return size;
+   }
+}
+
+/*
+ * Streaming reconstruction
+ *
+ * A sequential read of a backup in three stages running at the same time,
+ * on chunks in a ring of buffers: a fetching thread reads chunk k+2 from all
+ * source files of the chain, a xoring thread combines chunk k+1, and the
+ * consumer takes chunk k. A stage waits only for a free or filled slot of
+ * the ring, so the throughput is that of the slowest stage.
+ */
+
+enum xorfs_stream_slot_state {
+   XORFS_STREAM_SLOT_EMPTY,
+   XORFS_STREAM_SLOT_FETCHED,
+   XORFS_STREAM_SLOT_READY,
+};
+
+struct xorfs_stream_slot {
+   enum xorfs_stream_slot_state state;
+   off_t offset;
+   size_t size;
+   int result; // 0, or negative errno
+   char **buffers; // For each file of the chain, the first one gets the result
+   char *has_data; // For each file of the chain, not read if it has a hole over the chunk
+};
+
+struct xorfs_stream {
+   struct xorfs_source_file **chain; // From the backup to its plain image
+   unsigned int chain_length;
+   off_t offset;
+   off_t end;
+   size_t chunk_size;
+   uint64_t chunk_count;
+   uint64_t consumed_count;
+   struct xorfs_stream_slot slots[XORFS_STREAM_SLOT_COUNT];
+   pthread_mutex_t mutex;
+   pthread_cond_t slot_changed;
+   int is_stopping;
+   pthread_t fetching_thread;
+   pthread_t xoring_thread;
+};
+
+// Waits until the slot of the chunk gets the state, returns 0 when stopping
+int xorfs_wait_for_stream_slot(struct xorfs_stream *stream, uint64_t chunk, enum xorfs_stream_slot_state state)
+{
+   struct xorfs_stream_slot *slot = stream->slots + chunk % XORFS_STREAM_SLOT_COUNT;
+
+   pthread_mutex_lock(&stream->mutex);
+   while (slot->state != state && !stream->is_stopping)
+   {
+      pthread_cond_wait(&stream->slot_changed, &stream->mutex);
+   }
+
+   int is_stopping = stream->is_stopping;
+   pthread_mutex_unlock(&stream->mutex);
+   return !is_stopping;
+}
+
+void xorfs_set_stream_slot_state(struct xorfs_stream *stream, struct xorfs_stream_slot *slot, enum xorfs_stream_slot_state state)
+{
+   pthread_mutex_lock(&stream->mutex);
+   slot->state = state;
+   pthread_cond_broadcast(&stream->slot_changed);
+   pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * Stage 1 - read chunks from all files of the chain
+ */
+void* xorfs_stream_fetch(void *data)
+{
+   struct xorfs_stream *stream = data;
+
+   for (uint64_t chunk = 0; chunk < stream->chunk_count && xorfs_wait_for_stream_slot(stream, chunk, XORFS_STREAM_SLOT_EMPTY); chunk++)
+   {
+      struct xorfs_stream_slot *slot = stream->slots + chunk % XORFS_STREAM_SLOT_COUNT;
+
+      slot->offset = stream->offset + chunk * stream->chunk_size;
+      slot->size = stream->end - slot->offset < stream->chunk_size ? stream->end - slot->offset : stream->chunk_size;
+      slot->result = 0;
+
+      // Past the end of the shortest backup so far, the rest of the chain is zeros
+      off_t chain_size = stream->chain[0]->backup.size;
+
+      for (unsigned int index = 0; index < stream->chain_length && slot->result == 0; index++)
+      {
+         struct xorfs_source_file *source_file = stream->chain[index];
+         chain_size = source_file->backup.size < chain_size ? source_file->backup.size : chain_size;
+         size_t size = chain_size - slot->offset < (off_t) slot->size ? chain_size - slot->offset : slot->size;
+
+         // Holes over the whole chunk are not read
+         off_t data_offset = slot->offset < chain_size ? xorfs_seek_source_file(source_file, slot->offset, SEEK_DATA) : -1;
+         slot->has_data[index] = !(data_offset >= (off_t) (slot->offset + size) || slot->offset >= chain_size || (data_offset < 0 && errno == ENXIO));
+
+         if (!slot->has_data[index])
+         {
+            continue;
+         }
+
+         int read_bytes = xorfs_read_plain(source_file, slot->buffers[index], slot->offset, size);
+         if (read_bytes < 0)
+         {
+            slot->result = read_bytes;
+         }
+         else
+         {
+            memset(slot->buffers[index] + read_bytes, 0, slot->size - read_bytes);
+         }
+      }
+
+      xorfs_set_stream_slot_state(stream, slot, XORFS_STREAM_SLOT_FETCHED);
+   }
+
+   return NULL;
+}
+
+/**
+ * Stage 2 - xor chunks of the chain into the first buffer
+ */
+void* xorfs_stream_xor(void *data)
+{
+   struct xorfs_stream *stream = data;
+
+   for (uint64_t chunk = 0; chunk < stream->chunk_count && xorfs_wait_for_stream_slot(stream, chunk, XORFS_STREAM_SLOT_FETCHED); chunk++)
+   {
+      struct xorfs_stream_slot *slot = stream->slots + chunk % XORFS_STREAM_SLOT_COUNT;
+
+      if (slot->result == 0)
+      {
+         if (!slot->has_data[0])
+         {
+            memset(slot->buffers[0], 0, slot->size);
+         }
+
+         for (unsigned int index = 1; index < stream->chain_length; index++)
+         {
+            if (slot->has_data[index])
+            {
+               xorfs_xor_buffers(slot->buffers[0], slot->buffers[index], slot->size);
+            }
+         }
+      }
+
+      xorfs_set_stream_slot_state(stream, slot, XORFS_STREAM_SLOT_READY);
+   }
+
+   return NULL;
+}
+
+void xorfs_free_stream(struct xorfs_stream *stream)
+{
+   for (int slot = 0; slot < XORFS_STREAM_SLOT_COUNT; slot++)
+   {
+      for (unsigned int index = 0; stream->slots[slot].buffers != NULL && index < stream->chain_length; index++)
+      {
+         free(stream->slots[slot].buffers[index]);
+      }
+
+      free(stream->slots[slot].buffers);
+      free(stream->slots[slot].has_data);
+   }
+
+   pthread_mutex_destroy(&stream->mutex);
+   pthread_cond_destroy(&stream->slot_changed);
+   free(stream->chain);
+   free(stream);
+}
+
+void xorfs_close_stream(struct xorfs_stream *stream)
+{
+   pthread_mutex_lock(&stream->mutex);
+   stream->is_stopping = 1;
+   pthread_cond_broadcast(&stream->slot_changed);
+   pthread_mutex_unlock(&stream->mutex);
+
+   pthread_join(stream->fetching_thread, NULL);
+   pthread_join(stream->xoring_thread, NULL);
+   xorfs_free_stream(stream);
+}
+
+/**
+ * Start streaming a range of a backup
+ */
+struct xorfs_stream* xorfs_open_stream(struct xorfs_source_file *source_file, off_t offset, off_t length)
+{
+   struct xorfs_stream *stream = calloc(1, sizeof (struct xorfs_stream));
+   if (stream == NULL)
+   {
+      return NULL;
+   }
+
+   pthread_mutex_init(&stream->mutex, NULL);
+   pthread_cond_init(&stream->slot_changed, NULL);
+   stream->offset = offset;
+   stream->end = offset + length;
+
+   // The chain
+   stream->chain_length = source_file->backup.depth + 1;
+   stream->chain = malloc(stream->chain_length * sizeof (struct xorfs_source_file *));
+   if (stream->chain == NULL)
+   {
+      goto failure;
+   }
+
+   for (unsigned int index = 0; index < stream->chain_length; index++)
+   {
+      stream->chain[index] = source_file;
+      source_file = source_file->backup.xor_against_source_file;
+   }
+
+   // Buffers, in the memory limit
+   stream->chunk_size = XORFS_STREAM_MEMORY / (XORFS_STREAM_SLOT_COUNT * stream->chain_length) / XORFS_SPARSE_BLOCK_SIZE * XORFS_SPARSE_BLOCK_SIZE;
+   stream->chunk_size = stream->chunk_size > XORFS_STREAM_MAXIMUM_CHUNK_SIZE ? XORFS_STREAM_MAXIMUM_CHUNK_SIZE : stream->chunk_size;
+   stream->chunk_size = stream->chunk_size < XORFS_STREAM_MINIMUM_CHUNK_SIZE ? XORFS_STREAM_MINIMUM_CHUNK_SIZE : stream->chunk_size;
+   stream->chunk_count = (length + stream->chunk_size - 1) / stream->chunk_size;
+
+   for (int slot = 0; slot < XORFS_STREAM_SLOT_COUNT; slot++)
+   {
+      stream->slots[slot].buffers = calloc(stream->chain_length, sizeof (char *));
+      stream->slots[slot].has_data = calloc(stream->chain_length, 1);
+      if (stream->slots[slot].buffers == NULL || stream->slots[slot].has_data == NULL)
+      {
+         goto failure;
+      }
+
+      for (unsigned int index = 0; index < stream->chain_length; index++)
+      {
+         stream->slots[slot].buffers[index] = malloc(stream->chunk_size);
+         if (stream->slots[slot].buffers[index] == NULL)
+         {
+            goto failure;
+         }
+      }
+   }
+
+   // Stages
+   if (pthread_create(&stream->fetching_thread, NULL, xorfs_stream_fetch, stream) != 0)
+   {
+      goto failure;
+   }
+
+   if (pthread_create(&stream->xoring_thread, NULL, xorfs_stream_xor, stream) != 0)
+   {
+      pthread_mutex_lock(&stream->mutex);
+      stream->is_stopping = 1;
+      pthread_cond_broadcast(&stream->slot_changed);
+      pthread_mutex_unlock(&stream->mutex);
+      pthread_join(stream->fetching_thread, NULL);
+      goto failure;
+   }
+
+   return stream;
+
+   failure:
+   xorfs_log(XORFS_LOG_ERROR, "Unable to start streaming %s\n", stream->chain != NULL ? stream->chain[0]->name : "backup");
+   xorfs_free_stream(stream);
+   return NULL;
+}
+
+/**
+ * Stage 3 - take the next chunk of a stream
+ *
+ * The chunk is valid until the next call. Returns its size, 0 at the end,
+ * or negative errno.
+ */
+ssize_t xorfs_read_stream(struct xorfs_stream *stream, const char **data)
+{
+   // Previous chunk is free to fetch into
+   if (stream->consumed_count > 0)
+   {
+      xorfs_set_stream_slot_state(stream, stream->slots + (stream->consumed_count - 1) % XORFS_STREAM_SLOT_COUNT, XORFS_STREAM_SLOT_EMPTY);
+   }
+
+   if (stream->consumed_count >= stream->chunk_count)
+   {
+      return 0;
+   }
+
+   struct xorfs_stream_slot *slot = stream->slots + stream->consumed_count % XORFS_STREAM_SLOT_COUNT;
+   xorfs_wait_for_stream_slot(stream, stream->consumed_count, XORFS_STREAM_SLOT_READY);
+   stream->consumed_count++;
+
+   *data = slot->buffers[0];
+   return slot->result < 0 ? slot->result : (ssize_t) slot->size;
+}
+
+/**
+ * Read a long range of a backup, streamed
+ */
+int xorfs_read_backup_streamed(struct xorfs_source_file *source_file, char *buffer, off_t offset, size_t size)
+{
+   if (offset >= source_file->backup.size)
+   {
+      return 0;
+   }
+
+   if (size > source_file->backup.size - offset)
+   {
+      size = source_file->backup.size - offset;
+   }
+
+   if (size < XORFS_STREAM_MINIMUM_READ_SIZE)
+   {
+      return xorfs_read_backup(source_file, buffer, offset, size);
+   }
+
+   struct xorfs_stream *stream = xorfs_open_stream(source_file, offset, size);
+   if (stream == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   size_t position = 0;
+   ssize_t chunk_size;
+   const char *chunk;
+
+   while ((chunk_size = xorfs_read_stream(stream, &chunk)) > 0)
+   {
+      memcpy(buffer + position, chunk, chunk_size);
+      position += chunk_size;
+   }
+
+   xorfs_close_stream(stream);
+   return chunk_size < 0 ? chunk_size : position;
+}
+
+/*
+ * Read scheduler
+ *
+ * Reads of backups through the mount take one of a limited number of slots
+ * (-o io_slots). Waiting reads get a free slot in the order of start-time
+ * fair queuing over the clients (uid of the reading process): each client
+ * gets an equal share of the reconstruction time, estimated by the cost of
+ * the chain, however many reads it queues.
+ */
+
+struct xorfs_read_request {
+   double start_tag; // Virtual time at which the read would start, if all clients were served in parallel
+   int is_granted;
+   pthread_cond_t granted;
+   struct xorfs_read_request *next;
+};
+
+struct xorfs_read_client {
+   uid_t uid;
+   double finish_tag; // Of its last read
+};
+
+struct xorfs_read_scheduler {
+   pthread_mutex_t mutex;
+   unsigned int free_slot_count;
+   int is_initialized;
+   double virtual_time; // Start tag of the last read given a slot
+   struct xorfs_read_request *waiting;
+   struct xorfs_read_client *clients;
+   unsigned int client_count;
+};
+
+struct xorfs_read_scheduler xorfs_read_scheduler = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, NULL, NULL, 0 };
+
+/**
+ * Wait for a free slot for a read of `cost` (us) by client `uid`
+ *
+ * Returns 0, or -EINTR if the fuse request got interrupted while waiting -
+ * the read leaves the queue without a slot.
+ */
+int xorfs_acquire_read_slot(uid_t uid, double cost)
+{
+   struct xorfs_read_scheduler *scheduler = &xorfs_read_scheduler;
+   struct xorfs_read_client *client = NULL;
+   int return_value = 0;
+
+   pthread_mutex_lock(&scheduler->mutex);
+
+   if (!scheduler->is_initialized)
+   {
+      scheduler->free_slot_count = xorfs_options.io_slots > 0 ? xorfs_options.io_slots : xorfs_get_default_thread_count();
+      scheduler->is_initialized = 1;
+   }
+
+   // Find the client, or add it
+   for (unsigned int index = 0; index < scheduler->client_count && client == NULL; index++)
+   {
+      client = scheduler->clients[index].uid == uid ? scheduler->clients + index : NULL;
+   }
+
+   if (client == NULL)
+   {
+      struct xorfs_read_client *clients = realloc(scheduler->clients, (scheduler->client_count + 1) * sizeof (struct xorfs_read_client));
+      if (clients != NULL)
+      {
+         scheduler->clients = clients;
+         client = clients + scheduler->client_count++;
+         client->uid = uid;
+         client->finish_tag = 0;
+      }
+   }
+
+   // Tag the read, a client idle for a while starts at the current virtual time
+   double start_tag = scheduler->virtual_time;
+   if (client != NULL)
+   {
+      start_tag = client->finish_tag > start_tag ? client->finish_tag : start_tag;
+      client->finish_tag = start_tag + cost;
+   }
+
+   if (scheduler->free_slot_count > 0 && scheduler->waiting == NULL)
+   {
+      scheduler->free_slot_count--;
+      scheduler->virtual_time = start_tag;
+   }
+   else
+   // Wait in the queue
+   {
+      struct xorfs_read_request request = { start_tag, 0, PTHREAD_COND_INITIALIZER, scheduler->waiting };
+      scheduler->waiting = &request;
+
+      while (!request.is_granted && return_value == 0)
+      {
+         if (xorfs_is_interrupted())
+         {
+            return_value = -EINTR;
+         }
+         else
+         {
+            xorfs_wait_for_interval(&request.granted, &scheduler->mutex);
+         }
+      }
+
+      // Leave the queue, give back the share of the client if no later read of it is tagged after this one
+      if (!request.is_granted)
+      {
+         for (struct xorfs_read_request **link = &(scheduler->waiting); *link != NULL; link = &((*link)->next))
+         {
+            if (*link == &request)
+            {
+               *link = request.next;
+               break;
+            }
+         }
+
+         if (client != NULL && client->finish_tag == start_tag + cost)
+         {
+            client->finish_tag = start_tag;
+         }
+      }
+
+      pthread_cond_destroy(&request.granted);
+   }
+
+   pthread_mutex_unlock(&scheduler->mutex);
+   return return_value;
+}
+
+/**
+ * Give the slot to the waiting read with the lowest start tag, or free it
+ */
+void xorfs_release_read_slot()
+{
+   struct xorfs_read_scheduler *scheduler = &xorfs_read_scheduler;
+
+   pthread_mutex_lock(&scheduler->mutex);
+
+   if (scheduler->waiting == NULL)
+   {
+      scheduler->free_slot_count++;
+   }
+   else
+   {
+      struct xorfs_read_request **first_link = &(scheduler->waiting);
+
+      for (struct xorfs_read_request **link = &(scheduler->waiting); *link != NULL; link = &((*link)->next))
+      {
+         if ((*link)->start_tag < (*first_link)->start_tag)
+         {
+            first_link = link;
+         }
+      }
+
+      struct xorfs_read_request *request = *first_link;
+      *first_link = request->next;
+
+      scheduler->virtual_time = request->start_tag;
+      request->is_granted = 1;
+      pthread_cond_signal(&request->granted);
+   }
+
+   pthread_mutex_unlock(&scheduler->mutex);
+}
+
+/*
+ * Readahead
+ *
+ * Sequential reads of a backup push the range ahead of them straight into
+ * the page cache of the kernel (fuse_lowlevel_notify_store()), reconstructed
+ * by a thread of its own. Reads of the pushed range do not leave the kernel;
+ * the first one past it reaches xorfs again and pushes the next range.
+ *
+ * The kernel knows files by node IDs of the fuse library, the high-level
+ * API does not tell them; they are taken from file handles of the files in
+ * the mountpoint (name_to_handle_at()), which carry them.
+ */
+
+struct xorfs_readahead_request {
+   char file_name[NAME_MAX + 1];
+   off_t offset;
+   size_t size;
+   uid_t uid; // Of the reader, reconstruction goes to its share of reads
+};
+
+struct xorfs_readahead {
+   struct xorfs_readahead_request requests[XORFS_READAHEAD_QUEUE_LENGTH]; // Ring
+   unsigned int first;
+   unsigned int count;
+   pthread_t thread;
+   int is_running;
+   int is_stopping;
+   pthread_mutex_t mutex;
+   pthread_cond_t changed;
+};
+
+struct xorfs_readahead xorfs_readahead = { .mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+/**
+ * Node ID of a file of the mount, 0 if unknown
+ */
+uint64_t xorfs_get_node_id(const char *file_name)
+{
+   struct {
+      struct file_handle handle;
+      unsigned char data[MAX_HANDLE_SZ];
+   } handle;
+   char *path = NULL;
+   int mount_id;
+   uint64_t node_id = 0;
+
+   if (xorfs_mount.mountpoint == NULL || asprintf(&path, "%s/%s", xorfs_mount.mountpoint, file_name) < 0)
+   {
+      return 0;
+   }
+
+   // Node ID (high and low half) and generation, see fuse_encode_fh() of Linux
+   handle.handle.handle_bytes = MAX_HANDLE_SZ;
+   if (name_to_handle_at(AT_FDCWD, path, &handle.handle, &mount_id, 0) == 0 && handle.handle.handle_type == XORFS_FUSE_FILE_HANDLE_TYPE && handle.handle.handle_bytes >= 12)
+   {
+      uint32_t words[2];
+      memcpy(words, handle.handle.f_handle, sizeof words);
+      node_id = (uint64_t) words[0] << 32 | words[1];
+   }
+   else
+   {
+      xorfs_log(XORFS_LOG_DEBUG, "No node ID of '%s'\n", path);
+   }
+
+   free(path);
+   return node_id;
+}
+
+/**
+ * Reconstruct a range of a backup and store it in the page cache of the kernel
+ */
+int xorfs_push_range(const char *file_name, off_t offset, size_t size, uid_t uid)
+{
+   // Without a node the kernel has no cache to store the range in
+   uint64_t node_id = xorfs_get_node_id(file_name);
+   if (node_id == 0)
+   {
+      return 0;
+   }
+
+   char *buffer = malloc(size);
+   int read_bytes = -ENOENT;
+
+   if (buffer == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   // The catalog may be replaced in the meantime, the backup is looked up again
+   {
+      unsigned int epoch_parity = xorfs_enter_catalog();
+      struct xorfs_source_file *source_file = xorfs_get_source_file_by_file_name(file_name);
+
+      if (source_file != NULL)
+      {
+         read_bytes = xorfs_acquire_read_slot(uid, source_file->backup.cost * ((double) size / XORFS_PLANNING_READ_SIZE));
+         if (read_bytes == 0)
+         {
+            read_bytes = xorfs_read_backup_streamed(source_file, buffer, offset, size);
+            xorfs_release_read_slot();
+         }
+      }
+
+      xorfs_leave_catalog(epoch_parity);
+   }
+
+   int return_value = read_bytes < 0 ? read_bytes : 0;
+
+   if (read_bytes > 0)
+   {
+      struct fuse_bufvec data = FUSE_BUFVEC_INIT(read_bytes);
+      data.buf[0].mem = buffer;
+
+      return_value = fuse_lowlevel_notify_store(xorfs_mount.channel, node_id, offset, &data, 0);
+      xorfs_log(XORFS_LOG_DEBUG, "Pushed '%s', offset %li, %i bytes: %i\n", file_name, offset, read_bytes, return_value);
+   }
+
+   free(buffer);
+   return return_value;
+}
+
+void* xorfs_readahead_thread(void *data)
+{
+   struct xorfs_readahead *readahead = data;
+
+   pthread_mutex_lock(&readahead->mutex);
+   while (!readahead->is_stopping)
+   {
+      if (readahead->count == 0)
+      {
+         pthread_cond_wait(&readahead->changed, &readahead->mutex);
+         continue;
+      }
+
+      struct xorfs_readahead_request request = readahead->requests[readahead->first];
+      readahead->first = (readahead->first + 1) % XORFS_READAHEAD_QUEUE_LENGTH;
+      readahead->count--;
+
+      pthread_mutex_unlock(&readahead->mutex);
+      xorfs_push_range(request.file_name, request.offset, request.size, request.uid);
+      pthread_mutex_lock(&readahead->mutex);
+   }
+   pthread_mutex_unlock(&readahead->mutex);
+
+   return NULL;
+}
+
+/**
+ * Push the range ahead of a sequential read, unless pushed already
+ */
+void xorfs_read_ahead(struct xorfs_source_file *source_file, const char *file_name, off_t offset, size_t size)
+{
+   off_t window = (off_t) xorfs_options.readahead * 1024;
+   off_t end = offset + size;
+   off_t readahead_end = __atomic_load_n(&source_file->backup.readahead_end, __ATOMIC_RELAXED);
+   off_t next_read_offset = __atomic_exchange_n(&source_file->backup.next_read_offset, end, __ATOMIC_RELAXED);
+
+   off_t pushed_end = readahead_end;
+
+   // A pushed range not right ahead of the read (of an earlier pass through the file) does not count
+   if (pushed_end < end || pushed_end > end + window)
+   {
+      pushed_end = end;
+   }
+
+   // Sequential - right after the previous read, or after the pushed range; refilled at half of the window
+   if (!xorfs_readahead.is_running || (offset != next_read_offset && offset != readahead_end) || pushed_end >= end + window / 2)
+   {
+      return;
+   }
+
+   off_t start = pushed_end;
+   off_t stop = end + window < source_file->backup.size ? end + window : source_file->backup.size;
+
+   if (start >= stop || !__atomic_compare_exchange_n(&source_file->backup.readahead_end, &readahead_end, stop, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&xorfs_readahead.mutex);
+   if (xorfs_readahead.count < XORFS_READAHEAD_QUEUE_LENGTH)
+   {
+      struct xorfs_readahead_request *request = xorfs_readahead.requests + (xorfs_readahead.first + xorfs_readahead.count) % XORFS_READAHEAD_QUEUE_LENGTH;
+
+      snprintf(request->file_name, sizeof request->file_name, "%s", file_name);
+      request->offset = start;
+      request->size = stop - start;
+      request->uid = fuse_get_context()->uid;
+      xorfs_readahead.count++;
+      pthread_cond_signal(&xorfs_readahead.changed);
+   }
+   pthread_mutex_unlock(&xorfs_readahead.mutex);
+}
+
+void xorfs_start_readahead()
+{
+   if (xorfs_options.readahead == 0 || xorfs_mount.channel == NULL)
+   {
+      return;
+   }
+
+   if (pthread_create(&xorfs_readahead.thread, NULL, xorfs_readahead_thread, &xorfs_readahead) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to start readahead thread\n");
+      return;
+   }
+
+   xorfs_readahead.is_running = 1;
+}
+
+void xorfs_stop_readahead()
+{
+   if (!xorfs_readahead.is_running)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&xorfs_readahead.mutex);
+   xorfs_readahead.is_stopping = 1;
+   pthread_cond_signal(&xorfs_readahead.changed);
+   pthread_mutex_unlock(&xorfs_readahead.mutex);
+
+   pthread_join(xorfs_readahead.thread, NULL);
+   xorfs_readahead.is_running = 0;
+}
+
+static int xorfs_operation_read( const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+   xorfs_log(XORFS_LOG_DEBUG, "Operation read on '%s', offset %li, size %li\n", path, offset, size);
+
+   unsigned int epoch_parity = xorfs_enter_catalog();
+
+   // Reading debug file
+   if (strcmp(path + 1, XORFS_DEBUG_FILE_NAME) == 0)
+   {
+     ssize_t read_result = pread(__atomic_load_n(&xorfs_debug_file_fd, __ATOMIC_ACQUIRE), buffer, size, offset);
+     xorfs_leave_catalog(epoch_parity);
+     return read_result;
+   }
+   else
+   // Reading source file
+   {
+      struct xorfs_source_file *source_file = xorfs_get_source_file_by_file_name(path + 1 /* removing slash */);
+      if (source_file == NULL)
+      {
+         xorfs_leave_catalog(epoch_parity);
+         return -ENOENT;
+      }
+
+      struct xorfs_source_file *checkpoint = __atomic_load_n(&source_file->backup.checkpoint, __ATOMIC_ACQUIRE);
+      double cost = checkpoint != NULL ? checkpoint->backup.cost : source_file->backup.cost;
+      xorfs_is_serving_request = 1;
+      int read_bytes = xorfs_acquire_read_slot(fuse_get_context()->uid, cost * ((double) size / XORFS_PLANNING_READ_SIZE));
+      if (read_bytes == 0)
+      {
+         read_bytes = xorfs_read_backup(source_file, buffer, offset, size);
+         xorfs_release_read_slot();
+      }
+      xorfs_is_serving_request = 0;
+
+      // Account for choosing checkpoints
+      if (read_bytes > 0)
+      {
+         __atomic_add_fetch(&source_file->backup.read_bytes, read_bytes, __ATOMIC_RELAXED);
+         xorfs_read_ahead(source_file, path + 1, offset, read_bytes);
+      }
+
+      xorfs_leave_catalog(epoch_parity);
+      return read_bytes;
+   }
+}
+
+/*
+ * Spliced replies
+ *
+ * Large reads are reconstructed into page-aligned buffers from a pool, whose
+ * pages are given to a pipe of the replying thread (vmsplice() with
+ * SPLICE_F_GIFT) and dropped from the buffer (MADV_DONTNEED): fuse splices
+ * the pipe into /dev/fuse, and the kernel may take the pages over instead of
+ * copying them. A buffer goes back to the pool right away, without pages -
+ * the next read faults in fresh ones. The pipe is emptied by the reply,
+ * before its thread serves the next request.
+ */
+
+struct xorfs_splice_buffer {
+   char *data; // XORFS_SPLICE_BUFFER_SIZE, page-aligned
+   struct xorfs_splice_buffer *next;
+};
+
+struct xorfs_splice_pipe {
+   int fds[2];
+   size_t size;
+};
+
+struct xorfs_splice {
+   int is_enabled; // fuse splices replies into /dev/fuse
+   pthread_key_t pipe_key; // Pipe of each thread serving requests
+   pthread_mutex_t mutex;
+   struct xorfs_splice_buffer *free_buffers;
+};
+
+struct xorfs_splice xorfs_splice = { 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+void xorfs_close_splice_pipe(void *data)
+{
+   struct xorfs_splice_pipe *pipe = data;
+
+   close(pipe->fds[0]);
+   close(pipe->fds[1]);
+   free(pipe);
+}
+
+/**
+ * The empty pipe of this thread, if it can hold `size` bytes
+ */
+struct xorfs_splice_pipe *xorfs_get_splice_pipe(size_t size)
+{
+   struct xorfs_splice_pipe *pipe = pthread_getspecific(xorfs_splice.pipe_key);
+   int unread_size = 0;
+
+   // A failed reply may have left data in the pipe
+   if (pipe != NULL && (ioctl(pipe->fds[0], FIONREAD, &unread_size) != 0 || unread_size != 0))
+   {
+      xorfs_close_splice_pipe(pipe);
+      pthread_setspecific(xorfs_splice.pipe_key, NULL);
+      pipe = NULL;
+   }
+
+   if (pipe == NULL)
+   {
+      pipe = malloc(sizeof (struct xorfs_splice_pipe));
+      if (pipe == NULL)
+      {
+         return NULL;
+      }
+
+      if (pipe2(pipe->fds, O_CLOEXEC) != 0)
+      {
+         free(pipe);
+         return NULL;
+      }
+
+      // Over /proc/sys/fs/pipe-max-size, for unprivileged users, the pipe stays smaller
+      fcntl(pipe->fds[1], F_SETPIPE_SZ, XORFS_SPLICE_BUFFER_SIZE);
+      int pipe_size = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+      pipe->size = pipe_size > 0 ? pipe_size : 0;
+
+      if (pthread_setspecific(xorfs_splice.pipe_key, pipe) != 0)
+      {
+         xorfs_close_splice_pipe(pipe);
+         return NULL;
+      }
+   }
+
+   return size <= pipe->size ? pipe : NULL;
+}
+
+struct xorfs_splice_buffer *xorfs_take_splice_buffer()
+{
+   struct xorfs_splice_buffer *buffer;
+
+   pthread_mutex_lock(&xorfs_splice.mutex);
+   buffer = xorfs_splice.free_buffers;
+   if (buffer != NULL)
+   {
+      xorfs_splice.free_buffers = buffer->next;
+   }
+   pthread_mutex_unlock(&xorfs_splice.mutex);
+
+   if (buffer == NULL)
+   {
+      buffer = malloc(sizeof (struct xorfs_splice_buffer));
+      if (buffer == NULL)
+      {
+         return NULL;
+      }
+
+      buffer->data = mmap(NULL, XORFS_SPLICE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buffer->data == MAP_FAILED)
+      {
+         free(buffer);
+         return NULL;
+      }
+   }
+
+   return buffer;
+}
+
+void xorfs_give_back_splice_buffer(struct xorfs_splice_buffer *buffer)
+{
+   pthread_mutex_lock(&xorfs_splice.mutex);
+   buffer->next = xorfs_splice.free_buffers;
+   xorfs_splice.free_buffers = buffer;
+   pthread_mutex_unlock(&xorfs_splice.mutex);
+}
+
+/**
+ * Give `size` bytes of a buffer to a pipe, returns 0 or -errno
+ *
+ * The pages of the buffer are dropped, it reads as zeros afterwards.
+ */
+int xorfs_gift_to_pipe(struct xorfs_splice_pipe *pipe, char *data, size_t size)
+{
+   struct iovec vector = { data, size };
+
+   while (vector.iov_len > 0)
+   {
+      ssize_t spliced_size = vmsplice(pipe->fds[1], &vector, 1, SPLICE_F_GIFT);
+      if (spliced_size <= 0)
+      {
+         return spliced_size < 0 ? -errno : -EIO;
+      }
+
+      vector.iov_base = (char *) vector.iov_base + spliced_size;
+      vector.iov_len -= spliced_size;
+   }
+
+   madvise(data, size, MADV_DONTNEED);
+   return 0;
+}
+
+/**
+ * Read, replied through the pipe of this thread if large enough
+ *
+ * Anything spliced failing, the data is replied from memory.
+ */
+static int xorfs_operation_read_buf(const char *path, struct fuse_bufvec **data, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+   struct fuse_bufvec *vector = malloc(sizeof (struct fuse_bufvec));
+   struct xorfs_splice_pipe *pipe = NULL;
+   struct xorfs_splice_buffer *buffer = NULL;
+   char *memory = NULL;
+   int read_bytes;
+
+   if (vector == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   if (xorfs_splice.is_enabled && size >= XORFS_SPLICE_MINIMUM_SIZE && size <= XORFS_SPLICE_BUFFER_SIZE)
+   {
+      pipe = xorfs_get_splice_pipe(size);
+      buffer = pipe != NULL ? xorfs_take_splice_buffer() : NULL;
+   }
+
+   // Read
+   if (buffer != NULL)
+   {
+      read_bytes = xorfs_operation_read(path, buffer->data, size, offset, fi);
+   }
+   else
+   {
+      memory = malloc(size);
+      read_bytes = memory != NULL ? xorfs_operation_read(path, memory, size, offset, fi) : -ENOMEM;
+   }
+
+   *vector = FUSE_BUFVEC_INIT(read_bytes > 0 ? read_bytes : 0);
+
+   if (read_bytes <= 0)
+   {
+      // Nothing to reply
+   }
+   else if (buffer != NULL && xorfs_gift_to_pipe(pipe, buffer->data, read_bytes) == 0)
+   {
+      vector->buf[0].flags = FUSE_BUF_IS_FD;
+      vector->buf[0].fd = pipe->fds[0];
+   }
+   else if (buffer != NULL)
+   // Part of the data may be in the pipe, it is replaced by the next read
+   {
+      memory = malloc(read_bytes);
+      if (memory == NULL)
+      {
+         read_bytes = -ENOMEM;
+      }
+      else
+      {
+         memcpy(memory, buffer->data, read_bytes);
+      }
+   }
+
+   if (buffer != NULL)
+   {
+      xorfs_give_back_splice_buffer(buffer);
+   }
+
+   if (read_bytes < 0)
+   {
+      free(memory);
+      free(vector);
+      return read_bytes;
+   }
+
+   vector->buf[0].mem = memory; // Freed by fuse
+   *data = vector;
+   return 0;
+}
+
+/**
+ * Let fuse splice replies, if the kernel can
+ */
+void xorfs_start_splice(struct fuse_conn_info *connection)
+{
+   if (!(connection->capable & FUSE_CAP_SPLICE_WRITE) || pthread_key_create(&xorfs_splice.pipe_key, xorfs_close_splice_pipe) != 0)
+   {
+      return;
+   }
+
+   connection->want |= FUSE_CAP_SPLICE_WRITE | (connection->capable & FUSE_CAP_SPLICE_MOVE);
+   xorfs_splice.is_enabled = 1;
+}
+
+void xorfs_stop_splice()
+{
+   if (!xorfs_splice.is_enabled)
+   {
+      return;
+   }
+
+   xorfs_splice.is_enabled = 0;
+
+   // Pipe of this thread, those of others are closed as they exit
+   struct xorfs_splice_pipe *pipe = pthread_getspecific(xorfs_splice.pipe_key);
+   if (pipe != NULL)
+   {
+      xorfs_close_splice_pipe(pipe);
+      pthread_setspecific(xorfs_splice.pipe_key, NULL);
+   }
+
+   pthread_key_delete(xorfs_splice.pipe_key);
+
+   while (xorfs_splice.free_buffers != NULL)
+   {
+      struct xorfs_splice_buffer *buffer = xorfs_splice.free_buffers;
+      xorfs_splice.free_buffers = buffer->next;
+      munmap(buffer->data, XORFS_SPLICE_BUFFER_SIZE);
+      free(buffer);
+   }
+}
+
+static int xorfs_process_argument(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    xorfs_log(XORFS_LOG_DEBUG, "Processing argument \"%s\", key %i\n", arg, key);
+
+    // Take the first non-option as source directory
+    if (key == FUSE_OPT_KEY_NONOPT && xorfs_source_directory_path == NULL)
+    {
+        xorfs_source_directory_path = strdup(arg);
+
+        // Do not pass this argument to fuse itself
+        return 0;
+    }
+
+    return 1;
+}
+
+void xorfs_close_block_store(struct xorfs_block_store *store)
+{
+   if (store->mapping != NULL)
+   {
+      munmap(store->mapping, store->mapping_size);
+   }
+   else
+   {
+      free(store->slots);
+   }
+
+   if (store->fd >= 0)
+   {
+      close(store->fd);
+   }
+
+   free(store);
+}
+
+/**
+ * Drop cached frames of the source files, before they are freed
+ */
+void xorfs_drop_frames_of_source_files(struct xorfs_source_files *source_files)
+{
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+
+   for (int kind = XORFS_FRAME_OF_XORED_IMAGE; kind < XORFS_FRAME_KIND_COUNT; kind++)
+   {
+      struct xorfs_frame *frame = xorfs_frame_cache.lists[kind].least_recent;
+
+      while (frame != NULL)
+      {
+         struct xorfs_frame *more_recent = frame->more_recent;
+
+         if (frame->source_file >= source_files->files && frame->source_file < source_files->files + source_files->count)
+         {
+            xorfs_unlink_frame(frame);
+            free(frame->data);
+            free(frame);
+         }
+
+         frame = more_recent;
+      }
+   }
+
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+}
+
+void xorfs_free_source_files(struct xorfs_source_files *source_files)
+{
+   // Close all files
+   for (int index = 0; index < source_files->count; index++)
+   {
+       char* file_name = source_files->files[index].name;
+       int fd = source_files->files[index].fd;
+       struct xorfs_source_file_indexes *indexes = source_files->files[index].indexes;
+
+       xorfs_log(XORFS_LOG_DEBUG, "Closing file '%s'\n", file_name);
+
+       if (indexes != NULL)
+       {
+          if (source_files->files[index].format == XORFS_SOURCE_FORMAT_PACKED && indexes->packed_index.mapping != NULL)
+          {
+             munmap(indexes->packed_index.mapping, indexes->packed_index.mapping_size);
+          }
+
+          if (source_files->files[index].format == XORFS_SOURCE_FORMAT_COMPRESSED && indexes->compressed_index.mapping != NULL)
+          {
+             munmap(indexes->compressed_index.mapping, indexes->compressed_index.mapping_size);
+          }
+
+          if (source_files->files[index].format == XORFS_SOURCE_FORMAT_MANIFEST && indexes->manifest.mapping != NULL)
+          {
+             munmap(indexes->manifest.mapping, indexes->manifest.mapping_size);
+          }
+
+          free(indexes->unit_runs.starts);
+          free(indexes);
+       }
+
+       struct xorfs_source_file *checkpoint = source_files->files[index].backup.checkpoint;
+
+       if (checkpoint != NULL)
+       {
+          close(checkpoint->fd);
+          free(checkpoint->name);
+          free(checkpoint);
+       }
+
+       if (fd >= 0) { close(fd); }
+   }
+
+   while (source_files->name_chunks != NULL)
+   {
+      struct xorfs_name_chunk *next_chunk = source_files->name_chunks->next;
+      free(source_files->name_chunks);
+      source_files->name_chunks = next_chunk;
+   }
+
+   for (unsigned int set = 0; set < source_files->history_count; set++)
+   {
+      if (source_files->histories[set].mapping != NULL)
+      {
+         munmap(source_files->histories[set].mapping, source_files->histories[set].mapping_size);
+      }
+   }
+
+   if (source_files->block_store != NULL)
+   {
+      xorfs_close_block_store(source_files->block_store);
+   }
+
+   // Free memory
+   free(source_files->files);
+   free(source_files->lookup_slots);
+   free(source_files->backup_slots);
+   free(source_files->histories);
+   source_files->files = NULL;
+   source_files->count = 0;
+   source_files->allocated_count = 0;
+   source_files->lookup_slots = NULL;
+   source_files->backup_slots = NULL;
+   source_files->lookup_slot_count = 0;
+   source_files->histories = NULL;
+   source_files->history_count = 0;
+   source_files->block_store = NULL;
+}
+
+void xorfs_close_source_files ()
+{
+   xorfs_free_source_files(&xorfs_source_files);
+
+   for (unsigned int set = 0; set < xorfs_backup_sets.count; set++)
+   {
+      free(xorfs_backup_sets.sets[set].name);
+   }
+
+   free(xorfs_backup_sets.sets);
+   free(xorfs_backup_sets.slots);
+   xorfs_backup_sets.sets = NULL;
+   xorfs_backup_sets.count = 0;
+   xorfs_backup_sets.slots = NULL;
+   xorfs_backup_sets.slot_count = 0;
+}
+
+/**
+ * Fill the stat fields of the source file from its file
+ */
+int xorfs_stat_source_file(struct xorfs_source_file *source_file)
+{
+   struct stat file_stat;
+
+   if (fstat(source_file->fd, &file_stat) != 0)
+   {
+      return -1;
+   }
+
+   source_file->stat.st_size = file_stat.st_size;
+   source_file->stat.st_blocks = file_stat.st_blocks;
+   source_file->stat.st_dev = file_stat.st_dev;
+   source_file->backup.time = file_stat.st_mtime;
+   return 0;
+}
+
+/**
+ * Index of the set of backups named `name` (`length` characters), -1 if
+ * there is none
+ */
+int xorfs_find_backup_set(const char *name, size_t length)
+{
+   struct xorfs_backup_sets *sets = &xorfs_backup_sets;
+   uint32_t hash = xorfs_hash_name(name, length);
+
+   if (sets->slot_count > 0)
+   {
+      for (unsigned int slot = hash & (sets->slot_count - 1); sets->slots[slot] != 0; slot = (slot + 1) & (sets->slot_count - 1))
+      {
+         const char *set_name = sets->sets[sets->slots[slot] - 1].name;
+         if (strncmp(set_name, name, length) == 0 && set_name[length] == '\0')
+         {
+            return sets->slots[slot] - 1;
+         }
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Index of the set of backups named `name` (`length` characters), added if
+ * it is new, -1 on failure
+ *
+ * Sets are kept over rescans, cached frames stay charged to them.
+ */
+int xorfs_intern_backup_set(const char *name, size_t length)
+{
+   struct xorfs_backup_sets *sets = &xorfs_backup_sets;
+   uint32_t hash = xorfs_hash_name(name, length);
+   int existing_set = xorfs_find_backup_set(name, length);
+
+   if (existing_set >= 0)
+   {
+      return existing_set;
+   }
+
+   // Keep at most half of the slots used
+   if ((sets->count + 1) * 2 > sets->slot_count)
+   {
+      unsigned int slot_count = sets->slot_count > 0 ? sets->slot_count * 2 : 64;
+      unsigned int *slots = calloc(slot_count, sizeof (unsigned int));
+      if (slots == NULL)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+         return -1;
+      }
+
+      for (unsigned int set = 0; set < sets->count; set++)
+      {
+         unsigned int slot = xorfs_hash_name(sets->sets[set].name, strlen(sets->sets[set].name)) & (slot_count - 1);
+         while (slots[slot] != 0)
+         {
+            slot = (slot + 1) & (slot_count - 1);
+         }
+
+         slots[slot] = set + 1;
+      }
+
+      free(sets->slots);
+      sets->slots = slots;
+      sets->slot_count = slot_count;
+   }
+
+   char *set_name = strndup(name, length);
+   if (set_name == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return -1;
+   }
+
+   // Frames are charged to sets under the cache mutex
+   pthread_mutex_lock(&xorfs_frame_cache.mutex);
+   struct xorfs_backup_set *new_sets = realloc(sets->sets, (sets->count + 1) * sizeof (struct xorfs_backup_set));
+   if (new_sets != NULL)
+   {
+      new_sets[sets->count].name = set_name;
+      new_sets[sets->count].cache_size = 0;
+      sets->sets = new_sets;
+      sets->count++;
+   }
+   pthread_mutex_unlock(&xorfs_frame_cache.mutex);
+
+   if (new_sets == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      free(set_name);
+      return -1;
+   }
+
+   unsigned int slot = hash & (sets->slot_count - 1);
+   while (sets->slots[slot] != 0)
+   {
+      slot = (slot + 1) & (sets->slot_count - 1);
+   }
+
+   sets->slots[slot] = sets->count;
+   return sets->count - 1;
+}
+
+int xorfs_has_extension(const char *file_name, const char *extension)
+{
+   size_t name_length = strlen(file_name);
+   size_t extension_length = strlen(extension);
+
+   return name_length > extension_length && strcmp(file_name + name_length - extension_length, extension) == 0;
+}
+
+enum xorfs_source_format xorfs_get_source_format(const char *file_name)
+{
+   if (xorfs_has_extension(file_name, XORFS_PACKED_SOURCE_FILE_EXTENSION))
+   {
+      return XORFS_SOURCE_FORMAT_PACKED;
+   }
+   else if (xorfs_has_extension(file_name, XORFS_COMPRESSED_SOURCE_FILE_EXTENSION))
+   {
+      return XORFS_SOURCE_FORMAT_COMPRESSED;
+   }
+   else if (xorfs_has_extension(file_name, XORFS_MANIFEST_SOURCE_FILE_EXTENSION))
+   {
+      return XORFS_SOURCE_FORMAT_MANIFEST;
+   }
+
+   return XORFS_SOURCE_FORMAT_RAW;
+}
+
+/**
+ * Map the block index of a packed source file, set size of the image
+ */
+int xorfs_open_packed_index(struct xorfs_source_file *source_file)
+{
+   struct xorfs_packed_index *index = &(source_file->indexes->packed_index);
+   struct xorfs_packed_header header;
+   int fd = source_file->fd;
+
+   if (pread(fd, &header, sizeof header, 0) != sizeof header
+       || memcmp(header.magic, XORFS_PACKED_MAGIC, sizeof header.magic) != 0
+       || le32toh(header.version) != XORFS_PACKED_VERSION)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "File '%s' is not a packed source file of version %i\n", source_file->name, XORFS_PACKED_VERSION);
+      return 1;
+   }
+
+   index->block_size = le32toh(header.block_size);
+   index->block_count = le64toh(header.block_count);
+
+   if (index->block_size == 0 || index->block_count != (le64toh(header.size) + index->block_size - 1) / index->block_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Packed source file '%s' has a malformed header\n", source_file->name);
+      return 1;
+   }
+
+   index->mapping_size = sizeof header + index->block_count * sizeof (uint32_t);
+   index->data_offset = (index->mapping_size + index->block_size - 1) / index->block_size * index->block_size;
+
+   if (index->data_offset + le64toh(header.stored_block_count) * index->block_size > source_file->stat.st_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Packed source file '%s' is truncated\n", source_file->name);
+      return 1;
+   }
+
+   index->mapping = mmap(NULL, index->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (index->mapping == MAP_FAILED)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to map index of '%s': %s\n", source_file->name, strerror(errno));
+      index->mapping = NULL;
+      return 1;
+   }
+
+   index->blocks = (const uint32_t *) ((char *) index->mapping + sizeof header);
+
+   // The image is what is served
+   source_file->stat.st_size = le64toh(header.size);
+
+   return 0;
+}
+
+/**
+ * Map the frame index of a compressed source file, set size of the image
+ */
+int xorfs_open_compressed_index(struct xorfs_source_file *source_file)
+{
+   struct xorfs_compressed_index *index = &(source_file->indexes->compressed_index);
+   struct xorfs_compressed_header header;
+   int fd = source_file->fd;
+
+   if (pread(fd, &header, sizeof header, 0) != sizeof header
+       || memcmp(header.magic, XORFS_COMPRESSED_MAGIC, sizeof header.magic) != 0
+       || le32toh(header.version) != XORFS_COMPRESSED_VERSION)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "File '%s' is not a compressed source file of version %i\n", source_file->name, XORFS_COMPRESSED_VERSION);
+      return 1;
+   }
+
+   index->codec = le32toh(header.codec);
+   index->frame_size = le32toh(header.frame_size);
+   index->frame_count = le64toh(header.frame_count);
+
+   if (index->frame_size == 0 || index->frame_count != (le64toh(header.size) + index->frame_size - 1) / index->frame_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Compressed source file '%s' has a malformed header\n", source_file->name);
+      return 1;
+   }
+
+   if (!xorfs_is_codec_supported(index->codec))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Compressed source file '%s' uses codec %s, which is not built in\n", source_file->name, index->codec < 3 ? XORFS_CODEC_NAMES[index->codec] : "unknown");
+      return 1;
+   }
+
+   index->mapping_size = sizeof header + index->frame_count * sizeof (struct xorfs_compressed_frame);
+   if (index->mapping_size > source_file->stat.st_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Compressed source file '%s' is truncated\n", source_file->name);
+      return 1;
+   }
+
+   index->mapping = mmap(NULL, index->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (index->mapping == MAP_FAILED)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to map index of '%s': %s\n", source_file->name, strerror(errno));
+      index->mapping = NULL;
+      return 1;
+   }
+
+   index->frames = (const struct xorfs_compressed_frame *) ((char *) index->mapping + sizeof header);
+
+   // The image is what is served
+   source_file->stat.st_size = le64toh(header.size);
+
+   return 0;
+}
+
+/**
+ * Slot of backup `number` of `set` among `slots` (first source file of a
+ * backup + 1, 0 for an empty slot), or the empty slot where it belongs
+ */
+unsigned int xorfs_find_backup_slot(const int *slots, unsigned int slot_count, unsigned int set, unsigned int number)
+{
+   unsigned int key[2] = { set, number };
+   unsigned int slot = xorfs_hash_name((const char *) key, sizeof key) & (slot_count - 1);
+
+   while (slots[slot] != 0)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[slots[slot] - 1].backup);
+      if (backup->set == set && backup->number == number)
+      {
+         break;
+      }
+
+      slot = (slot + 1) & (slot_count - 1);
+   }
+
+   return slot;
+}
+
+struct xorfs_source_file* get_source_file_by_backup_name_and_number(const char* requested_name, unsigned int requested_number)
+{
+   int set = xorfs_find_backup_set(requested_name, strlen(requested_name));
+
+   if (set >= 0 && xorfs_source_files.backup_slots != NULL)
+   {
+      unsigned int slot = xorfs_find_backup_slot(xorfs_source_files.backup_slots, xorfs_source_files.lookup_slot_count, set, requested_number);
+      if (xorfs_source_files.backup_slots[slot] != 0)
+      {
+         return xorfs_source_files.files + xorfs_source_files.backup_slots[slot] - 1;
+      }
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Source file for backup %s-%i not found\n", requested_name, requested_number);
+   return NULL;
+}
+
+char* xorfs_construct_source_file_path(const char *file_name)
+{
+   // directory path, slash, file name, null byte
+   size_t path_buffer_size = strlen(xorfs_source_directory_path) + 1 + strlen(file_name) + 1;
+
+   char *file_path = malloc(path_buffer_size);
+   if (file_path == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return NULL;
+   }
+
+   file_path[0] = '\0';
+
+   strcat(file_path, xorfs_source_directory_path);
+   strcat(file_path, "/");
+   strcat(file_path, file_name);
+
+   return file_path;
+}
+
+/**
+ * Open the block store of the source directory and map its hash index
+ *
+ * Tools adding blocks pass the block size for a new store - the store is
+ * then created if missing, and the hash index is loaded to memory to grow.
+ * Each scan of the source directory opens the store anew, with the blocks
+ * and the index as they are at the moment.
+ */
+struct xorfs_block_store* xorfs_open_block_store(uint32_t new_block_size)
+{
+   struct xorfs_block_store *store = calloc(1, sizeof (struct xorfs_block_store));
+   struct xorfs_block_store_header header;
+   struct xorfs_block_index_header index_header;
+   struct stat store_stat;
+   char *store_path = xorfs_construct_source_file_path(XORFS_BLOCK_STORE_FILE_NAME);
+   char *index_path = xorfs_construct_source_file_path(XORFS_BLOCK_INDEX_FILE_NAME);
+   int index_fd = -1;
+   int return_value = 1;
+
+   if (store == NULL || store_path == NULL || index_path == NULL)
+   {
+      free(store);
+      store = NULL;
+      goto cleanup;
+   }
+
+   // Blocks
+   store->fd = open(store_path, new_block_size != 0 ? O_RDWR | O_CREAT : O_RDONLY, XORFS_FILE_PERMISSIONS);
+   if (store->fd < 0 || fstat(store->fd, &store_stat) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open block store '%s': %s\n", store_path, strerror(errno));
+      goto cleanup;
+   }
+
+   if (store_stat.st_size == 0 && new_block_size != 0)
+   // New store
+   {
+      memset(&header, 0, sizeof header);
+      memcpy(header.magic, XORFS_BLOCK_STORE_MAGIC, sizeof header.magic);
+      header.version = htole32(XORFS_BLOCK_STORE_VERSION);
+      header.block_size = htole32(new_block_size);
+
+      if (pwrite(store->fd, &header, sizeof header, 0) != sizeof header || ftruncate(store->fd, new_block_size) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write block store '%s': %s\n", store_path, strerror(errno));
+         goto cleanup;
+      }
+
+      store_stat.st_size = new_block_size;
+   }
+
+   if (pread(store->fd, &header, sizeof header, 0) != sizeof header
+       || memcmp(header.magic, XORFS_BLOCK_STORE_MAGIC, sizeof header.magic) != 0
+       || le32toh(header.version) != XORFS_BLOCK_STORE_VERSION)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "File '%s' is not a block store of version %i\n", store_path, XORFS_BLOCK_STORE_VERSION);
+      goto cleanup;
+   }
+
+   store->block_size = le32toh(header.block_size);
+   if (store->block_size < sizeof header || (store->block_size & (store->block_size - 1)) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block store '%s' has a malformed header\n", store_path);
+      goto cleanup;
+   }
+
+   // A block cut short by an interrupted tool is not counted, the next one overwrites it
+   store->block_count = (store_stat.st_size - store->block_size) / store->block_size;
+
+   // Hash index, empty when missing
+   index_fd = open(index_path, O_RDONLY);
+   if (index_fd < 0 && errno == ENOENT)
+   {
+      store->slot_count = XORFS_BLOCK_INDEX_INITIAL_SLOT_COUNT;
+      store->entry_count = 0;
+      store->slots = calloc(store->slot_count, sizeof (struct xorfs_block_index_slot));
+      return_value = store->slots == NULL ? 1 : 0;
+      goto cleanup;
+   }
+
+   if (index_fd < 0
+       || pread(index_fd, &index_header, sizeof index_header, 0) != sizeof index_header
+       || memcmp(index_header.magic, XORFS_BLOCK_INDEX_MAGIC, sizeof index_header.magic) != 0
+       || le32toh(index_header.version) != XORFS_BLOCK_INDEX_VERSION)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "File '%s' is not a block index of version %i\n", index_path, XORFS_BLOCK_INDEX_VERSION);
+      goto cleanup;
+   }
+
+   store->slot_count = le64toh(index_header.slot_count);
+   store->entry_count = le64toh(index_header.entry_count);
+   store->mapping_size = sizeof index_header + store->slot_count * sizeof (struct xorfs_block_index_slot);
+
+   if (store->slot_count == 0 || (store->slot_count & (store->slot_count - 1)) != 0 || store->entry_count >= store->slot_count)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block index '%s' has a malformed header\n", index_path);
+      goto cleanup;
+   }
+
+   if (new_block_size != 0)
+   // Loaded to grow
+   {
+      store->slots = malloc(store->slot_count * sizeof (struct xorfs_block_index_slot));
+      if (store->slots == NULL || pread(index_fd, store->slots, store->slot_count * sizeof (struct xorfs_block_index_slot), sizeof index_header) != store->slot_count * sizeof (struct xorfs_block_index_slot))
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read block index '%s'\n", index_path);
+         goto cleanup;
+      }
+   }
+   else
+   // Mapped to serve
+   {
+      store->mapping = mmap(NULL, store->mapping_size, PROT_READ, MAP_SHARED, index_fd, 0);
+      if (store->mapping == MAP_FAILED)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to map block index '%s': %s\n", index_path, strerror(errno));
+         store->mapping = NULL;
+         goto cleanup;
+      }
+
+      store->slots = (struct xorfs_block_index_slot *) ((char *) store->mapping + sizeof index_header);
+   }
+
+   xorfs_log(XORFS_LOG_DEBUG, "Block store has %lu blocks of %u bytes, %lu indexed\n", store->block_count, store->block_size, store->entry_count);
+   return_value = 0;
+
+   cleanup:
+   if (index_fd >= 0)
+   {
+      close(index_fd);
+   }
+
+   if (return_value != 0 && store != NULL)
+   {
+      xorfs_close_block_store(store);
+      store = NULL;
+   }
+
+   free(store_path);
+   free(index_path);
+   return store;
+}
+
+/**
+ * Map the block hashes of a manifest source file, set size of the image
+ */
+int xorfs_open_manifest(struct xorfs_source_file *source_file)
+{
+   struct xorfs_manifest *manifest = &(source_file->indexes->manifest);
+   struct xorfs_manifest_header header;
+   int fd = source_file->fd;
+
+   if (pread(fd, &header, sizeof header, 0) != sizeof header
+       || memcmp(header.magic, XORFS_MANIFEST_MAGIC, sizeof header.magic) != 0
+       || le32toh(header.version) != XORFS_MANIFEST_VERSION)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "File '%s' is not a manifest of version %i\n", source_file->name, XORFS_MANIFEST_VERSION);
+      return 1;
+   }
+
+   manifest->block_size = le32toh(header.block_size);
+   manifest->block_count = le64toh(header.block_count);
+   manifest->store = xorfs_source_files.block_store;
+
+   if (manifest->block_size != manifest->store->block_size || manifest->block_count != (le64toh(header.size) + manifest->block_size - 1) / manifest->block_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Manifest '%s' has a malformed header, or does not match the block store\n", source_file->name);
+      return 1;
+   }
+
+   manifest->mapping_size = sizeof header + manifest->block_count * XORFS_HASH_SIZE;
+   if (manifest->mapping_size > source_file->stat.st_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Manifest '%s' is truncated\n", source_file->name);
+      return 1;
+   }
+
+   manifest->mapping = mmap(NULL, manifest->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (manifest->mapping == MAP_FAILED)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to map hashes of '%s': %s\n", source_file->name, strerror(errno));
+      manifest->mapping = NULL;
+      return 1;
+   }
+
+   manifest->hashes = (const unsigned char (*)[XORFS_HASH_SIZE]) ((char *) manifest->mapping + sizeof header);
+
+   // The image is what is served
+   source_file->stat.st_size = le64toh(header.size);
+
+   return 0;
+}
+
+/**
+ * Is the device a rotational disk?
+ *
+ * Looked up in sysfs, for a partition in its parent disk.
+ */
+int xorfs_is_rotational_device(dev_t device)
+{
+   const char *formats[] = { "/sys/dev/block/%u:%u/queue/rotational", "/sys/dev/block/%u:%u/../queue/rotational" };
+
+   for (int index = 0; index < 2; index++)
+   {
+      char path[PATH_MAX];
+      int rotational = 0;
+
+      snprintf(path, sizeof path, formats[index], major(device), minor(device));
+
+      FILE *file = fopen(path, "r");
+      if (file != NULL)
+      {
+         int scanned_count = fscanf(file, "%i", &rotational);
+         fclose(file);
+
+         if (scanned_count == 1)
+         {
+            return rotational;
+         }
+      }
+   }
+
+   // Unknown (network, tmpfs, ...) - as fast as SSD
+   return 0;
+}
+
+/**
+ * Estimated cost of reading a range of the backup from this source file alone,
+ * in microseconds
+ *
+ * Reading holes costs almost nothing, so the cost of reaching the storage
+ * scales with the share of allocated data in the file.
+ */
+double xorfs_get_source_file_cost(struct xorfs_source_file *source_file)
+{
+   static dev_t known_devices[XORFS_PLANNING_KNOWN_DEVICE_COUNT];
+   static int known_rotational[XORFS_PLANNING_KNOWN_DEVICE_COUNT];
+   static int known_device_count = 0;
+   int rotational = -1;
+
+   // Storage tier
+   for (int index = 0; index < known_device_count; index++)
+   {
+      if (known_devices[index] == source_file->stat.st_dev)
+      {
+         rotational = known_rotational[index];
+      }
+   }
+
+   if (rotational < 0)
+   {
+      rotational = xorfs_is_rotational_device(source_file->stat.st_dev);
+
+      if (known_device_count < XORFS_PLANNING_KNOWN_DEVICE_COUNT)
+      {
+         known_devices[known_device_count] = source_file->stat.st_dev;
+         known_rotational[known_device_count] = rotational;
+         known_device_count++;
+      }
+   }
+
+   double latency = rotational ? XORFS_PLANNING_HDD_LATENCY : XORFS_PLANNING_SSD_LATENCY;
+   double bandwidth = rotational ? XORFS_PLANNING_HDD_BANDWIDTH : XORFS_PLANNING_SSD_BANDWIDTH;
+
+   // Share of allocated data
+   double density = 1;
+   if (source_file->stat.st_size > 0)
+   {
+      density = (double) source_file->stat.st_blocks * 512 / source_file->stat.st_size;
+      density = density > 1 ? 1 : density;
+   }
+
+   return XORFS_PLANNING_FILE_COST + density * (latency + XORFS_PLANNING_READ_SIZE / bandwidth);
+}
+
+struct xorfs_planning_heap {
+   unsigned int count;
+   double *costs;
+   int *backup_indexes;
+};
+
+void xorfs_planning_heap_push(struct xorfs_planning_heap *heap, double cost, int backup_index)
+{
+   unsigned int position = heap->count;
+   heap->count++;
+
+   while (position > 0 && heap->costs[(position - 1) / 2] > cost)
+   {
+      heap->costs[position] = heap->costs[(position - 1) / 2];
+      heap->backup_indexes[position] = heap->backup_indexes[(position - 1) / 2];
+      position = (position - 1) / 2;
+   }
+
+   heap->costs[position] = cost;
+   heap->backup_indexes[position] = backup_index;
+}
+
+void xorfs_planning_heap_pop(struct xorfs_planning_heap *heap, double *cost, int *backup_index)
+{
+   *cost = heap->costs[0];
+   *backup_index = heap->backup_indexes[0];
+   heap->count--;
+
+   double last_cost = heap->costs[heap->count];
+   int last_backup_index = heap->backup_indexes[heap->count];
+   unsigned int position = 0;
+
+   while (2 * position + 1 < heap->count)
+   {
+      unsigned int child = 2 * position + 1;
+      if (child + 1 < heap->count && heap->costs[child + 1] < heap->costs[child])
+      {
+         child++;
+      }
+
+      if (heap->costs[child] >= last_cost)
+      {
+         break;
+      }
+
+      heap->costs[position] = heap->costs[child];
+      heap->backup_indexes[position] = heap->backup_indexes[child];
+      position = child;
+   }
+
+   heap->costs[position] = last_cost;
+   heap->backup_indexes[position] = last_backup_index;
+}
+
+/**
+ * Choose source files to read backups from
+ *
+ * Backups and source files form a graph - a xored image is an edge from
+ * the backup it is xored against, a plain image is an edge from nowhere.
+ * A backup may be provided by several source files - xored against different
+ * backups (shortcut or skip deltas), or left behind by an interrupted offline
+ * tool. Edges are weighted by xorfs_get_source_file_cost() and each backup
+ * is read from the source file on its cheapest path (Dijkstra), the others
+ * are marked as duplicates. Links point to the chosen source files.
+ */
+int xorfs_plan_reconstruction()
+{
+   unsigned int count = xorfs_source_files.count;
+   int return_value = 0;
+   int *backup_indexes = malloc(count * sizeof (int)); // First source file of the same backup
+   int *parent_indexes = malloc(count * sizeof (int)); // First source file of the backup xored against, -1 if none
+   double *file_costs = malloc(count * sizeof (double));
+   int *children_starts = malloc((count + 1) * sizeof (int)); // Source files xored against a backup, indexed by first source file
+   int *children = malloc(count * sizeof (int));
+   double *backup_costs = malloc(count * sizeof (double)); // Indexed by first source file
+   int *chosen_indexes = malloc(count * sizeof (int)); // Indexed by first source file
+   char *settled = calloc(count, 1); // Indexed by first source file
+   struct xorfs_planning_heap heap = { 0, malloc((2 * count + 1) * sizeof (double)), malloc((2 * count + 1) * sizeof (int)) };
+   unsigned int backup_slot_count = 64;
+
+   // Keep at most half of the slots used
+   while (backup_slot_count < count * 2)
+   {
+      backup_slot_count *= 2;
+   }
+
+   int *backup_slots = calloc(backup_slot_count, sizeof (int)); // First source file of a backup + 1, by set and number
+
+   if (backup_indexes == NULL || parent_indexes == NULL || file_costs == NULL || children_starts == NULL || children == NULL
+       || backup_costs == NULL || chosen_indexes == NULL || settled == NULL || heap.costs == NULL || heap.backup_indexes == NULL || backup_slots == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return_value = 1;
+      goto cleanup;
+   }
+
+   // Group source files by backup
+   for (int index = 0; index < count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      backup_indexes[index] = index;
+      backup_costs[index] = HUGE_VAL;
+      chosen_indexes[index] = -1;
+      file_costs[index] = xorfs_get_source_file_cost(xorfs_source_files.files + index);
+
+      unsigned int slot = xorfs_find_backup_slot(backup_slots, backup_slot_count, backup->set, backup->number);
+      if (backup_slots[slot] != 0)
+      {
+         backup_indexes[index] = backup_slots[slot] - 1;
+      }
+      else
+      {
+         backup_slots[slot] = index + 1;
+      }
+   }
+
+   // Edges
+   for (int index = 0; index <= count; index++)
+   {
+      children_starts[index] = 0;
+   }
+
+   for (int index = 0; index < count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      parent_indexes[index] = -1;
+
+      if (backup->xor_against_number == 0)
+      {
+         continue;
+      }
+
+      unsigned int slot = xorfs_find_backup_slot(backup_slots, backup_slot_count, backup->set, backup->xor_against_number);
+      if (backup_slots[slot] != 0)
+      {
+         parent_indexes[index] = backup_slots[slot] - 1;
+         children_starts[parent_indexes[index] + 1]++;
+      }
+
+      if (parent_indexes[index] < 0)
+      {
+         xorfs_log(XORFS_LOG_NOTICE, "'%s' is xored against backup %i, but that is missing\n", xorfs_source_files.files[index].name, backup->xor_against_number);
+      }
+   }
+
+   for (int index = 0; index < count; index++)
+   {
+      children_starts[index + 1] += children_starts[index];
+   }
+
+   {
+      int *positions = chosen_indexes; // Borrowed, reset below
+
+      for (int index = 0; index < count; index++)
+      {
+         positions[index] = children_starts[index];
+      }
+
+      for (int index = 0; index < count; index++)
+      {
+         if (parent_indexes[index] >= 0)
+         {
+            children[positions[parent_indexes[index]]] = index;
+            positions[parent_indexes[index]]++;
+         }
+      }
+
+      for (int index = 0; index < count; index++)
+      {
+         positions[index] = -1;
+      }
+   }
+
+   // Cheapest paths
+   {
+      for (int index = 0; index < count; index++)
+      {
+         int backup_index = backup_indexes[index];
+
+         if (xorfs_source_files.files[index].backup.xor_against_number == 0 && file_costs[index] < backup_costs[backup_index])
+         {
+            backup_costs[backup_index] = file_costs[index];
+            chosen_indexes[backup_index] = index;
+            xorfs_planning_heap_push(&heap, file_costs[index], backup_index);
+         }
+      }
+
+      while (heap.count > 0)
+      {
+         double cost;
+         int backup_index;
+
+         xorfs_planning_heap_pop(&heap, &cost, &backup_index);
+         if (settled[backup_index])
+         {
+            continue;
+         }
+
+         settled[backup_index] = 1;
+
+         for (int position = children_starts[backup_index]; position < children_starts[backup_index + 1]; position++)
+         {
+            int child_index = children[position];
+            int child_backup_index = backup_indexes[child_index];
+            double child_cost = cost + file_costs[child_index];
+
+            if (!settled[child_backup_index] && child_cost < backup_costs[child_backup_index])
+            {
+               backup_costs[child_backup_index] = child_cost;
+               chosen_indexes[child_backup_index] = child_index;
+               xorfs_planning_heap_push(&heap, child_cost, child_backup_index);
+            }
+         }
+      }
+   }
+
+   // Choose
+   for (int index = 0; index < count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      int backup_index = backup_indexes[index];
+
+      if (chosen_indexes[backup_index] < 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Backup %s-%i cannot be reconstructed - its chain misses a backup or contains a loop\n", source_file->backup.name, source_file->backup.number);
+         return_value = 1;
+         goto cleanup;
+      }
+
+      source_file->is_duplicate = (chosen_indexes[backup_index] != index);
+      source_file->backup.xor_against_source_file = NULL;
+      source_file->backup.cost = file_costs[index];
+
+      if (parent_indexes[index] >= 0)
+      {
+         source_file->backup.xor_against_source_file = xorfs_source_files.files + chosen_indexes[parent_indexes[index]];
+         source_file->backup.cost += backup_costs[parent_indexes[index]];
+      }
+
+      if (source_file->is_duplicate)
+      {
+         xorfs_log(XORFS_LOG_INFO, "Backup %s-%i is read from '%s', not from '%s'\n", source_file->backup.name, source_file->backup.number, xorfs_source_files.files[chosen_indexes[backup_index]].name, source_file->name);
+      }
+   }
+
+   // Depths along the chosen links
+   for (int index = 0; index < count; index++)
+   {
+      xorfs_source_files.files[index].backup.depth = xorfs_source_files.files[index].backup.xor_against_source_file == NULL ? 0 : UINT_MAX;
+   }
+
+   for (int index = 0; index < count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      unsigned int depth = 0;
+
+      while (source_file->backup.depth == UINT_MAX)
+      {
+         source_file = source_file->backup.xor_against_source_file;
+         depth++;
+      }
+
+      depth += source_file->backup.depth;
+      source_file = xorfs_source_files.files + index;
+
+      while (source_file->backup.depth == UINT_MAX)
+      {
+         source_file->backup.depth = depth;
+         source_file = source_file->backup.xor_against_source_file;
+         depth--;
+      }
+   }
+
+   cleanup:
+   free(backup_indexes);
+   free(parent_indexes);
+   free(file_costs);
+   free(children_starts);
+   free(children);
+   free(backup_costs);
+   free(chosen_indexes);
+   free(settled);
+   free(heap.costs);
+   free(heap.backup_indexes);
+   free(backup_slots);
+   return return_value;
+}
+
+int xorfs_create_debug_file(struct xorfs_source_files *source_files)
+{
+   char mkstemp_template[] = "/tmp/xorfs-debug-XXXXXX";
+   int fd = mkstemp(mkstemp_template);
+   if (fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to create temporary file\n");
+      return -1;
+   }
+
+   dprintf(fd, "XORFS\n");
+   dprintf(fd, "version: %i.%i\n", XORFS_VERSION_MAJOR, XORFS_VERSION_MINOR);
+   dprintf(fd, "----------------------------------------\n\n");
+
+   dprintf(fd, "Source files:\n");
+   dprintf(fd, "total %i\n\n", xorfs_source_files.count);
+
+   for (int file_index = 0; file_index < xorfs_source_files.count; file_index++)
+   {
+      struct xorfs_source_file *sf = xorfs_source_files.files + file_index;
+
+      dprintf(fd, "Source file #%i, at %p\n", file_index, sf);
+      dprintf(fd, " - File name: %s\n", sf->name);
+      dprintf(fd, " - Backup:\n");
+      dprintf(fd, "   - Name: %s\n", sf->backup.name);
+      dprintf(fd, "   - Number: %i\n", sf->backup.number);
+      dprintf(fd, "   - Xored against number (link): %i (%p)\n", sf->backup.xor_against_number, sf->backup.xor_against_source_file);
+      dprintf(fd, "   - Depth: %u\n", sf->backup.depth);
+      dprintf(fd, "   - Cost: %.1f us\n", sf->backup.cost);
+      dprintf(fd, "   - Size: %li\n", sf->backup.size);
+      dprintf(fd, "   - Checkpoint: %s\n", sf->backup.checkpoint != NULL ? sf->backup.checkpoint->name : "none");
+      dprintf(fd, " - Duplicate: %s\n", sf->is_duplicate ? "yes" : "no");
+   }
+
+   return fd;
+}
+
+/**
+ * Copy of `name` in the name pool of the source files, NULL on failure
+ */
+char* xorfs_pool_name(struct xorfs_source_files *source_files, const char *name)
+{
+   size_t size = strlen(name) + 1;
+   struct xorfs_name_chunk *chunk = source_files->name_chunks;
+
+   if (chunk == NULL || XORFS_NAME_CHUNK_SIZE - chunk->used_size < size)
+   {
+      chunk = malloc(sizeof (struct xorfs_name_chunk));
+      if (chunk == NULL)
+      {
+         return NULL;
+      }
+
+      chunk->next = source_files->name_chunks;
+      chunk->used_size = 0;
+      source_files->name_chunks = chunk;
+   }
+
+   char *pooled_name = chunk->names + chunk->used_size;
+   memcpy(pooled_name, name, size);
+   chunk->used_size += size;
+   return pooled_name;
+}
+
+/**
+ * Fill the lookup slots of xorfs_source_files by output file names, and
+ * by set and number
+ */
+int xorfs_index_source_files()
+{
+   struct xorfs_source_files *source_files = &xorfs_source_files;
+   unsigned int slot_count = 64;
+
+   // Keep at most half of the slots used
+   while (slot_count < source_files->count * 2)
+   {
+      slot_count *= 2;
+   }
+
+   source_files->lookup_slots = calloc(slot_count, sizeof (struct xorfs_lookup_slot));
+   source_files->backup_slots = calloc(slot_count, sizeof (int));
+   if (source_files->lookup_slots == NULL || source_files->backup_slots == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return -1;
+   }
+
+   source_files->lookup_slot_count = slot_count;
+
+   for (unsigned int index = 0; index < source_files->count; index++)
+   {
+      struct xorfs_source_file *source_file = source_files->files + index;
+      if (source_file->is_duplicate)
+      {
+         continue;
+      }
+
+      uint32_t hash = xorfs_hash_name(source_file->name, source_file->backup.output_name_length);
+      unsigned int slot = hash & (slot_count - 1);
+      while (source_files->lookup_slots[slot].index != 0)
+      {
+         slot = (slot + 1) & (slot_count - 1);
+      }
+
+      source_files->lookup_slots[slot].hash = hash;
+      source_files->lookup_slots[slot].index = index + 1;
+
+      source_files->backup_slots[xorfs_find_backup_slot(source_files->backup_slots, slot_count, source_file->backup.set, source_file->backup.number)] = index + 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Map the block history indexes of the backup sets which have one
+ */
+int xorfs_open_histories(struct xorfs_source_files *catalog)
+{
+   catalog->history_count = xorfs_backup_sets.count;
+   catalog->histories = calloc(catalog->history_count, sizeof (struct xorfs_history));
+   if (catalog->histories == NULL && catalog->history_count > 0)
+   {
+      catalog->history_count = 0;
+      return -ENOMEM;
+   }
+
+   for (unsigned int set = 0; set < catalog->history_count; set++)
+   {
+      struct xorfs_history *history = catalog->histories + set;
+      struct xorfs_history_header header;
+      struct stat file_stat;
+      char *file_name = NULL;
+      char *path = NULL;
+
+      if (asprintf(&file_name, "%s%s", xorfs_backup_sets.sets[set].name, XORFS_HISTORY_FILE_EXTENSION) < 0 || (path = xorfs_construct_source_file_path(file_name)) == NULL)
+      {
+         free(file_name);
+         return -ENOMEM;
+      }
+
+      int fd = open(path, O_RDONLY);
+      if (fd >= 0)
+      {
+         if (fstat(fd, &file_stat) != 0 || pread(fd, &header, sizeof header, 0) != sizeof header
+             || memcmp(header.magic, XORFS_HISTORY_MAGIC, sizeof header.magic) != 0
+             || le32toh(header.version) != XORFS_HISTORY_VERSION
+             || sizeof header + (le64toh(header.block_count) + 1) * sizeof (uint64_t) + le64toh(header.entry_count) * sizeof (uint32_t) != file_stat.st_size)
+         {
+            xorfs_log(XORFS_LOG_WARNING, "Ignoring '%s', not a block history index of version %i\n", file_name, XORFS_HISTORY_VERSION);
+         }
+         else
+         {
+            history->mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (history->mapping == MAP_FAILED)
+            {
+               xorfs_log(XORFS_LOG_ERROR, "Unable to map '%s': %s\n", file_name, strerror(errno));
+               history->mapping = NULL;
+            }
+            else
+            {
+               history->mapping_size = file_stat.st_size;
+               history->block_size = le32toh(header.block_size);
+               history->last_number = le32toh(header.last_number);
+               history->block_count = le64toh(header.block_count);
+               history->offsets = (const uint64_t *) ((char *) history->mapping + sizeof header);
+               history->numbers = (const uint32_t *) (history->offsets + history->block_count + 1);
+            }
+         }
+
+         close(fd);
+      }
+
+      free(file_name);
+      free(path);
+   }
+
+   return 0;
+}
+
+/**
+ * Numbers of the backups which changed the block at `offset`, up to
+ * `capacity` of them into `numbers`; how many there are
+ */
+uint64_t xorfs_get_block_history(const struct xorfs_history *history, off_t offset, uint32_t *numbers, uint32_t capacity)
+{
+   uint64_t block = offset / history->block_size;
+
+   if (offset < 0 || block >= history->block_count)
+   {
+      return 0;
+   }
+
+   uint64_t first = le64toh(history->offsets[block]);
+   uint64_t count = le64toh(history->offsets[block + 1]) - first;
+
+   for (uint64_t index = 0; index < count && index < capacity; index++)
+   {
+      numbers[index] = le32toh(history->numbers[first + index]);
+   }
+
+   return count;
+}
+
+int xorfs_open_source_files (char *directory_path)
+{
+    int return_value;
+    DIR* source_directory;
+
+    // Open the directory
+    source_directory = opendir(directory_path);
+    if (source_directory == NULL)
+    {
+        xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s' as source directory\n", directory_path);
+        return_value = 1;
+        goto failure_return;
+    }
+
+    // Process entries one-by-one
+    {
+       struct dirent* entry;
+
+       while (entry = readdir(source_directory))
+       // Process a directory entry
+       {
+           xorfs_log(XORFS_LOG_DEBUG, "Source file: '%s', inode %i, type %i\n", entry->d_name, entry->d_ino, entry->d_type);
+
+           // Filter out unwanted entries
+           {
+               // Process only regular files
+               if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+               {
+                   xorfs_log(XORFS_LOG_DEBUG, "Ignoring file '%s' - not a regular file\n", entry->d_name);
+                   continue;
+               }
+
+               // Process only .xor, .xorz, .xorc and .xorm files
+               if (!xorfs_has_extension(entry->d_name, XORFS_SOURCE_FILE_EXTENSION)
+                   && !xorfs_has_extension(entry->d_name, XORFS_PACKED_SOURCE_FILE_EXTENSION)
+                   && !xorfs_has_extension(entry->d_name, XORFS_COMPRESSED_SOURCE_FILE_EXTENSION)
+                   && !xorfs_has_extension(entry->d_name, XORFS_MANIFEST_SOURCE_FILE_EXTENSION))
+               {
+                   xorfs_log(XORFS_LOG_DEBUG, "Ignoring file '%s' - name not ending with '%s', '%s', '%s' or '%s'\n", entry->d_name, XORFS_SOURCE_FILE_EXTENSION, XORFS_PACKED_SOURCE_FILE_EXTENSION, XORFS_COMPRESSED_SOURCE_FILE_EXTENSION, XORFS_MANIFEST_SOURCE_FILE_EXTENSION);
+                   continue;
+               }
+           }
+
+           // Open a .xor file, store information about the file
+           {
+               // Allocate more memory for `struct xorfs_source_files`, twice as much each time
+               if (xorfs_source_files.count == xorfs_source_files.allocated_count)
+               {
+                   int new_allocated_count = xorfs_source_files.allocated_count > 0 ? xorfs_source_files.allocated_count * 2 : 64;
+                   size_t new_size = new_allocated_count * sizeof(struct xorfs_source_file);
+                   struct xorfs_source_file* new_memory = realloc(xorfs_source_files.files, new_size);
+                   if (new_memory == NULL)
+                   {
+                       xorfs_log(XORFS_LOG_ERROR, "Unable to allocate %l bytes of memory: %s\n", new_size, strerror(errno));
+                       return_value = 2;
+                       goto failure_close_files;
+                   }
+
+                   xorfs_source_files.files = new_memory;
+                   xorfs_source_files.allocated_count = new_allocated_count;
+               }
+
+               xorfs_source_files.count++;
+
+               // Fill the new `struct xorfs_source_file`
+               {
+                   int index = xorfs_source_files.count - 1;
+                   struct xorfs_source_file* new_source_file = xorfs_source_files.files + index;
+                   char *file_name = entry->d_name;
+                   int fd;
+
+                   // Safe-fill the structure
+                   {
+                      new_source_file->name = NULL;
+                      new_source_file->fd = -1;
+                      new_source_file->is_duplicate = 0;
+                      new_source_file->format = xorfs_get_source_format(file_name);
+                      new_source_file->indexes = NULL;
+                      new_source_file->backup.name = NULL;
+                      new_source_file->backup.number = 0;
+                      new_source_file->backup.xor_against_number = 0;
+                      new_source_file->backup.xor_against_source_file = NULL;
+                      new_source_file->backup.depth = 0;
+                      new_source_file->backup.cost = 0;
+                      new_source_file->backup.size = 0;
+                      new_source_file->backup.checkpoint = NULL;
+                      new_source_file->backup.read_bytes = 0;
+                      new_source_file->backup.output_name_length = 0;
+                   }
+
+                   // Obtain the file descriptor
+                   {
+                       char *file_path = NULL;
+
+                       // Construct path to file
+                       {
+                           file_path = xorfs_construct_source_file_path(file_name);
+                           if (file_path == NULL)
+                           {
+                               return_value = 3;
+                               goto failure_close_files;
+                           }
+                       }
+
+                       // Open the file
+                       {
+                          fd = open(file_path, O_RDONLY);
+                          if (fd < 0)
+                          {
+                              xorfs_log(XORFS_LOG_ERROR, "Unable to open file '%s': %s\n", file_path, strerror(errno));
+                              free(file_path);
+                              return_value = 3;
+                              goto failure_close_files;
+                          }
+                          else
+                          {
+                              xorfs_log(XORFS_LOG_DEBUG, "Successfully opened file '%s'\n", file_path);
+                          }
+                       }
+
+                       free(file_path);
+                       new_source_file->fd = fd;
+                   }
+
+                   // Copy name string
+                   {
+                      char* pooled_name = xorfs_pool_name(&xorfs_source_files, file_name);
+                      if (pooled_name == NULL)
+                      {
+                         xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+                         return_value = 3;
+                         goto failure_close_files;
+                      }
+
+                      new_source_file->name = pooled_name;
+                   }
+
+                   // Get stat info
+                   {
+                      int stat_result = xorfs_stat_source_file(new_source_file);
+                      if (stat_result != 0)
+                      {
+                         xorfs_log(XORFS_LOG_ERROR, "Unable to stat file '%s': %s\n", file_name, strerror(errno));
+                         return_value = 4;
+                         goto failure_close_files;
+                      }
+                   }
+
+                   // Allocate indexes of a file which is not raw
+                   if (new_source_file->format != XORFS_SOURCE_FORMAT_RAW
+                       && (new_source_file->indexes = calloc(1, sizeof (struct xorfs_source_file_indexes))) == NULL)
+                   {
+                      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+                      return_value = 3;
+                      goto failure_close_files;
+                   }
+
+                   // Map block index of a packed file
+                   if (new_source_file->format == XORFS_SOURCE_FORMAT_PACKED && xorfs_open_packed_index(new_source_file) != 0)
+                   {
+                      return_value = 4;
+                      goto failure_close_files;
+                   }
+
+                   // Map frame index of a compressed file
+                   if (new_source_file->format == XORFS_SOURCE_FORMAT_COMPRESSED && xorfs_open_compressed_index(new_source_file) != 0)
+                   {
+                      return_value = 4;
+                      goto failure_close_files;
+                   }
+
+                   // Map hashes of a manifest, with the first one open the block store
+                   if (new_source_file->format == XORFS_SOURCE_FORMAT_MANIFEST
+                       && ((xorfs_source_files.block_store == NULL && (xorfs_source_files.block_store = xorfs_open_block_store(0)) == NULL) || xorfs_open_manifest(new_source_file) != 0))
+                   {
+                      return_value = 4;
+                      goto failure_close_files;
+                   }
+
+                   if (new_source_file->format != XORFS_SOURCE_FORMAT_RAW && xorfs_index_unit_runs(new_source_file) != 0)
+                   {
+                      return_value = 4;
+                      goto failure_close_files;
+                   }
+
+                   new_source_file->backup.size = new_source_file->stat.st_size;
+
+                   // Get backup information
+                   {
+                      struct xorfs_backup* backup_info = &(new_source_file->backup);
+
+                      // Parse file name
+                      {
+                         int first_number_offset = 0;
+                         char* xOrDot;
+                         char *dot;
+
+                         // Characters until the first number are name
+                         {
+                            char current_char;
+                            int maximum_offset = strlen(new_source_file->name) - 1;
+
+                            // Find offset of first number
+                            do
+                            {
+                               current_char = new_source_file->name[first_number_offset];
 
                                if (current_char >= '0' && current_char <= '9')
                                {
@@ -582,159 +4612,5903 @@ int xorfs_open_source_files (char *directory_path)
                             }
                             while (1);
 
-                            // Copy name
-                            {
-                               int name_end_offset = first_number_offset - 1; // Remove trailing dash
-                               void* new_memory = malloc(name_end_offset + 1); // name + \0
-                               if (new_memory == NULL)
-                               {
-                                  xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
-                                  return_value = 5;
-                                  goto failure_close_files;
-                               }
+                            // Intern name
+                            {
+                               int name_end_offset = first_number_offset - 1; // Remove trailing dash
+                               int set = xorfs_intern_backup_set(new_source_file->name, name_end_offset);
+                               if (set < 0)
+                               {
+                                  return_value = 5;
+                                  goto failure_close_files;
+                               }
+
+                               backup_info->set = set;
+                               backup_info->name = xorfs_backup_sets.sets[set].name;
+                            }
+                         }
+
+                         // Read first number
+                         {
+                            unsigned long int number = 0;
+                            number = strtol(new_source_file->name + first_number_offset, &xOrDot, 10);
+                            // No error checking - there is a number at the beginning of the string here, always
+
+                            backup_info->number = (int) number;
+                         }
+
+                         // Then the rest of the name
+                         {
+                            if (*xOrDot == 'x')
+                            {
+                               // Read second number
+                               {
+                                  unsigned long int number = 0;
+                                  errno = 0;
+                                  number = strtol(xOrDot + 1, &dot, 10);
+                                  if (errno != 0)
+                                  {
+                                     xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': Cannot read second number after 'x'\n", new_source_file->name);
+                                     return_value = 5;
+                                     goto failure_close_files;
+                                  }
+
+                                  backup_info->xor_against_number = (int) number;
+                               }
+                            }
+                            else if (*xOrDot == '.')
+                            {
+                               // This is a plain image file
+                               backup_info->xor_against_number = 0;
+                               backup_info->xor_against_source_file = NULL;
+                               dot = xOrDot;
+                            }
+                            else
+                            {
+                               xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': No 'x' or '.' after the first number\n", new_source_file->name);
+                               return_value = 5;
+                               goto failure_close_files;
+                            }
+                         }
+
+                         // Verify that we ended on a '.'
+                         if (*dot != '.')
+                         {
+                            xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': Dot not found when expected\n", new_source_file->name);
+                            return_value = 5;
+                            goto failure_close_files;
+                         }
+
+                         // Output file name is the string until after the first number, and ".dat"
+                         backup_info->output_name_length = xOrDot - new_source_file->name;
+                      }
+                   }
+               }
+           }
+       }
+    }
+
+    // Choose source files to read backups from and fill the links
+    if (xorfs_plan_reconstruction() != 0)
+    {
+       return_value = 6;
+       goto failure_close_files;
+    }
+
+    if (xorfs_index_source_files() != 0)
+    {
+       return_value = 7;
+       goto failure_close_files;
+    }
+
+    if (xorfs_open_histories(&xorfs_source_files) != 0)
+    {
+       return_value = 8;
+       goto failure_close_files;
+    }
+
+    // Success
+    closedir(source_directory);
+    return 0;
+
+    // Fail procedure
+    failure_close_files:
+    xorfs_free_source_files(&xorfs_source_files);
+    failure_closedir:
+    closedir(source_directory);
+    failure_return:
+    return return_value;
+}
+
+/*
+ * Offline tools
+ *
+ * Run as `xorfs <tool> <source directory> ...` instead of mounting.
+ * Tools change the source directory only by atomic renames and by removing
+ * files which are no longer needed, so it stays readable at any moment.
+ */
+
+int xorfs_get_backup_depth(struct xorfs_source_file *source_file)
+{
+   struct xorfs_source_file *first_source_file = source_file;
+   int depth = 0;
+
+   while (source_file->backup.xor_against_number != 0)
+   {
+      source_file = source_file->backup.xor_against_source_file;
+      depth++;
+
+      if (depth > xorfs_source_files.count)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Chain of backup %s-%i contains a loop\n", first_source_file->backup.name, first_source_file->backup.number);
+         return -1;
+      }
+   }
+
+   return depth;
+}
+
+struct xorfs_source_file* xorfs_get_plain_source_file(struct xorfs_source_file *source_file)
+{
+   while (source_file->backup.xor_against_number != 0)
+   {
+      source_file = source_file->backup.xor_against_source_file;
+   }
+
+   return source_file;
+}
+
+/**
+ * Logical size of the shortest backup in the chain, past it the xored images
+ * of the longer ones apply to zeros
+ */
+off_t xorfs_get_chain_size(struct xorfs_source_file *source_file)
+{
+   off_t size = source_file->backup.size;
+
+   while (source_file->backup.xor_against_number != 0)
+   {
+      source_file = source_file->backup.xor_against_source_file;
+      size = source_file->backup.size < size ? source_file->backup.size : size;
+   }
+
+   return size;
+}
+
+/**
+ * Length of the range from `offset` (at most `size`) in which no xored image
+ * of the chain has data, so the backup equals its plain image there.
+ */
+off_t xorfs_get_chain_hole_length(struct xorfs_source_file *source_file, off_t offset, off_t size)
+{
+   off_t hole_length = size;
+
+   while (source_file->backup.xor_against_number != 0 && hole_length > 0)
+   {
+      off_t data_offset = xorfs_seek_source_file(source_file, offset, SEEK_DATA);
+      if (data_offset < 0)
+      {
+         if (errno != ENXIO)
+         {
+            // Cannot tell, treat as data
+            return 0;
+         }
+
+         // No data until the end of file
+      }
+      else if (data_offset - offset < hole_length)
+      {
+         hole_length = data_offset - offset;
+      }
+
+      source_file = source_file->backup.xor_against_source_file;
+   }
+
+   return hole_length;
+}
+
+/**
+ * Length of the extent of the backup from `offset` (up to `size`), which is
+ * either a hole in all source files of its chain, or data in some of them
+ */
+off_t xorfs_get_backup_extent(struct xorfs_source_file *source_file, off_t offset, off_t size, int *is_hole)
+{
+   off_t end = offset + size;
+   off_t nearest_data = end;
+
+   // Hole, up to the nearest data in any file
+   for (struct xorfs_source_file *file = source_file; file != NULL; file = file->backup.xor_against_number != 0 ? file->backup.xor_against_source_file : NULL)
+   {
+      off_t data_offset = xorfs_seek_source_file(file, offset, SEEK_DATA);
+      if (data_offset < 0 && errno != ENXIO)
+      {
+         // Cannot tell, treat as data
+         *is_hole = 0;
+         return size;
+      }
+
+      if (data_offset >= 0 && data_offset < nearest_data)
+      {
+         nearest_data = data_offset;
+      }
+   }
+
+   if (nearest_data > offset)
+   {
+      *is_hole = 1;
+      return nearest_data - offset;
+   }
+
+   // Data, up to where all files have a hole
+   off_t position = offset;
+   int moved = 1;
+   *is_hole = 0;
+
+   while (moved && position < end)
+   {
+      moved = 0;
+
+      for (struct xorfs_source_file *file = source_file; file != NULL; file = file->backup.xor_against_number != 0 ? file->backup.xor_against_source_file : NULL)
+      {
+         if (xorfs_seek_source_file(file, position, SEEK_DATA) == position)
+         {
+            off_t hole_offset = xorfs_seek_source_file(file, position, SEEK_HOLE);
+            position = hole_offset > position ? hole_offset : end;
+            moved = 1;
+         }
+      }
+   }
+
+   return (position < end ? position : end) - offset;
+}
+
+const char* xorfs_get_source_file_extension(struct xorfs_source_file *source_file)
+{
+   switch (source_file->format)
+   {
+      case XORFS_SOURCE_FORMAT_PACKED: return XORFS_PACKED_SOURCE_FILE_EXTENSION;
+      case XORFS_SOURCE_FORMAT_COMPRESSED: return XORFS_COMPRESSED_SOURCE_FILE_EXTENSION;
+      case XORFS_SOURCE_FORMAT_MANIFEST: return XORFS_MANIFEST_SOURCE_FILE_EXTENSION;
+      default: return XORFS_SOURCE_FILE_EXTENSION;
+   }
+}
+
+char* xorfs_construct_backup_file_name(const char *backup_name, unsigned int number, unsigned int xor_against_number, const char *extension)
+{
+   char *file_name = NULL;
+   int asprintf_result;
+
+   if (xor_against_number == 0)
+   {
+      asprintf_result = asprintf(&file_name, "%s-%u%s", backup_name, number, extension);
+   }
+   else
+   {
+      asprintf_result = asprintf(&file_name, "%s-%ux%u%s", backup_name, number, xor_against_number, extension);
+   }
+
+   if (asprintf_result < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return NULL;
+   }
+
+   return file_name;
+}
+
+/**
+ * Write the buffer, leaving holes in place of zero blocks
+ */
+int xorfs_write_sparse(int fd, const char *buffer, size_t size, off_t offset)
+{
+   size_t position = 0;
+
+   while (position < size)
+   {
+      size_t data_start;
+      size_t block_size;
+
+      // Skip zero blocks
+      while (position < size)
+      {
+         block_size = size - position < XORFS_SPARSE_BLOCK_SIZE ? size - position : XORFS_SPARSE_BLOCK_SIZE;
+         if (buffer[position] != 0 || memcmp(buffer + position, buffer + position + 1, block_size - 1) != 0)
+         {
+            break;
+         }
+
+         position += block_size;
+      }
+
+      // Collect non-zero blocks
+      data_start = position;
+      while (position < size)
+      {
+         block_size = size - position < XORFS_SPARSE_BLOCK_SIZE ? size - position : XORFS_SPARSE_BLOCK_SIZE;
+         if (buffer[position] == 0 && memcmp(buffer + position, buffer + position + 1, block_size - 1) == 0)
+         {
+            break;
+         }
+
+         position += block_size;
+      }
+
+      // Write them
+      while (data_start < position)
+      {
+         ssize_t written_bytes = pwrite(fd, buffer + data_start, position - data_start, offset + data_start);
+         if (written_bytes < 0)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to write at offset %li: %s\n", offset + data_start, strerror(errno));
+            return -EIO;
+         }
+
+         data_start += written_bytes;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Copy a range of the source file's image into a file, at the same offset
+ *
+ * Holes of the image are skipped. Data of raw source files is copied by
+ * copy_file_range(), which shares the extents (reflink) where
+ * the filesystem supports it.
+ */
+int xorfs_copy_range(struct xorfs_source_file *source_file, int output_fd, off_t offset, off_t length)
+{
+   int input_fd = source_file->fd;
+   off_t end = offset + length;
+
+   while (offset < end)
+   {
+      // Find data in the input
+      {
+         off_t data_offset = xorfs_seek_source_file(source_file, offset, SEEK_DATA);
+         if (data_offset < 0 || data_offset >= end)
+         {
+            // Only a hole remains
+            return 0;
+         }
+
+         offset = data_offset;
+      }
+
+      off_t hole_offset = xorfs_seek_source_file(source_file, offset, SEEK_HOLE);
+      if (hole_offset < 0 || hole_offset > end)
+      {
+         hole_offset = end;
+      }
+
+      while (offset < hole_offset)
+      {
+         ssize_t copied_bytes = -1;
+         errno = EINVAL;
+
+         if (source_file->format == XORFS_SOURCE_FORMAT_RAW)
+         {
+            loff_t input_offset = offset;
+            loff_t output_offset = offset;
+            copied_bytes = copy_file_range(input_fd, &input_offset, output_fd, &output_offset, hole_offset - offset, 0);
+         }
+
+         if (copied_bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+         // Fall back to reading and writing
+         {
+            char buffer[XORFS_SPARSE_BLOCK_SIZE * 16];
+            size_t to_copy = hole_offset - offset < sizeof buffer ? hole_offset - offset : sizeof buffer;
+
+            copied_bytes = xorfs_read_plain(source_file, buffer, offset, to_copy);
+            if (copied_bytes > 0 && xorfs_write_sparse(output_fd, buffer, copied_bytes, offset) != 0)
+            {
+               copied_bytes = -1;
+            }
+         }
+
+         if (copied_bytes < 0)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to copy data at offset %li: %s\n", offset, strerror(errno));
+            return -EIO;
+         }
+         else if (copied_bytes == 0)
+         {
+            // Input ends sooner than expected
+            return 0;
+         }
+
+         offset += copied_bytes;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Write the whole content of a backup into `output_fd`
+ *
+ * Ranges unchanged against the plain image are copied from it,
+ * the rest is reconstructed chunk by chunk and written sparse.
+ */
+int xorfs_materialize_backup(struct xorfs_source_file *source_file, int output_fd)
+{
+   struct xorfs_source_file *plain_source_file = xorfs_get_plain_source_file(source_file);
+   off_t size = source_file->backup.size;
+   off_t chain_size = xorfs_get_chain_size(source_file);
+   off_t offset = 0;
+   int return_value = 0;
+
+   char *buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   if (buffer == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   while (offset < size)
+   {
+      off_t chunk_size = size - offset < XORFS_TOOL_CHUNK_SIZE ? size - offset : XORFS_TOOL_CHUNK_SIZE;
+      off_t hole_length = xorfs_get_chain_hole_length(source_file, offset, chunk_size);
+
+      if (hole_length > 0)
+      // Same as in the plain image
+      {
+         // Up to the shortest backup of the chain, zeros past it
+         off_t plain_size = plain_source_file->backup.size < chain_size ? plain_source_file->backup.size : chain_size;
+         if (offset < plain_size)
+         {
+            off_t copy_length = plain_size - offset < hole_length ? plain_size - offset : hole_length;
+
+            return_value = xorfs_copy_range(plain_source_file, output_fd, offset, copy_length);
+            if (return_value < 0)
+            {
+               break;
+            }
+         }
+
+         offset += hole_length;
+      }
+      else
+      // Changed, reconstruct
+      {
+         int read_bytes = xorfs_read_backup(source_file, buffer, offset, chunk_size);
+         if (read_bytes <= 0)
+         {
+            return_value = read_bytes < 0 ? read_bytes : -EIO;
+            break;
+         }
+
+         return_value = xorfs_write_sparse(output_fd, buffer, read_bytes, offset);
+         if (return_value < 0)
+         {
+            break;
+         }
+
+         offset += read_bytes;
+      }
+   }
+
+   // Set the size, trailing holes included
+   if (return_value == 0 && ftruncate(output_fd, size) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to set size of materialized backup %s-%i: %s\n", source_file->backup.name, source_file->backup.number, strerror(errno));
+      return_value = -EIO;
+   }
+
+   free(buffer);
+   return return_value;
+}
+
+void xorfs_sync_source_directory()
+{
+   int directory_fd = open(xorfs_source_directory_path, O_RDONLY | O_DIRECTORY);
+   if (directory_fd >= 0)
+   {
+      fsync(directory_fd);
+      close(directory_fd);
+   }
+}
+
+/**
+ * Create a hidden temporary file in the source directory,
+ * to be renamed to `file_name` by xorfs_commit_temporary_file()
+ */
+int xorfs_create_temporary_file(const char *file_name, char **temporary_path)
+{
+   char *temporary_file_name = NULL;
+
+   if (asprintf(&temporary_file_name, ".%s%s", file_name, XORFS_TEMPORARY_FILE_SUFFIX) < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return -1;
+   }
+
+   *temporary_path = xorfs_construct_source_file_path(temporary_file_name);
+   free(temporary_file_name);
+   if (*temporary_path == NULL)
+   {
+      return -1;
+   }
+
+   // Truncate - a leftover of an interrupted run may exist
+   int fd = open(*temporary_path, O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+   if (fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to create file '%s': %s\n", *temporary_path, strerror(errno));
+      free(*temporary_path);
+      *temporary_path = NULL;
+   }
+
+   return fd;
+}
+
+/**
+ * Flush the temporary file and atomically rename it to `file_name`
+ *
+ * Closes the descriptor and frees the temporary path in any case.
+ */
+int xorfs_commit_temporary_file(int fd, char *temporary_path, const char *file_name)
+{
+   int return_value = 0;
+   char *file_path = xorfs_construct_source_file_path(file_name);
+
+   if (file_path == NULL)
+   {
+      return_value = -ENOMEM;
+   }
+   else if (fsync(fd) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to flush '%s': %s\n", temporary_path, strerror(errno));
+      return_value = -EIO;
+   }
+   else if (rename(temporary_path, file_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to rename '%s' to '%s': %s\n", temporary_path, file_path, strerror(errno));
+      return_value = -EIO;
+   }
+   else
+   // Persist the rename
+   {
+      xorfs_sync_source_directory();
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+   }
+
+   close(fd);
+   free(temporary_path);
+   free(file_path);
+   return return_value;
+}
+
+int xorfs_remove_source_file(struct xorfs_source_file *source_file)
+{
+   char *file_path = xorfs_construct_source_file_path(source_file->name);
+   if (file_path == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   // Open descriptors stay usable, other jobs may still read the file
+   int unlink_result = unlink(file_path);
+   if (unlink_result != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to remove '%s': %s\n", file_path, strerror(errno));
+   }
+
+   free(file_path);
+   return unlink_result == 0 ? 0 : -EIO;
+}
+
+int xorfs_rename_source_file(struct xorfs_source_file *source_file, const char *file_name)
+{
+   int return_value = 0;
+   char *old_path = xorfs_construct_source_file_path(source_file->name);
+   char *new_path = xorfs_construct_source_file_path(file_name);
+
+   if (old_path == NULL || new_path == NULL)
+   {
+      return_value = -ENOMEM;
+   }
+   else if (rename(old_path, new_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to rename '%s' to '%s': %s\n", old_path, new_path, strerror(errno));
+      return_value = -EIO;
+   }
+   else
+   {
+      xorfs_sync_source_directory();
+   }
+
+   free(old_path);
+   free(new_path);
+   return return_value;
+}
+
+/**
+ * Write a plain image of the backup next to its current source file
+ */
+int xorfs_write_plain_image(struct xorfs_source_file *source_file)
+{
+   char *temporary_path = NULL;
+   int return_value;
+
+   char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, 0, XORFS_SOURCE_FILE_EXTENSION);
+   if (file_name == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   int fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      free(file_name);
+      return -EIO;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Materializing backup %s-%i into '%s'\n", source_file->backup.name, source_file->backup.number, file_name);
+
+   return_value = xorfs_materialize_backup(source_file, fd);
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else
+   {
+      return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   }
+
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Write a xored image of the backup against another one of its set as `file_name`
+ *
+ * The xored image has the size of the backup, the other one is zeros past its end.
+ */
+int xorfs_write_xored_backup(struct xorfs_source_file *source_file, struct xorfs_source_file *target_source_file, const char *file_name)
+{
+   off_t size = source_file->backup.size;
+   off_t chain_size = xorfs_get_chain_size(source_file);
+   off_t target_chain_size = xorfs_get_chain_size(target_source_file);
+   char *temporary_path = NULL;
+   char *first_buffer = NULL;
+   char *second_buffer = NULL;
+   int return_value = 0;
+   int fd = -1;
+
+   // Past the shortest backup of either chain, backups are not their plain image
+   chain_size = target_chain_size < chain_size ? target_chain_size : chain_size;
+
+   first_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   second_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   if (first_buffer == NULL || second_buffer == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   for (off_t offset = 0; offset < size && return_value == 0; )
+   {
+      off_t chunk_size = size - offset < XORFS_TOOL_CHUNK_SIZE ? size - offset : XORFS_TOOL_CHUNK_SIZE;
+
+      // Both backups equal their common plain image here, so the delta is zero
+      if (offset < chain_size && xorfs_get_plain_source_file(source_file) == xorfs_get_plain_source_file(target_source_file))
+      {
+         off_t hole_length = xorfs_get_chain_hole_length(source_file, offset, chain_size - offset < chunk_size ? chain_size - offset : chunk_size);
+         off_t target_hole_length = xorfs_get_chain_hole_length(target_source_file, offset, chunk_size);
+
+         hole_length = target_hole_length < hole_length ? target_hole_length : hole_length;
+         if (hole_length > 0)
+         {
+            offset += hole_length;
+            continue;
+         }
+      }
+
+      int first_read_bytes = xorfs_read_backup(source_file, first_buffer, offset, chunk_size);
+      int second_read_bytes = xorfs_read_backup(target_source_file, second_buffer, offset, chunk_size);
+      if (first_read_bytes <= 0 || second_read_bytes < 0)
+      {
+         return_value = -EIO;
+         break;
+      }
+
+      // Target may be shorter
+      if (second_read_bytes < first_read_bytes)
+      {
+         memset(second_buffer + second_read_bytes, 0, first_read_bytes - second_read_bytes);
+      }
+
+      xorfs_xor_buffers(first_buffer, second_buffer, first_read_bytes);
+      return_value = xorfs_write_sparse(fd, first_buffer, first_read_bytes, offset);
+      offset += first_read_bytes;
+   }
+
+   if (return_value == 0 && ftruncate(fd, size) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to set size of '%s': %s\n", temporary_path, strerror(errno));
+      return_value = -EIO;
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else
+   {
+      return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   }
+
+   cleanup:
+   free(first_buffer);
+   free(second_buffer);
+   return return_value;
+}
+
+/**
+ * Replace a xored image by a plain image of the same backup
+ *
+ * Xored images against this backup stay valid - its data does not change.
+ */
+int xorfs_materialize_backup_in_place(struct xorfs_source_file *source_file)
+{
+   int return_value = xorfs_write_plain_image(source_file);
+
+   // The plain image is in place, the xored one is not needed
+   if (return_value == 0)
+   {
+      return_value = xorfs_remove_source_file(source_file);
+   }
+
+   return return_value;
+}
+
+/*
+ * Checkpoints
+ *
+ * Plain images of often read backups with long chains, written by a
+ * background thread into a directory of their own. Reads of a backup
+ * with a checkpoint go to it instead of the chain, so do reads of the
+ * backups xored against it.
+ */
+
+struct xorfs_checkpoints {
+   off_t used_size; // bytes allocated by checkpoints
+};
+
+struct xorfs_checkpoints xorfs_checkpoints = { 0 };
+
+char* xorfs_construct_checkpoint_path(const char *file_name)
+{
+   char *path = NULL;
+
+   if (asprintf(&path, "%s/%s", xorfs_options.checkpoint_directory, file_name) < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return NULL;
+   }
+
+   return path;
+}
+
+/**
+ * A checkpoint is valid, if it is newer than all source files of the chain
+ */
+int xorfs_is_checkpoint_valid(struct xorfs_source_file *source_file, const struct stat *checkpoint_stat)
+{
+   if (checkpoint_stat->st_size != source_file->backup.size)
+   {
+      return 0;
+   }
+
+   for (struct xorfs_source_file *file = source_file; file != NULL; file = file->backup.xor_against_number != 0 ? file->backup.xor_against_source_file : NULL)
+   {
+      if (file->backup.time > checkpoint_stat->st_mtime)
+      {
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+/**
+ * Open the checkpoint of the backup and make the reads use it
+ */
+int xorfs_open_checkpoint(struct xorfs_source_file *source_file, const char *file_name)
+{
+   struct xorfs_source_file *checkpoint = NULL;
+   char *path = xorfs_construct_checkpoint_path(file_name);
+   if (path == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open checkpoint '%s': %s\n", path, strerror(errno));
+      free(path);
+      return -EIO;
+   }
+
+   free(path);
+
+   checkpoint = calloc(1, sizeof (struct xorfs_source_file));
+   if (checkpoint == NULL || (checkpoint->name = strdup(file_name)) == NULL)
+   {
+      free(checkpoint);
+      close(fd);
+      return -ENOMEM;
+   }
+
+   checkpoint->fd = fd;
+   checkpoint->format = XORFS_SOURCE_FORMAT_RAW;
+   xorfs_stat_source_file(checkpoint);
+   checkpoint->backup.name = source_file->backup.name;
+   checkpoint->backup.set = source_file->backup.set;
+   checkpoint->backup.number = source_file->backup.number;
+   checkpoint->backup.size = source_file->backup.size;
+   checkpoint->backup.cost = xorfs_get_source_file_cost(checkpoint);
+
+   xorfs_checkpoints.used_size += checkpoint->stat.st_blocks * 512;
+
+   // Reads in progress finish through the chain, the following ones use the checkpoint
+   __atomic_store_n(&source_file->backup.checkpoint, checkpoint, __ATOMIC_RELEASE);
+   return 0;
+}
+
+/**
+ * Use valid checkpoints of the checkpoint directory, remove the others
+ */
+int xorfs_load_checkpoints()
+{
+   xorfs_checkpoints.used_size = 0;
+
+   // Adopt valid checkpoints
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (source_file->is_duplicate || source_file->backup.xor_against_number == 0)
+      {
+         continue;
+      }
+
+      char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, 0, XORFS_SOURCE_FILE_EXTENSION);
+      char *path = file_name != NULL ? xorfs_construct_checkpoint_path(file_name) : NULL;
+      struct stat checkpoint_stat;
+
+      if (path != NULL && stat(path, &checkpoint_stat) == 0 && xorfs_is_checkpoint_valid(source_file, &checkpoint_stat))
+      {
+         xorfs_open_checkpoint(source_file, file_name);
+      }
+
+      free(path);
+      free(file_name);
+   }
+
+   // Remove the rest - stale checkpoints, those of removed backups and leftovers of interrupted writes
+   DIR *directory = opendir(xorfs_options.checkpoint_directory);
+   if (directory == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open checkpoint directory '%s': %s\n", xorfs_options.checkpoint_directory, strerror(errno));
+      return -1;
+   }
+
+   for (struct dirent *entry = readdir(directory); entry != NULL; entry = readdir(directory))
+   {
+      int is_used = 0;
+
+      if (entry->d_type != DT_REG)
+      {
+         continue;
+      }
+
+      for (int index = 0; index < xorfs_source_files.count && !is_used; index++)
+      {
+         struct xorfs_source_file *checkpoint = xorfs_source_files.files[index].backup.checkpoint;
+         is_used = checkpoint != NULL && strcmp(checkpoint->name, entry->d_name) == 0;
+      }
+
+      if (!is_used)
+      {
+         xorfs_log(XORFS_LOG_INFO, "Removing checkpoint '%s'\n", entry->d_name);
+         unlinkat(dirfd(directory), entry->d_name, 0);
+      }
+   }
+
+   closedir(directory);
+   xorfs_log(XORFS_LOG_INFO, "Checkpoints use %li of %lu MiB\n", xorfs_checkpoints.used_size / (1024 * 1024), xorfs_options.checkpoint_size);
+   return 0;
+}
+
+/**
+ * Choose the backup whose checkpoint saves the most reconstruction time
+ * and fits the budget, NULL if there is none
+ *
+ * Its value is the cost of its chain times the amount of data read from it.
+ * Read amounts decay by half with each choice, so that the recent reads
+ * weigh the most.
+ */
+struct xorfs_source_file* xorfs_choose_checkpoint()
+{
+   struct xorfs_source_file *best_source_file = NULL;
+   double best_value = 0;
+   off_t budget = (off_t) xorfs_options.checkpoint_size * 1024 * 1024;
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (source_file->is_duplicate || source_file->backup.xor_against_number == 0 || source_file->backup.checkpoint != NULL)
+      {
+         continue;
+      }
+
+      uint64_t read_bytes = __atomic_load_n(&source_file->backup.read_bytes, __ATOMIC_RELAXED);
+      __atomic_fetch_sub(&source_file->backup.read_bytes, read_bytes - read_bytes / 2, __ATOMIC_RELAXED);
+
+      double value = source_file->backup.cost * read_bytes / XORFS_PLANNING_READ_SIZE;
+      if (value <= best_value)
+      {
+         continue;
+      }
+
+      // Allocated size of the checkpoint is at most that of the chain
+      off_t estimated_size = 0;
+      for (struct xorfs_source_file *file = source_file; file != NULL; file = file->backup.xor_against_number != 0 ? file->backup.xor_against_source_file : NULL)
+      {
+         estimated_size += file->stat.st_blocks * 512;
+      }
+
+      estimated_size = estimated_size < source_file->backup.size ? estimated_size : source_file->backup.size;
+      if (xorfs_checkpoints.used_size + estimated_size > budget)
+      {
+         continue;
+      }
+
+      best_source_file = source_file;
+      best_value = value;
+   }
+
+   return best_source_file;
+}
+
+/**
+ * Write the checkpoint of the backup and start using it
+ */
+int xorfs_write_checkpoint(struct xorfs_source_file *source_file)
+{
+   char *file_name = NULL;
+   char *temporary_file_name = NULL;
+   char *temporary_path = NULL;
+   char *path = NULL;
+   int fd = -1;
+   int return_value = -ENOMEM;
+
+   file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, 0, XORFS_SOURCE_FILE_EXTENSION);
+   if (file_name == NULL || asprintf(&temporary_file_name, ".%s%s", file_name, XORFS_TEMPORARY_FILE_SUFFIX) < 0)
+   {
+      temporary_file_name = NULL;
+      goto cleanup;
+   }
+
+   temporary_path = xorfs_construct_checkpoint_path(temporary_file_name);
+   path = xorfs_construct_checkpoint_path(file_name);
+   if (temporary_path == NULL || path == NULL)
+   {
+      goto cleanup;
+   }
+
+   fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+   if (fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to create file '%s': %s\n", temporary_path, strerror(errno));
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Writing checkpoint of backup %s-%i, depth %u\n", source_file->backup.name, source_file->backup.number, source_file->backup.depth);
+
+   return_value = xorfs_materialize_backup(source_file, fd);
+   if (return_value == 0 && (fsync(fd) != 0 || rename(temporary_path, path) != 0))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to write checkpoint '%s': %s\n", path, strerror(errno));
+      return_value = -EIO;
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      goto cleanup;
+   }
+
+   return_value = xorfs_open_checkpoint(source_file, file_name);
+
+cleanup:
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+
+   free(path);
+   free(temporary_path);
+   free(temporary_file_name);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Rescan the source directory, if it changed since `directory_time`, and
+ * publish the new catalog
+ */
+int xorfs_rescan_source_directory(struct timespec *directory_time)
+{
+   struct stat directory_stat;
+   struct xorfs_source_files *old_catalog = xorfs_catalog;
+   struct xorfs_source_files previous_source_files = xorfs_source_files;
+
+   if (stat(xorfs_source_directory_path, &directory_stat) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to stat source directory '%s': %s\n", xorfs_source_directory_path, strerror(errno));
+      return -1;
+   }
+
+   // Files added, removed or renamed
+   if (directory_stat.st_mtim.tv_sec == directory_time->tv_sec && directory_stat.st_mtim.tv_nsec == directory_time->tv_nsec)
+   {
+      return 0;
+   }
+
+   *directory_time = directory_stat.st_mtim;
+
+   struct xorfs_source_files *new_catalog = malloc(sizeof (struct xorfs_source_files));
+   if (new_catalog == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Rescanning source directory\n");
+
+   // The published catalog is a copy, xorfs_source_files may be rebuilt
+   if (old_catalog == &xorfs_source_files)
+   {
+      old_catalog = malloc(sizeof (struct xorfs_source_files));
+      if (old_catalog == NULL)
+      {
+         free(new_catalog);
+         return -ENOMEM;
+      }
+
+      *old_catalog = xorfs_source_files;
+      __atomic_store_n(&xorfs_catalog, old_catalog, __ATOMIC_SEQ_CST);
+      xorfs_synchronize_catalog();
+   }
+
+   xorfs_source_files = (struct xorfs_source_files) { 0, 0, NULL, NULL, NULL, 0, NULL, 0, NULL, NULL };
+
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to rescan source directory, keeping the previous source files\n");
+      xorfs_source_files = previous_source_files;
+      free(new_catalog);
+      return -1;
+   }
+
+   if (xorfs_options.checkpoint_directory != NULL)
+   {
+      xorfs_load_checkpoints();
+   }
+
+   *new_catalog = xorfs_source_files;
+   int new_debug_file_fd = xorfs_create_debug_file(new_catalog);
+
+   // Publish, wait for operations on the old catalog and free it
+   __atomic_store_n(&xorfs_catalog, new_catalog, __ATOMIC_SEQ_CST);
+   int old_debug_file_fd = __atomic_exchange_n(&xorfs_debug_file_fd, new_debug_file_fd, __ATOMIC_SEQ_CST);
+   xorfs_synchronize_catalog();
+
+   xorfs_drop_frames_of_source_files(old_catalog);
+   xorfs_free_source_files(old_catalog);
+   free(old_catalog);
+   if (old_debug_file_fd >= 0)
+   {
+      close(old_debug_file_fd);
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Serving %i source files\n", new_catalog->count);
+   return 0;
+}
+
+/*
+ * Background jobs of the mount - rescans and checkpoints, one after another
+ * in one thread
+ */
+
+struct xorfs_background_jobs {
+   pthread_t thread;
+   int is_running;
+   int is_stopping;
+   pthread_mutex_t mutex;
+   pthread_cond_t stop;
+};
+
+struct xorfs_background_jobs xorfs_background_jobs = { 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+void* xorfs_background_thread(void *data)
+{
+   struct xorfs_background_jobs *jobs = data;
+   struct timespec directory_time = { 0, 0 };
+   struct stat directory_stat;
+   time_t next_rescan_time = time(NULL) + xorfs_options.rescan_interval;
+   time_t next_checkpoint_time = time(NULL) + xorfs_options.checkpoint_interval;
+
+   // Scanned at mount
+   if (stat(xorfs_source_directory_path, &directory_stat) == 0)
+   {
+      directory_time = directory_stat.st_mtim;
+   }
+
+   pthread_mutex_lock(&jobs->mutex);
+   while (!jobs->is_stopping)
+   {
+      struct timespec deadline = { 0, 0 };
+      int rescans = xorfs_options.rescan_interval > 0;
+      int checkpoints = xorfs_options.checkpoint_directory != NULL;
+
+      deadline.tv_sec = rescans ? next_rescan_time : next_checkpoint_time;
+      if (rescans && checkpoints && next_checkpoint_time < next_rescan_time)
+      {
+         deadline.tv_sec = next_checkpoint_time;
+      }
+
+      pthread_cond_timedwait(&jobs->stop, &jobs->mutex, &deadline);
+      if (jobs->is_stopping)
+      {
+         break;
+      }
+
+      // Jobs take long, stopping waits for them to finish
+      pthread_mutex_unlock(&jobs->mutex);
+
+      if (rescans && time(NULL) >= next_rescan_time)
+      {
+         xorfs_rescan_source_directory(&directory_time);
+         next_rescan_time = time(NULL) + xorfs_options.rescan_interval;
+      }
+
+      if (checkpoints && time(NULL) >= next_checkpoint_time)
+      {
+         struct xorfs_source_file *source_file = xorfs_choose_checkpoint();
+         if (source_file != NULL)
+         {
+            xorfs_write_checkpoint(source_file);
+         }
+
+         next_checkpoint_time = time(NULL) + xorfs_options.checkpoint_interval;
+      }
+
+      pthread_mutex_lock(&jobs->mutex);
+   }
+   pthread_mutex_unlock(&jobs->mutex);
+
+   return NULL;
+}
+
+/**
+ * Start the background jobs, once fuse is running (it may fork)
+ */
+static void* xorfs_operation_init(struct fuse_conn_info *connection)
+{
+   if (xorfs_options.checkpoint_directory != NULL || xorfs_options.rescan_interval > 0)
+   {
+      if (pthread_create(&xorfs_background_jobs.thread, NULL, xorfs_background_thread, &xorfs_background_jobs) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to start background thread\n");
+      }
+      else
+      {
+         xorfs_background_jobs.is_running = 1;
+      }
+   }
+
+   xorfs_start_readahead();
+   xorfs_start_splice(connection);
+   return NULL;
+}
+
+static void xorfs_operation_destroy(void *data)
+{
+   xorfs_stop_readahead();
+   xorfs_stop_splice();
+
+   if (xorfs_background_jobs.is_running)
+   {
+      pthread_mutex_lock(&xorfs_background_jobs.mutex);
+      xorfs_background_jobs.is_stopping = 1;
+      pthread_cond_signal(&xorfs_background_jobs.stop);
+      pthread_mutex_unlock(&xorfs_background_jobs.mutex);
+
+      pthread_join(xorfs_background_jobs.thread, NULL);
+      xorfs_background_jobs.is_running = 0;
+   }
+}
+
+struct xorfs_job_queue {
+   struct xorfs_source_file **source_files;
+   unsigned int count;
+   unsigned int next;
+   int (*function)(struct xorfs_source_file *source_file);
+   int failed_count;
+   pthread_mutex_t mutex;
+};
+
+void* xorfs_job_queue_worker(void *data)
+{
+   struct xorfs_job_queue *queue = data;
+
+   while (1)
+   {
+      struct xorfs_source_file *source_file = NULL;
+
+      // Take a job
+      pthread_mutex_lock(&queue->mutex);
+      if (queue->next < queue->count)
+      {
+         source_file = queue->source_files[queue->next];
+         queue->next++;
+      }
+      pthread_mutex_unlock(&queue->mutex);
+
+      if (source_file == NULL)
+      {
+         return NULL;
+      }
+
+      // Run it
+      if (queue->function(source_file) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Job on backup %s-%i failed\n", source_file->backup.name, source_file->backup.number);
+
+         pthread_mutex_lock(&queue->mutex);
+         queue->failed_count++;
+         pthread_mutex_unlock(&queue->mutex);
+      }
+   }
+}
+
+/**
+ * Run `function` on every given source file, in `thread_count` threads
+ *
+ * Returns the number of failed jobs.
+ */
+int xorfs_run_jobs(struct xorfs_source_file **source_files, unsigned int count, int (*function)(struct xorfs_source_file *), int thread_count)
+{
+   struct xorfs_job_queue queue = { source_files, count, 0, function, 0, PTHREAD_MUTEX_INITIALIZER };
+   pthread_t threads[thread_count];
+   int started_count = 0;
+
+   for (int index = 0; index < thread_count; index++)
+   {
+      if (pthread_create(threads + index, NULL, xorfs_job_queue_worker, &queue) != 0)
+      {
+         xorfs_log(XORFS_LOG_WARNING, "Unable to start worker thread: %s\n", strerror(errno));
+         break;
+      }
+
+      started_count++;
+   }
+
+   // Work in this thread if none could be started
+   if (started_count == 0)
+   {
+      xorfs_job_queue_worker(&queue);
+   }
+
+   for (int index = 0; index < started_count; index++)
+   {
+      pthread_join(threads[index], NULL);
+   }
+
+   return queue.failed_count;
+}
+
+/**
+ * Depth of the backup after compaction, materialization points are marked in `materialize`
+ */
+int xorfs_plan_compaction(int index, int maximum_depth, int *new_depths, char *materialize)
+{
+   struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+   if (new_depths[index] >= 0)
+   {
+      return new_depths[index];
+   }
+
+   if (source_file->backup.xor_against_number == 0)
+   {
+      new_depths[index] = 0;
+   }
+   else
+   {
+      int parent_index = source_file->backup.xor_against_source_file - xorfs_source_files.files;
+      int depth = xorfs_plan_compaction(parent_index, maximum_depth, new_depths, materialize) + 1;
+
+      if (depth > maximum_depth)
+      {
+         materialize[index] = 1;
+         depth = 0;
+      }
+
+      new_depths[index] = depth;
+   }
+
+   return new_depths[index];
+}
+
+/**
+ * Limit depth of all chains by materializing plain images
+ */
+int xorfs_tool_compact(int argc, char *argv[])
+{
+   int return_value = 0;
+   int maximum_depth = atoi(argv[2]);
+   int thread_count = argc > 3 ? atoi(argv[3]) : xorfs_get_default_thread_count();
+   int *new_depths = NULL;
+   char *materialize = NULL;
+   struct xorfs_source_file **jobs = NULL;
+   unsigned int job_count = 0;
+
+   if (maximum_depth < 0 || thread_count < 1)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Invalid maximum depth or thread count\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   new_depths = malloc(xorfs_source_files.count * sizeof (int));
+   materialize = calloc(xorfs_source_files.count, 1);
+   jobs = malloc(xorfs_source_files.count * sizeof (struct xorfs_source_file *));
+   if (new_depths == NULL || materialize == NULL || jobs == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return_value = 1;
+      goto cleanup;
+   }
+
+   // Finish an interrupted run - remove xored images replaced by plain ones
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (source_file->is_duplicate && source_file->backup.xor_against_number != 0)
+      {
+         struct xorfs_source_file *used_source_file = get_source_file_by_backup_name_and_number(source_file->backup.name, source_file->backup.number);
+         if (used_source_file != NULL && used_source_file->backup.xor_against_number == 0)
+         {
+            xorfs_log(XORFS_LOG_NOTICE, "Removing '%s', replaced by '%s'\n", source_file->name, used_source_file->name);
+            xorfs_remove_source_file(source_file);
+         }
+      }
+   }
+
+   // Check chains
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      new_depths[index] = -1;
+
+      if (!xorfs_source_files.files[index].is_duplicate && xorfs_get_backup_depth(xorfs_source_files.files + index) < 0)
+      {
+         return_value = 1;
+         goto cleanup;
+      }
+   }
+
+   // Plan
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      if (xorfs_source_files.files[index].is_duplicate)
+      {
+         continue;
+      }
+
+      xorfs_plan_compaction(index, maximum_depth, new_depths, materialize);
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      if (materialize[index])
+      {
+         jobs[job_count] = xorfs_source_files.files + index;
+         job_count++;
+      }
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Materializing %u backups in %i threads to limit chain depth to %i\n", job_count, thread_count, maximum_depth);
+
+   // Materialize
+   {
+      int failed_count = xorfs_run_jobs(jobs, job_count, xorfs_materialize_backup_in_place, thread_count);
+      if (failed_count > 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "%i of %u backups could not be materialized\n", failed_count, job_count);
+         return_value = 1;
+      }
+   }
+
+   cleanup:
+   free(jobs);
+   free(materialize);
+   free(new_depths);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Next data region of either file within [offset, end)
+ *
+ * Returns 0 and sets the region, or 1 if only holes remain.
+ * `in_first`/`in_second` tell which of the files have data in the region.
+ */
+int xorfs_find_common_data_region(struct xorfs_source_file *first_source_file, struct xorfs_source_file *second_source_file, off_t offset, off_t end, off_t *region_start, off_t *region_end, int *in_first, int *in_second)
+{
+   off_t data_offsets[2];
+   struct xorfs_source_file *source_files[2] = { first_source_file, second_source_file };
+
+   for (int index = 0; index < 2; index++)
+   {
+      data_offsets[index] = xorfs_seek_source_file(source_files[index], offset, SEEK_DATA);
+      if (data_offsets[index] < 0 || data_offsets[index] > end)
+      {
+         data_offsets[index] = end;
+      }
+   }
+
+   *region_start = data_offsets[0] < data_offsets[1] ? data_offsets[0] : data_offsets[1];
+   if (*region_start >= end)
+   {
+      return 1;
+   }
+
+   *region_end = end;
+   *in_first = (data_offsets[0] == *region_start);
+   *in_second = (data_offsets[1] == *region_start);
+
+   for (int index = 0; index < 2; index++)
+   {
+      off_t boundary;
+
+      if (data_offsets[index] == *region_start)
+      // Has data here - region ends where its data does
+      {
+         boundary = xorfs_seek_source_file(source_files[index], *region_start, SEEK_HOLE);
+         if (boundary < 0)
+         {
+            boundary = end;
+         }
+      }
+      else
+      // Has a hole here - region ends where its data starts
+      {
+         boundary = data_offsets[index];
+      }
+
+      if (boundary < *region_end)
+      {
+         *region_end = boundary;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Write a xored image of the backup against the parent of its parent
+ *
+ * The image is d(backup, parent) ^ d(parent, grandparent). If the parent
+ * is a plain image, the result is a plain image of the backup.
+ * Only data regions of the two files are read, holes of both stay holes.
+ * Past the end of a shorter parent, d(backup, parent) is the backup itself,
+ * there it is xored with the grandparent.
+ * The original file is kept.
+ */
+int xorfs_merge_with_parent(struct xorfs_source_file *source_file)
+{
+   struct xorfs_source_file *parent_source_file = source_file->backup.xor_against_source_file;
+   struct xorfs_source_file *grandparent_source_file = parent_source_file->backup.xor_against_source_file;
+   off_t end = source_file->stat.st_size;
+   off_t merged_end = grandparent_source_file != NULL && parent_source_file->stat.st_size < end ? parent_source_file->stat.st_size : end;
+   off_t offset = 0;
+   char *temporary_path = NULL;
+   char *first_buffer = NULL;
+   char *second_buffer = NULL;
+   int return_value = 0;
+
+   char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, parent_source_file->backup.xor_against_number, XORFS_SOURCE_FILE_EXTENSION);
+   if (file_name == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   first_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   second_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   if (first_buffer == NULL || second_buffer == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   int fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Merging '%s' and '%s' into '%s'\n", source_file->name, parent_source_file->name, file_name);
+
+   while (offset < merged_end && return_value == 0)
+   {
+      off_t region_start, region_end;
+      int in_first, in_second;
+
+      if (xorfs_find_common_data_region(source_file, parent_source_file, offset, merged_end, &region_start, &region_end, &in_first, &in_second) != 0)
+      {
+         break;
+      }
+
+      if (!in_second)
+      // Only the backup's file has data
+      {
+         return_value = xorfs_copy_range(source_file, fd, region_start, region_end - region_start);
+      }
+      else if (!in_first)
+      // Only the parent's file has data
+      {
+         return_value = xorfs_copy_range(parent_source_file, fd, region_start, region_end - region_start);
+      }
+      else
+      // Both have data, xor them
+      {
+         for (off_t chunk_offset = region_start; chunk_offset < region_end && return_value == 0; chunk_offset += XORFS_TOOL_CHUNK_SIZE)
+         {
+            size_t chunk_size = region_end - chunk_offset < XORFS_TOOL_CHUNK_SIZE ? region_end - chunk_offset : XORFS_TOOL_CHUNK_SIZE;
+
+            int first_read_bytes = xorfs_read_plain(source_file, first_buffer, chunk_offset, chunk_size);
+            int second_read_bytes = xorfs_read_plain(parent_source_file, second_buffer, chunk_offset, chunk_size);
+            if (first_read_bytes < 0 || second_read_bytes < 0)
+            {
+               return_value = -EIO;
+               break;
+            }
+
+            // Parent's file may end sooner
+            if (second_read_bytes < first_read_bytes)
+            {
+               memset(second_buffer + second_read_bytes, 0, first_read_bytes - second_read_bytes);
+            }
+
+            xorfs_xor_buffers(first_buffer, second_buffer, first_read_bytes);
+            return_value = xorfs_write_sparse(fd, first_buffer, first_read_bytes, chunk_offset);
+         }
+      }
+
+      offset = region_end;
+   }
+
+   // Past the end of the parent
+   for (off_t chunk_offset = merged_end; chunk_offset < end && return_value == 0; chunk_offset += XORFS_TOOL_CHUNK_SIZE)
+   {
+      size_t chunk_size = end - chunk_offset < XORFS_TOOL_CHUNK_SIZE ? end - chunk_offset : XORFS_TOOL_CHUNK_SIZE;
+
+      int first_read_bytes = xorfs_read_plain(source_file, first_buffer, chunk_offset, chunk_size);
+      int second_read_bytes = xorfs_read_backup(grandparent_source_file, second_buffer, chunk_offset, chunk_size);
+      if (first_read_bytes < 0 || second_read_bytes < 0)
+      {
+         return_value = -EIO;
+         break;
+      }
+
+      // The grandparent may end sooner
+      memset(first_buffer + first_read_bytes, 0, chunk_size - first_read_bytes);
+      xorfs_xor_buffers(first_buffer, second_buffer, second_read_bytes);
+      return_value = xorfs_write_sparse(fd, first_buffer, chunk_size, chunk_offset);
+   }
+
+   if (return_value == 0 && ftruncate(fd, end) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to set size of '%s': %s\n", temporary_path, strerror(errno));
+      return_value = -EIO;
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else
+   {
+      return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   }
+
+   cleanup:
+   free(first_buffer);
+   free(second_buffer);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Remove a backup, merging xored images against it with its own
+ */
+int xorfs_tool_merge(int argc, char *argv[])
+{
+   int return_value = 0;
+   struct xorfs_source_file *removed_source_file;
+   struct xorfs_source_file **children = NULL;
+   unsigned int child_count = 0;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   removed_source_file = get_source_file_by_backup_name_and_number(argv[2], atoi(argv[3]));
+   if (removed_source_file == NULL)
+   {
+      return_value = 1;
+      goto cleanup;
+   }
+
+   children = malloc(xorfs_source_files.count * sizeof (struct xorfs_source_file *));
+   if (children == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return_value = 1;
+      goto cleanup;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (!source_file->is_duplicate && source_file->backup.xor_against_source_file == removed_source_file)
+      {
+         children[child_count] = source_file;
+         child_count++;
+      }
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Removing backup %s-%i, merging %u xored images against it\n", removed_source_file->backup.name, removed_source_file->backup.number, child_count);
+
+   // Write the merged images
+   if (xorfs_run_jobs(children, child_count, xorfs_merge_with_parent, xorfs_get_default_thread_count()) > 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Merging failed, nothing removed\n");
+      return_value = 1;
+      goto cleanup;
+   }
+
+   // Remove the replaced images, then the backup itself
+   // (unused duplicates against it would be left without a link)
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (source_file->backup.xor_against_source_file == removed_source_file && xorfs_remove_source_file(source_file) != 0)
+      {
+         return_value = 1;
+      }
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (source_file->backup.number == removed_source_file->backup.number
+          && strcmp(source_file->backup.name, removed_source_file->backup.name) == 0
+          && xorfs_remove_source_file(source_file) != 0)
+      {
+         return_value = 1;
+      }
+   }
+
+   cleanup:
+   free(children);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Make the latest backup of a set a plain image, reversing links of its chain
+ *
+ * d(c, p) is the same data as d(p, c), so a link between backups of the same
+ * size is reversed by renaming 'c x p' to 'p x c'. The xored image has the
+ * size of the backup, so a link across a change of size is written anew as
+ * 'p x c', of the size of p. Otherwise, only the plain image of the latest
+ * backup is written.
+ */
+int xorfs_tool_rotate(int argc, char *argv[])
+{
+   int return_value = 0;
+   struct xorfs_source_file *latest_source_file = NULL;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   // Find the latest backup
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (!source_file->is_duplicate
+          && strcmp(source_file->backup.name, argv[2]) == 0
+          && (latest_source_file == NULL || source_file->backup.number > latest_source_file->backup.number))
+      {
+         latest_source_file = source_file;
+      }
+   }
+
+   if (latest_source_file == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backups of set '%s' found\n", argv[2]);
+      return_value = 1;
+      goto cleanup;
+   }
+
+   if (latest_source_file->backup.xor_against_number == 0)
+   {
+      xorfs_log(XORFS_LOG_NOTICE, "Backup %s-%i is a plain image already\n", latest_source_file->backup.name, latest_source_file->backup.number);
+      goto cleanup;
+   }
+
+   if (xorfs_get_backup_depth(latest_source_file) < 0)
+   {
+      return_value = 1;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Rotating chain of backup %s-%i\n", latest_source_file->backup.name, latest_source_file->backup.number);
+
+   // Plain image of the latest backup
+   if (xorfs_write_plain_image(latest_source_file) != 0)
+   {
+      return_value = 1;
+      goto cleanup;
+   }
+
+   // Reverse links, from the top - every step leaves a readable chain
+   {
+      struct xorfs_source_file *source_file = latest_source_file;
+
+      while (source_file->backup.xor_against_number != 0)
+      {
+         struct xorfs_source_file *parent_source_file = source_file->backup.xor_against_source_file;
+
+         if (source_file->backup.size == parent_source_file->backup.size)
+         {
+            char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, parent_source_file->backup.number, source_file->backup.number, xorfs_get_source_file_extension(source_file));
+            if (file_name == NULL || xorfs_rename_source_file(source_file, file_name) != 0)
+            {
+               free(file_name);
+               return_value = 1;
+               goto cleanup;
+            }
+
+            xorfs_log(XORFS_LOG_INFO, "Renamed '%s' to '%s'\n", source_file->name, file_name);
+            free(file_name);
+         }
+         else
+         // Sizes differ - both chains are still intact, the reversed link is written from them
+         {
+            char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, parent_source_file->backup.number, source_file->backup.number, XORFS_SOURCE_FILE_EXTENSION);
+            if (file_name == NULL || xorfs_write_xored_backup(parent_source_file, source_file, file_name) != 0 || xorfs_remove_source_file(source_file) != 0)
+            {
+               free(file_name);
+               return_value = 1;
+               goto cleanup;
+            }
+
+            xorfs_log(XORFS_LOG_INFO, "Replaced '%s' by '%s'\n", source_file->name, file_name);
+            free(file_name);
+         }
+
+         source_file = parent_source_file;
+      }
+
+      // Former plain image is replaced by the last reversed link
+      if (xorfs_remove_source_file(source_file) != 0)
+      {
+         return_value = 1;
+      }
+   }
+
+   cleanup:
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Backup to which the skip delta of a backup goes
+ *
+ * With numbers counted from the first backup of the set, backup m is xored
+ * against m with the lowest set bit cleared. Any backup is then at most
+ * log2(m) skip deltas away from the first one.
+ */
+struct xorfs_source_file* xorfs_get_skip_delta_target(struct xorfs_source_file *source_file)
+{
+   unsigned int first_number = UINT_MAX;
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      if (backup->number < first_number && strcmp(backup->name, source_file->backup.name) == 0)
+      {
+         first_number = backup->number;
+      }
+   }
+
+   unsigned int relative_number = source_file->backup.number - first_number;
+   if (relative_number == 0)
+   {
+      return NULL;
+   }
+
+   return get_source_file_by_backup_name_and_number(source_file->backup.name, first_number + (relative_number & (relative_number - 1)));
+}
+
+/**
+ * Write a xored image of the backup against its skip delta target, if it is missing
+ */
+int xorfs_write_skip_delta(struct xorfs_source_file *source_file)
+{
+   struct xorfs_source_file *target_source_file = xorfs_get_skip_delta_target(source_file);
+
+   if (target_source_file == NULL || source_file->backup.xor_against_number == 0)
+   {
+      return 0;
+   }
+
+   // Does it exist already?
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      if (backup->number == source_file->backup.number
+          && backup->xor_against_number == target_source_file->backup.number
+          && strcmp(backup->name, source_file->backup.name) == 0)
+      {
+         return 0;
+      }
+   }
+
+   char *file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, target_source_file->backup.number, XORFS_SOURCE_FILE_EXTENSION);
+   if (file_name == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Writing skip delta '%s'\n", file_name);
+
+   int return_value = xorfs_write_xored_backup(source_file, target_source_file, file_name);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Add skip deltas to all backups of a set
+ */
+int xorfs_tool_skip_deltas(int argc, char *argv[])
+{
+   int return_value = 0;
+   int thread_count = argc > 3 ? atoi(argv[3]) : xorfs_get_default_thread_count();
+   struct xorfs_source_file **jobs = NULL;
+   unsigned int job_count = 0;
+
+   if (thread_count < 1)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Invalid thread count\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   jobs = malloc(xorfs_source_files.count * sizeof (struct xorfs_source_file *));
+   if (jobs == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+      return_value = 1;
+      goto cleanup;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (!source_file->is_duplicate && strcmp(source_file->backup.name, argv[2]) == 0)
+      {
+         jobs[job_count] = source_file;
+         job_count++;
+      }
+   }
+
+   if (xorfs_run_jobs(jobs, job_count, xorfs_write_skip_delta, thread_count) > 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Some skip deltas could not be written\n");
+      return_value = 1;
+   }
+
+   cleanup:
+   free(jobs);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Backup against which a new image may be xored, NULL for a plain image
+ */
+struct xorfs_parent_candidate {
+   struct xorfs_source_file *source_file;
+   unsigned int depth; // Of the new backup with this parent
+   unsigned int changed_sample_count;
+};
+
+/**
+ * Offset of the sample `index` of `sample_count` spread over `size` bytes
+ *
+ * One sample at a varying place in each stretch of the image, so that
+ * regular layouts of guest filesystems do not line up with the samples.
+ */
+off_t xorfs_get_sample_offset(unsigned int index, unsigned int sample_count, off_t size)
+{
+   uint64_t block_count = (size + XORFS_SPARSE_BLOCK_SIZE - 1) / XORFS_SPARSE_BLOCK_SIZE;
+   uint64_t stretch_length = block_count / sample_count > 0 ? block_count / sample_count : 1;
+   uint64_t block = (uint64_t) index * block_count / sample_count + xorfs_hash_name((const char *) &index, sizeof index) % stretch_length;
+
+   return (off_t) (block < block_count ? block : block_count - 1) * XORFS_SPARSE_BLOCK_SIZE;
+}
+
+/**
+ * Count sampled blocks of the image which differ from the candidate parent
+ *
+ * Those are the blocks a xored image against it stores, relative to the
+ * whole image; for a plain image, the non-zero blocks.
+ */
+int xorfs_count_changed_samples(struct xorfs_parent_candidate *candidate, const char *samples, unsigned int sample_count, off_t size)
+{
+   char parent_block[XORFS_SPARSE_BLOCK_SIZE];
+
+   candidate->changed_sample_count = 0;
+
+   for (unsigned int index = 0; index < sample_count; index++)
+   {
+      const char *block = samples + (size_t) index * XORFS_SPARSE_BLOCK_SIZE;
+
+      memset(parent_block, 0, sizeof parent_block);
+      if (candidate->source_file != NULL && xorfs_read_backup(candidate->source_file, parent_block, xorfs_get_sample_offset(index, sample_count, size), sizeof parent_block) < 0)
+      {
+         return -EIO;
+      }
+
+      if (memcmp(block, parent_block, sizeof parent_block) != 0)
+      {
+         candidate->changed_sample_count++;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Choose the parent of a new image of `size` bytes, open as `fd`
+ *
+ * Candidates are the plain image, the last `recent_count` backups of the
+ * set and its backups stored as plain images. The one with the fewest
+ * changed samples wins; those within XORFS_PARENT_SIZE_TOLERANCE of it
+ * are as good, of them the one with the shortest chain wins.
+ */
+int xorfs_choose_parent(const char *backup_name, int fd, off_t size, unsigned int recent_count, struct xorfs_parent_candidate *parent)
+{
+   unsigned int sample_count = XORFS_PARENT_SAMPLE_COUNT;
+   struct xorfs_parent_candidate *candidates = calloc(xorfs_source_files.count + 1, sizeof (struct xorfs_parent_candidate));
+   unsigned int candidate_count = 1; // The plain image
+   unsigned int latest_number = 0;
+   char *samples = NULL;
+   int return_value = 0;
+
+   if (size < (off_t) sample_count * XORFS_SPARSE_BLOCK_SIZE)
+   {
+      sample_count = (size + XORFS_SPARSE_BLOCK_SIZE - 1) / XORFS_SPARSE_BLOCK_SIZE;
+   }
+
+   samples = calloc(sample_count, XORFS_SPARSE_BLOCK_SIZE);
+   if (candidates == NULL || samples == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   // Read samples of the image, the last block may be partial
+   for (unsigned int index = 0; index < sample_count; index++)
+   {
+      off_t offset = xorfs_get_sample_offset(index, sample_count, size);
+      size_t block_size = size - offset < XORFS_SPARSE_BLOCK_SIZE ? size - offset : XORFS_SPARSE_BLOCK_SIZE;
+
+      if (pread(fd, samples + (size_t) index * XORFS_SPARSE_BLOCK_SIZE, block_size, offset) != block_size)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read the image at %li: %s\n", offset, strerror(errno));
+         return_value = -EIO;
+         goto cleanup;
+      }
+   }
+
+   // Collect candidates
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      if (!xorfs_source_files.files[index].is_duplicate && strcmp(backup->name, backup_name) == 0 && backup->number > latest_number)
+      {
+         latest_number = backup->number;
+      }
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (!source_file->is_duplicate && strcmp(source_file->backup.name, backup_name) == 0
+          && (source_file->backup.number + recent_count > latest_number || source_file->backup.xor_against_number == 0))
+      {
+         candidates[candidate_count].source_file = source_file;
+         candidates[candidate_count].depth = source_file->backup.depth + 1;
+         candidate_count++;
+      }
+   }
+
+   // Sample them
+   unsigned int fewest_changed_count = UINT_MAX;
+
+   for (unsigned int index = 0; index < candidate_count; index++)
+   {
+      struct xorfs_parent_candidate *candidate = candidates + index;
+
+      return_value = xorfs_count_changed_samples(candidate, samples, sample_count, size);
+      if (return_value != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read backup %s-%u\n", backup_name, candidate->source_file->backup.number);
+         goto cleanup;
+      }
+
+      if (candidate->source_file != NULL)
+      {
+         xorfs_log(XORFS_LOG_INFO, "Against %s-%u: %u of %u sampled blocks stored, depth %u\n", backup_name, candidate->source_file->backup.number, candidate->changed_sample_count, sample_count, candidate->depth);
+      }
+      else
+      {
+         xorfs_log(XORFS_LOG_INFO, "Without parent: %u of %u sampled blocks stored\n", candidate->changed_sample_count, sample_count);
+      }
+
+      if (candidate->changed_sample_count < fewest_changed_count)
+      {
+         fewest_changed_count = candidate->changed_sample_count;
+      }
+   }
+
+   // Choose
+   *parent = candidates[0];
+   unsigned int tolerated_count = fewest_changed_count + fewest_changed_count * XORFS_PARENT_SIZE_TOLERANCE / 100;
+   int has_parent = 0;
+
+   for (unsigned int index = 0; index < candidate_count; index++)
+   {
+      struct xorfs_parent_candidate *candidate = candidates + index;
+
+      if (candidate->changed_sample_count <= tolerated_count
+          && (!has_parent || candidate->depth < parent->depth
+              || (candidate->depth == parent->depth && candidate->changed_sample_count < parent->changed_sample_count)))
+      {
+         *parent = *candidate;
+         has_parent = 1;
+      }
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Chose %s, about %u%% of the image stored, depth %u\n", parent->source_file != NULL ? parent->source_file->name : "a plain image", parent->changed_sample_count * 100 / sample_count, parent->depth);
+
+   cleanup:
+   free(candidates);
+   free(samples);
+   return return_value;
+}
+
+/**
+ * Write a range of an image xored against its parent, NULL for a plain image
+ *
+ * Buffers are of XORFS_TOOL_CHUNK_SIZE. Zero blocks are left as holes.
+ */
+int xorfs_write_xored_range(int fd, int image_fd, struct xorfs_source_file *parent, off_t offset, off_t length, char *first_buffer, char *second_buffer)
+{
+   for (off_t end = offset + length; offset < end; )
+   {
+      size_t chunk_size = end - offset < XORFS_TOOL_CHUNK_SIZE ? end - offset : XORFS_TOOL_CHUNK_SIZE;
+
+      if (pread(image_fd, first_buffer, chunk_size, offset) != chunk_size)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read the image at %li\n", offset);
+         return -EIO;
+      }
+
+      if (parent != NULL)
+      {
+         int parent_read_bytes = xorfs_read_backup(parent, second_buffer, offset, chunk_size);
+         if (parent_read_bytes < 0)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to read backup %s-%u at %li\n", parent->backup.name, parent->backup.number, offset);
+            return -EIO;
+         }
+
+         // Parent may be shorter
+         xorfs_xor_buffers(first_buffer, second_buffer, parent_read_bytes);
+      }
+
+      if (xorfs_write_sparse(fd, first_buffer, chunk_size, offset) != 0)
+      {
+         return -EIO;
+      }
+
+      offset += chunk_size;
+   }
+
+   return 0;
+}
+
+/**
+ * Add an image as the next backup of a set, xored against the best parent
+ */
+int xorfs_tool_add(int argc, char *argv[])
+{
+   const char *backup_name = argv[2];
+   unsigned int recent_count = argc > 4 ? atoi(argv[4]) : XORFS_PARENT_CANDIDATE_COUNT;
+   struct xorfs_parent_candidate parent;
+   unsigned int number = 1;
+   char *temporary_path;
+   char *file_name = NULL;
+   char *first_buffer = NULL;
+   char *second_buffer = NULL;
+   int image_fd = -1;
+   int fd = -1;
+   int return_value = 1;
+   off_t size;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   image_fd = open(argv[3], O_RDONLY);
+   if (image_fd < 0 || (size = lseek(image_fd, 0, SEEK_END)) < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s': %s\n", argv[3], strerror(errno));
+      goto cleanup;
+   }
+
+   if (size == 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Image '%s' is empty\n", argv[3]);
+      goto cleanup;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_backup *backup = &(xorfs_source_files.files[index].backup);
+
+      if (strcmp(backup->name, backup_name) == 0 && backup->number >= number)
+      {
+         number = backup->number + 1;
+      }
+   }
+
+   if (xorfs_choose_parent(backup_name, image_fd, size, recent_count, &parent) != 0)
+   {
+      goto cleanup;
+   }
+
+   file_name = xorfs_construct_backup_file_name(backup_name, number, parent.source_file != NULL ? parent.source_file->backup.number : 0, XORFS_SOURCE_FILE_EXTENSION);
+   first_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   second_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   if (file_name == NULL || first_buffer == NULL || second_buffer == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory\n");
+      goto cleanup;
+   }
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Writing '%s'\n", file_name);
+
+   return_value = xorfs_write_xored_range(fd, image_fd, parent.source_file, 0, size, first_buffer, second_buffer) != 0;
+
+   if (return_value == 0 && ftruncate(fd, size) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to set size of '%s': %s\n", temporary_path, strerror(errno));
+      return_value = 1;
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else if (xorfs_commit_temporary_file(fd, temporary_path, file_name) != 0)
+   {
+      return_value = 1;
+   }
+
+   cleanup:
+   if (image_fd >= 0)
+   {
+      close(image_fd);
+   }
+
+   free(first_buffer);
+   free(second_buffer);
+   free(file_name);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Range of an image, of a changed block list
+ */
+struct xorfs_extent {
+   off_t offset;
+   off_t length;
+};
+
+/**
+ * Read a changed block list - lines of "<offset> <length>" in bytes,
+ * decimal or 0x hexadecimal, empty lines and lines starting with # ignored
+ *
+ * Returns the number of extents, or -1.
+ */
+int xorfs_read_extent_list(const char *path, struct xorfs_extent **extents)
+{
+   FILE *file = fopen(path, "r");
+   char line[256];
+   int extent_count = 0;
+   int line_number = 0;
+
+   *extents = NULL;
+
+   if (file == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s': %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   while (fgets(line, sizeof line, file) != NULL)
+   {
+      long long offset;
+      long long length;
+      char rest;
+
+      line_number++;
+
+      if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+      {
+         continue;
+      }
+
+      if (sscanf(line, "%lli %lli %c", &offset, &length, &rest) != 2 || offset < 0 || length < 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Invalid extent on line %i of '%s'\n", line_number, path);
+         goto error;
+      }
+
+      if (extent_count % 1024 == 0)
+      {
+         struct xorfs_extent *new_extents = realloc(*extents, (extent_count + 1024) * sizeof (struct xorfs_extent));
+         if (new_extents == NULL)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
+            goto error;
+         }
+
+         *extents = new_extents;
+      }
+
+      (*extents)[extent_count].offset = offset;
+      (*extents)[extent_count].length = length;
+      extent_count++;
+   }
+
+   if (ferror(file))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to read '%s'\n", path);
+      goto error;
+   }
+
+   fclose(file);
+   return extent_count;
+
+   error:
+   fclose(file);
+   free(*extents);
+   *extents = NULL;
+   return -1;
+}
+
+/**
+ * Add an image as the next backup of a set, xored against the latest one
+ * only in the extents of a changed block list relative to it
+ *
+ * The rest of the xored image is holes; only the changed extents of the
+ * image and the latest backup are read. The image may have grown, what is
+ * past the end of the latest backup counts as changed.
+ */
+int xorfs_tool_add_changed(int argc, char *argv[])
+{
+   const char *backup_name = argv[2];
+   struct xorfs_source_file *parent = NULL;
+   struct xorfs_extent *extents = NULL;
+   int extent_count;
+   off_t changed_size = 0;
+   char *temporary_path;
+   char *file_name = NULL;
+   char *first_buffer = NULL;
+   char *second_buffer = NULL;
+   int image_fd = -1;
+   int fd = -1;
+   int return_value = 1;
+   off_t size;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   extent_count = xorfs_read_extent_list(argv[4], &extents);
+   if (extent_count < 0)
+   {
+      goto cleanup;
+   }
+
+   image_fd = open(argv[3], O_RDONLY);
+   if (image_fd < 0 || (size = lseek(image_fd, 0, SEEK_END)) < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s': %s\n", argv[3], strerror(errno));
+      goto cleanup;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (!source_file->is_duplicate && strcmp(source_file->backup.name, backup_name) == 0
+          && (parent == NULL || source_file->backup.number > parent->backup.number))
+      {
+         parent = source_file;
+      }
+   }
+
+   if (parent == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backup '%s' to which the changed blocks are relative\n", backup_name);
+      goto cleanup;
+   }
+
+   for (int index = 0; index < extent_count; index++)
+   {
+      if (extents[index].offset + extents[index].length > size)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Extent %lli+%lli is past the end of the image\n", (long long) extents[index].offset, (long long) extents[index].length);
+         goto cleanup;
+      }
+
+      changed_size += extents[index].length;
+   }
+
+   file_name = xorfs_construct_backup_file_name(backup_name, parent->backup.number + 1, parent->backup.number, XORFS_SOURCE_FILE_EXTENSION);
+   first_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   second_buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   if (file_name == NULL || first_buffer == NULL || second_buffer == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory\n");
+      goto cleanup;
+   }
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_NOTICE, "Writing '%s' from %i changed extents, %lli bytes\n", file_name, extent_count, (long long) changed_size);
+
+   return_value = 0;
+   for (int index = 0; index < extent_count && return_value == 0; index++)
+   {
+      return_value = xorfs_write_xored_range(fd, image_fd, parent, extents[index].offset, extents[index].length, first_buffer, second_buffer) != 0;
+   }
+
+   // Grown disk
+   if (return_value == 0 && size > parent->backup.size)
+   {
+      return_value = xorfs_write_xored_range(fd, image_fd, parent, parent->backup.size, size - parent->backup.size, first_buffer, second_buffer) != 0;
+   }
+
+   if (return_value == 0 && ftruncate(fd, size) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to set size of '%s': %s\n", temporary_path, strerror(errno));
+      return_value = 1;
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else if (xorfs_commit_temporary_file(fd, temporary_path, file_name) != 0)
+   {
+      return_value = 1;
+   }
+
+   cleanup:
+   if (image_fd >= 0)
+   {
+      close(image_fd);
+   }
+
+   free(extents);
+   free(first_buffer);
+   free(second_buffer);
+   free(file_name);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Replace a raw source file by a packed one with the same image
+ */
+int xorfs_pack_source_file(struct xorfs_source_file *source_file, uint32_t block_size)
+{
+   off_t size = source_file->stat.st_size;
+   uint64_t block_count = (size + block_size - 1) / block_size;
+   off_t data_offset = (sizeof (struct xorfs_packed_header) + block_count * sizeof (uint32_t) + block_size - 1) / block_size * block_size;
+   uint32_t stored_block_count = 0;
+   uint32_t *blocks = NULL;
+   char *buffer = NULL;
+   char *file_name = NULL;
+   char *temporary_path = NULL;
+   int return_value = 0;
+   int fd = -1;
+
+   if (block_count > UINT32_MAX)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Image of '%s' has too many blocks, use larger blocks\n", source_file->name);
+      return -EINVAL;
+   }
+
+   blocks = calloc(block_count, sizeof (uint32_t));
+   buffer = malloc(block_size);
+   file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, source_file->backup.xor_against_number, XORFS_PACKED_SOURCE_FILE_EXTENSION);
+   if ((blocks == NULL && block_count > 0) || buffer == NULL || file_name == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Packing '%s' into '%s', %u byte blocks\n", source_file->name, file_name, block_size);
+
+   // Store non-zero blocks of data regions
+   for (off_t offset = 0; offset < size && return_value == 0; )
+   {
+      off_t data_offset_in_image = xorfs_seek_source_file(source_file, offset, SEEK_DATA);
+      if (data_offset_in_image < 0)
+      {
+         break;
+      }
+
+      off_t hole_offset = xorfs_seek_source_file(source_file, data_offset_in_image, SEEK_HOLE);
+      if (hole_offset < 0)
+      {
+         hole_offset = size;
+      }
+
+      uint64_t block = data_offset_in_image / block_size;
+      for (; (off_t) block * block_size < hole_offset; block++)
+      {
+         int read_bytes = xorfs_read_plain(source_file, buffer, (off_t) block * block_size, block_size);
+         if (read_bytes < 0)
+         {
+            return_value = read_bytes;
+            break;
+         }
+
+         memset(buffer + read_bytes, 0, block_size - read_bytes);
+
+         if (buffer[0] == 0 && memcmp(buffer, buffer + 1, block_size - 1) == 0)
+         {
+            continue;
+         }
+
+         if (pwrite(fd, buffer, block_size, data_offset + (off_t) stored_block_count * block_size) != block_size)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+            return_value = -EIO;
+            break;
+         }
+
+         stored_block_count++;
+         blocks[block] = htole32(stored_block_count);
+      }
+
+      offset = (off_t) block * block_size;
+   }
+
+   // Header and index
+   if (return_value == 0)
+   {
+      struct xorfs_packed_header header;
+
+      memcpy(header.magic, XORFS_PACKED_MAGIC, sizeof header.magic);
+      header.version = htole32(XORFS_PACKED_VERSION);
+      header.block_size = htole32(block_size);
+      header.size = htole64(size);
+      header.block_count = htole64(block_count);
+      header.stored_block_count = htole64(stored_block_count);
+
+      if (pwrite(fd, &header, sizeof header, 0) != sizeof header
+          || pwrite(fd, blocks, block_count * sizeof (uint32_t), sizeof header) != block_count * sizeof (uint32_t)
+          || ftruncate(fd, data_offset + (off_t) stored_block_count * block_size) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+         return_value = -EIO;
+      }
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else
+   {
+      return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   }
+
+   // The packed file is in place
+   if (return_value == 0)
+   {
+      return_value = xorfs_remove_source_file(source_file);
+   }
+
+   cleanup:
+   free(blocks);
+   free(buffer);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Convert a raw source file to the packed format
+ */
+int xorfs_tool_pack(int argc, char *argv[])
+{
+   int return_value = 1;
+   long block_size = argc > 3 ? atol(argv[3]) : XORFS_PACKED_DEFAULT_BLOCK_SIZE;
+
+   if (block_size < 512 || block_size > (1 << 24) || (block_size & (block_size - 1)) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block size must be a power of two between 512 B and 16 MiB\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (strcmp(source_file->name, argv[2]) != 0)
+      {
+         continue;
+      }
+
+      if (source_file->format != XORFS_SOURCE_FORMAT_RAW)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "'%s' is not a raw source file\n", source_file->name);
+         break;
+      }
+
+      return_value = xorfs_pack_source_file(source_file, block_size) == 0 ? 0 : 1;
+      break;
+   }
+
+   if (return_value != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to pack '%s'\n", argv[2]);
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Replace a raw source file by a compressed one with the same image
+ */
+int xorfs_compress_source_file(struct xorfs_source_file *source_file, enum xorfs_codec codec, uint32_t frame_size)
+{
+   off_t size = source_file->stat.st_size;
+   uint64_t frame_count = (size + frame_size - 1) / frame_size;
+   off_t file_offset = sizeof (struct xorfs_compressed_header) + frame_count * sizeof (struct xorfs_compressed_frame);
+   size_t compressed_buffer_size = 2 * (size_t) frame_size + 1024; // Above bounds of the codecs
+   struct xorfs_compressed_frame *frames = NULL;
+   char *buffer = NULL;
+   char *compressed_buffer = NULL;
+   char *file_name = NULL;
+   char *temporary_path = NULL;
+   int return_value = 0;
+   int fd = -1;
+
+   frames = calloc(frame_count, sizeof (struct xorfs_compressed_frame));
+   buffer = malloc(frame_size);
+   compressed_buffer = malloc(compressed_buffer_size);
+   file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, source_file->backup.xor_against_number, XORFS_COMPRESSED_SOURCE_FILE_EXTENSION);
+   if ((frames == NULL && frame_count > 0) || buffer == NULL || compressed_buffer == NULL || file_name == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Compressing '%s' into '%s', %s, %u byte frames\n", source_file->name, file_name, XORFS_CODEC_NAMES[codec], frame_size);
+
+   for (uint64_t frame = 0; frame < frame_count; frame++)
+   {
+      off_t frame_offset = frame * frame_size;
+      const char *stored_data = compressed_buffer;
+
+      // Zero frames of holes are not read at all
+      off_t data_offset = xorfs_seek_source_file(source_file, frame_offset, SEEK_DATA);
+      if (data_offset < 0 || data_offset >= frame_offset + frame_size)
+      {
+         continue;
+      }
+
+      int read_bytes = xorfs_read_plain(source_file, buffer, frame_offset, frame_size);
+      if (read_bytes <= 0)
+      {
+         return_value = -EIO;
+         break;
+      }
+
+      if (buffer[0] == 0 && memcmp(buffer, buffer + 1, read_bytes - 1) == 0)
+      {
+         continue;
+      }
+
+      size_t stored_size = xorfs_compress(codec, buffer, read_bytes, compressed_buffer, compressed_buffer_size);
+      if (stored_size == 0)
+      // Does not get smaller
+      {
+         stored_data = buffer;
+         stored_size = read_bytes;
+         frames[frame].flags = htole32(XORFS_COMPRESSED_FRAME_STORED);
+      }
+
+      if (pwrite(fd, stored_data, stored_size, file_offset) != stored_size)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+         return_value = -EIO;
+         break;
+      }
+
+      frames[frame].offset = htole64(file_offset);
+      frames[frame].stored_size = htole32(stored_size);
+      file_offset += stored_size;
+   }
+
+   // Header and index
+   if (return_value == 0)
+   {
+      struct xorfs_compressed_header header;
+
+      memset(&header, 0, sizeof header);
+      memcpy(header.magic, XORFS_COMPRESSED_MAGIC, sizeof header.magic);
+      header.version = htole32(XORFS_COMPRESSED_VERSION);
+      header.codec = htole32(codec);
+      header.frame_size = htole32(frame_size);
+      header.size = htole64(size);
+      header.frame_count = htole64(frame_count);
+
+      if (pwrite(fd, &header, sizeof header, 0) != sizeof header
+          || pwrite(fd, frames, frame_count * sizeof (struct xorfs_compressed_frame), sizeof header) != frame_count * sizeof (struct xorfs_compressed_frame)
+          || ftruncate(fd, file_offset) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+         return_value = -EIO;
+      }
+   }
+
+   if (return_value != 0)
+   {
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+   }
+   else
+   {
+      return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   }
+
+   // The compressed file is in place
+   if (return_value == 0)
+   {
+      return_value = xorfs_remove_source_file(source_file);
+   }
+
+   cleanup:
+   free(frames);
+   free(buffer);
+   free(compressed_buffer);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Convert a raw source file to the compressed format
+ */
+int xorfs_tool_compress(int argc, char *argv[])
+{
+   int return_value = 1;
+   enum xorfs_codec codec = XORFS_CODEC_NONE;
+   long frame_size = argc > 4 ? atol(argv[4]) : XORFS_COMPRESSED_DEFAULT_FRAME_SIZE;
+
+#if defined(XORFS_WITH_LZ4)
+   codec = XORFS_CODEC_LZ4;
+#endif
+#if defined(XORFS_WITH_ZSTD)
+   codec = XORFS_CODEC_ZSTD;
+#endif
+
+   if (argc > 3)
+   {
+      for (codec = 0; codec < 3 && strcmp(argv[3], XORFS_CODEC_NAMES[codec]) != 0; codec++);
+   }
+
+   if (codec >= 3 || !xorfs_is_codec_supported(codec))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Codec '%s' is not built in\n", argv[3]);
+      return 1;
+   }
+
+   if (frame_size < 4096 || frame_size > (1 << 24))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Frame size must be between 4 KiB and 16 MiB\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (strcmp(source_file->name, argv[2]) != 0)
+      {
+         continue;
+      }
+
+      if (source_file->format != XORFS_SOURCE_FORMAT_RAW)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "'%s' is not a raw source file\n", source_file->name);
+         break;
+      }
+
+      return_value = xorfs_compress_source_file(source_file, codec, frame_size) == 0 ? 0 : 1;
+      break;
+   }
+
+   if (return_value != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to compress '%s'\n", argv[2]);
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Double the slots of the hash index of the block store
+ */
+int xorfs_grow_block_index(struct xorfs_block_store *store)
+{
+   struct xorfs_block_index_slot *old_slots = store->slots;
+   uint64_t old_slot_count = store->slot_count;
+
+   store->slots = calloc(2 * old_slot_count, sizeof (struct xorfs_block_index_slot));
+   if (store->slots == NULL)
+   {
+      store->slots = old_slots;
+      return -ENOMEM;
+   }
+
+   store->slot_count = 2 * old_slot_count;
+
+   for (uint64_t slot = 0; slot < old_slot_count; slot++)
+   {
+      if (old_slots[slot].block != 0)
+      {
+         *xorfs_find_block_slot(store, old_slots[slot].hash) = old_slots[slot];
+      }
+   }
+
+   free(old_slots);
+   return 0;
+}
+
+/**
+ * Add a block to the block store, unless it is there already
+ */
+int xorfs_add_block(struct xorfs_block_store *store, const char *data, const unsigned char *hash)
+{
+   // Keep the hash index at most half full
+   if ((store->entry_count + 1) * 2 > store->slot_count && xorfs_grow_block_index(store) != 0)
+   {
+      return -ENOMEM;
+   }
+
+   struct xorfs_block_index_slot *slot = xorfs_find_block_slot(store, hash);
+   if (slot->block != 0)
+   {
+      return 0;
+   }
+
+   if (pwrite(store->fd, data, store->block_size, (off_t) (store->block_count + 1) * store->block_size) != store->block_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to write block store: %s\n", strerror(errno));
+      return -EIO;
+   }
+
+   store->block_count++;
+   store->entry_count++;
+   memcpy(slot->hash, hash, XORFS_HASH_SIZE);
+   slot->block = htole64(store->block_count);
+   return 0;
+}
+
+/**
+ * Replace the hash index of the block store by the one in memory
+ *
+ * Added blocks are synced first, so the index never points past them.
+ */
+int xorfs_write_block_index(struct xorfs_block_store *store)
+{
+   struct xorfs_block_index_header header;
+   size_t slots_size = store->slot_count * sizeof (struct xorfs_block_index_slot);
+   char *temporary_path = NULL;
+
+   if (fsync(store->fd) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to sync block store: %s\n", strerror(errno));
+      return -EIO;
+   }
+
+   int fd = xorfs_create_temporary_file(XORFS_BLOCK_INDEX_FILE_NAME, &temporary_path);
+   if (fd < 0)
+   {
+      return -EIO;
+   }
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, XORFS_BLOCK_INDEX_MAGIC, sizeof header.magic);
+   header.version = htole32(XORFS_BLOCK_INDEX_VERSION);
+   header.slot_count = htole64(store->slot_count);
+   header.entry_count = htole64(store->entry_count);
+
+   if (pwrite(fd, &header, sizeof header, 0) != sizeof header || pwrite(fd, store->slots, slots_size, sizeof header) != slots_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+      unlink(temporary_path);
+      free(temporary_path);
+      close(fd);
+      return -EIO;
+   }
+
+   return xorfs_commit_temporary_file(fd, temporary_path, XORFS_BLOCK_INDEX_FILE_NAME);
+}
+
+/**
+ * Replace a source file by a manifest with the same image, its blocks go
+ * to the block store
+ */
+int xorfs_dedup_source_file(struct xorfs_source_file *source_file)
+{
+   struct xorfs_block_store *store = xorfs_source_files.block_store;
+   uint32_t block_size = store->block_size;
+   off_t size = source_file->stat.st_size;
+   uint64_t block_count = (size + block_size - 1) / block_size;
+   uint64_t stored_block_count = store->block_count;
+   unsigned char (*hashes)[XORFS_HASH_SIZE] = NULL;
+   char *buffer = NULL;
+   char *file_name = NULL;
+   char *temporary_path = NULL;
+   int return_value = 0;
+   int fd = -1;
+
+   hashes = calloc(block_count, XORFS_HASH_SIZE);
+   buffer = malloc(block_size);
+   file_name = xorfs_construct_backup_file_name(source_file->backup.name, source_file->backup.number, source_file->backup.xor_against_number, XORFS_MANIFEST_SOURCE_FILE_EXTENSION);
+   if ((hashes == NULL && block_count > 0) || buffer == NULL || file_name == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Deduplicating '%s' into '%s', %u byte blocks\n", source_file->name, file_name, block_size);
+
+   // Hash and store non-zero blocks of data regions
+   for (off_t offset = 0; offset < size && return_value == 0; )
+   {
+      off_t data_offset = xorfs_seek_source_file(source_file, offset, SEEK_DATA);
+      if (data_offset < 0)
+      {
+         break;
+      }
+
+      off_t hole_offset = xorfs_seek_source_file(source_file, data_offset, SEEK_HOLE);
+      if (hole_offset < 0)
+      {
+         hole_offset = size;
+      }
+
+      uint64_t block = data_offset / block_size;
+      for (; (off_t) block * block_size < hole_offset; block++)
+      {
+         int read_bytes = xorfs_read_plain(source_file, buffer, (off_t) block * block_size, block_size);
+         if (read_bytes < 0)
+         {
+            return_value = read_bytes;
+            break;
+         }
+
+         memset(buffer + read_bytes, 0, block_size - read_bytes);
+
+         if (buffer[0] == 0 && memcmp(buffer, buffer + 1, block_size - 1) == 0)
+         {
+            continue;
+         }
+
+         xorfs_sha256(buffer, block_size, hashes[block]);
+
+         return_value = xorfs_add_block(store, buffer, hashes[block]);
+         if (return_value != 0)
+         {
+            break;
+         }
+      }
+
+      offset = (off_t) block * block_size;
+   }
+
+   // Blocks are in the store, the manifest may point to them
+   if (return_value == 0)
+   {
+      xorfs_log(XORFS_LOG_INFO, "%lu blocks added to the block store, which has %lu now\n", store->block_count - stored_block_count, store->block_count);
+      return_value = xorfs_write_block_index(store);
+   }
+
+   if (return_value == 0)
+   {
+      struct xorfs_manifest_header header;
+
+      fd = xorfs_create_temporary_file(file_name, &temporary_path);
+      if (fd < 0)
+      {
+         return_value = -EIO;
+         goto cleanup;
+      }
+
+      memset(&header, 0, sizeof header);
+      memcpy(header.magic, XORFS_MANIFEST_MAGIC, sizeof header.magic);
+      header.version = htole32(XORFS_MANIFEST_VERSION);
+      header.block_size = htole32(block_size);
+      header.size = htole64(size);
+      header.block_count = htole64(block_count);
+
+      if (pwrite(fd, &header, sizeof header, 0) != sizeof header
+          || pwrite(fd, hashes, block_count * XORFS_HASH_SIZE, sizeof header) != block_count * XORFS_HASH_SIZE)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+         unlink(temporary_path);
+         free(temporary_path);
+         close(fd);
+         return_value = -EIO;
+      }
+      else
+      {
+         return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+      }
+   }
+
+   // The manifest is in place
+   if (return_value == 0)
+   {
+      return_value = xorfs_remove_source_file(source_file);
+   }
+
+   cleanup:
+   free(hashes);
+   free(buffer);
+   free(file_name);
+   return return_value;
+}
+
+/**
+ * Convert a source file to a manifest over the block store
+ */
+int xorfs_tool_dedup(int argc, char *argv[])
+{
+   int return_value = 1;
+   long block_size = argc > 3 ? atol(argv[3]) : XORFS_BLOCK_STORE_DEFAULT_BLOCK_SIZE;
+
+   if (block_size < 512 || block_size > (1 << 24) || (block_size & (block_size - 1)) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block size must be a power of two between 512 B and 16 MiB\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   xorfs_source_files.block_store = xorfs_open_block_store(block_size);
+   if (xorfs_source_files.block_store == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open block store\n");
+      return 1;
+   }
+
+   if (argc > 3 && xorfs_source_files.block_store->block_size != block_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block store has %u byte blocks already\n", xorfs_source_files.block_store->block_size);
+      xorfs_close_block_store(xorfs_source_files.block_store);
+      xorfs_source_files.block_store = NULL;
+      return 1;
+   }
+
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+
+      if (strcmp(source_file->name, argv[2]) != 0)
+      {
+         continue;
+      }
+
+      if (source_file->format == XORFS_SOURCE_FORMAT_MANIFEST)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "'%s' is a manifest already\n", source_file->name);
+         break;
+      }
+
+      return_value = xorfs_dedup_source_file(source_file) == 0 ? 0 : 1;
+      break;
+   }
+
+   if (return_value != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to deduplicate '%s'\n", argv[2]);
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Write a backup to a file or standard output, streamed
+ */
+int xorfs_tool_extract(int argc, char *argv[])
+{
+   struct xorfs_source_file *source_file;
+   struct xorfs_stream *stream = NULL;
+   struct stat output_stat;
+   int output_fd = STDOUT_FILENO;
+   int return_value = 1;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   source_file = xorfs_get_source_file_by_file_name(argv[2]);
+   if (source_file == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backup '%s'\n", argv[2]);
+      goto cleanup;
+   }
+
+   if (argc > 3)
+   {
+      output_fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+      if (output_fd < 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to create '%s': %s\n", argv[3], strerror(errno));
+         goto cleanup;
+      }
+   }
+
+   stream = xorfs_open_stream(source_file, 0, source_file->backup.size);
+   if (stream == NULL || fstat(output_fd, &output_stat) != 0)
+   {
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Extracting %s, %li bytes in %zu byte chunks\n", argv[2], source_file->backup.size, stream->chunk_size);
+
+   // Regular files get holes, pipes everything
+   {
+      off_t offset = 0;
+      ssize_t chunk_size;
+      const char *chunk;
+
+      while ((chunk_size = xorfs_read_stream(stream, &chunk)) > 0)
+      {
+         if (S_ISREG(output_stat.st_mode))
+         {
+            if (xorfs_write_sparse(output_fd, chunk, chunk_size, offset) != 0)
+            {
+               break;
+            }
+         }
+         else
+         {
+            ssize_t written_bytes = 0;
+            for (ssize_t done = 0; done < chunk_size && written_bytes >= 0; done += written_bytes)
+            {
+               written_bytes = write(output_fd, chunk + done, chunk_size - done);
+            }
+
+            if (written_bytes < 0)
+            {
+               xorfs_log(XORFS_LOG_ERROR, "Unable to write output: %s\n", strerror(errno));
+               break;
+            }
+         }
+
+         offset += chunk_size;
+      }
+
+      if (chunk_size < 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to read %s: %s\n", argv[2], strerror(-chunk_size));
+      }
+      else if (offset == source_file->backup.size && (!S_ISREG(output_stat.st_mode) || ftruncate(output_fd, offset) == 0))
+      {
+         return_value = 0;
+      }
+   }
+
+   cleanup:
+   if (stream != NULL)
+   {
+      xorfs_close_stream(stream);
+   }
+
+   if (output_fd != STDOUT_FILENO && output_fd >= 0 && close(output_fd) != 0)
+   {
+      return_value = 1;
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/*
+ * Scan of a backup set
+ *
+ * Reconstructs a range of every backup of a set in one pass. Chains of
+ * a set form trees rooted in plain images; they are walked depth first
+ * chunk by chunk, each xored image being xored into the data of its parent.
+ * Every source file is read once, instead of once for each backup whose
+ * chain contains it.
+ */
+
+/**
+ * Called with the data of every backup of the scanned set, chunk by chunk
+ */
+typedef int (*xorfs_scan_function)(struct xorfs_source_file *source_file, const char *data, off_t offset, size_t size, void *context);
+
+struct xorfs_scan {
+   int *first_children; // Indexed by source file, -1 if none
+   int *next_siblings; // Indexed by source file, -1 if none
+   char *read_buffer;
+   off_t offset; // Of the chunk
+   size_t size;
+   xorfs_scan_function function;
+   void *context;
+};
+
+int xorfs_scan_subtree(struct xorfs_scan *scan, struct xorfs_source_file *source_file, char *buffer)
+{
+   off_t backup_size = source_file->backup.size;
+   size_t size = scan->offset >= backup_size ? 0 : (backup_size - scan->offset < (off_t) scan->size ? backup_size - scan->offset : scan->size);
+   int return_value = 0;
+
+   // Its image, a plain one is the data, a xored one is xored onto the data of the parent
+   if (size > 0)
+   {
+      off_t data_offset = xorfs_seek_source_file(source_file, scan->offset, SEEK_DATA);
+      int has_data = !(data_offset >= (off_t) (scan->offset + size) || (data_offset < 0 && errno == ENXIO));
+      char *image = source_file->backup.xor_against_number == 0 ? buffer : scan->read_buffer;
+      int read_bytes = 0;
+
+      if (has_data)
+      {
+         read_bytes = xorfs_read_plain(source_file, image, scan->offset, size);
+         if (read_bytes < 0)
+         {
+            return read_bytes;
+         }
+      }
+
+      if (image == buffer)
+      {
+         memset(buffer + read_bytes, 0, size - read_bytes);
+      }
+      else
+      {
+         xorfs_xor_buffers(buffer, image, read_bytes);
+      }
+   }
+
+   // Past its end the backup is zeros, for the backups xored against it too
+   memset(buffer + size, 0, scan->size - size);
+
+   if (size > 0)
+   {
+      return_value = scan->function(source_file, buffer, scan->offset, size, scan->context);
+      if (return_value != 0)
+      {
+         return return_value;
+      }
+   }
+
+   // Backups xored against this one, the last one takes over the buffer
+   for (int child = scan->first_children[source_file - xorfs_source_files.files]; child >= 0 && return_value == 0; child = scan->next_siblings[child])
+   {
+      if (scan->next_siblings[child] < 0)
+      {
+         return xorfs_scan_subtree(scan, xorfs_source_files.files + child, buffer);
+      }
+
+      char *child_buffer = malloc(scan->size);
+      if (child_buffer == NULL)
+      {
+         return -ENOMEM;
+      }
+
+      memcpy(child_buffer, buffer, scan->size);
+      return_value = xorfs_scan_subtree(scan, xorfs_source_files.files + child, child_buffer);
+      free(child_buffer);
+   }
+
+   return return_value;
+}
+
+/**
+ * Reconstruct `length` bytes from `offset` of every backup of the set, and
+ * pass them to `function`
+ *
+ * Memory in use is a chunk for each branching of the chains.
+ */
+int xorfs_scan_backup_set(const char *backup_name, off_t offset, off_t length, xorfs_scan_function function, void *context)
+{
+   unsigned int count = xorfs_source_files.count;
+   struct xorfs_scan scan = { malloc(count * sizeof (int)), malloc(count * sizeof (int)), malloc(XORFS_TOOL_CHUNK_SIZE), 0, 0, function, context };
+   char *buffer = malloc(XORFS_TOOL_CHUNK_SIZE);
+   int return_value = 0;
+
+   if (scan.first_children == NULL || scan.next_siblings == NULL || scan.read_buffer == NULL || buffer == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   // Trees of the used source files of the set
+   for (int index = 0; index < count; index++)
+   {
+      scan.first_children[index] = -1;
+      scan.next_siblings[index] = -1;
+   }
+
+   for (int index = count - 1; index >= 0; index--)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (source_file->is_duplicate || source_file->backup.xor_against_number == 0 || strcmp(source_file->backup.name, backup_name) != 0)
+      {
+         continue;
+      }
+
+      int parent = source_file->backup.xor_against_source_file - xorfs_source_files.files;
+      scan.next_siblings[index] = scan.first_children[parent];
+      scan.first_children[parent] = index;
+   }
+
+   // Chunk by chunk, from every plain image
+   for (scan.offset = offset; scan.offset < offset + length && return_value == 0; scan.offset += scan.size)
+   {
+      scan.size = offset + length - scan.offset < XORFS_TOOL_CHUNK_SIZE ? offset + length - scan.offset : XORFS_TOOL_CHUNK_SIZE;
+
+      for (int index = 0; index < count && return_value == 0; index++)
+      {
+         struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+         if (!source_file->is_duplicate && source_file->backup.xor_against_number == 0 && strcmp(source_file->backup.name, backup_name) == 0)
+         {
+            return_value = xorfs_scan_subtree(&scan, source_file, buffer);
+         }
+      }
+   }
+
+   cleanup:
+   free(scan.first_children);
+   free(scan.next_siblings);
+   free(scan.read_buffer);
+   free(buffer);
+   return return_value;
+}
+
+struct xorfs_scan_output {
+   const char *directory_path;
+   off_t offset; // Of the range, at the start of the output files
+};
+
+int xorfs_write_scanned_data(struct xorfs_source_file *source_file, const char *data, off_t offset, size_t size, void *context)
+{
+   struct xorfs_scan_output *output = context;
+   char file_name[NAME_MAX + 1];
+   char *path = NULL;
+   int return_value = 0;
+
+   xorfs_get_output_file_name(source_file, file_name);
+   if (asprintf(&path, "%s/%s", output->directory_path, file_name) < 0)
+   {
+      return -ENOMEM;
+   }
+
+   int fd = open(path, O_WRONLY);
+   if (fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open '%s': %s\n", path, strerror(errno));
+      return_value = -EIO;
+   }
+   else
+   {
+      return_value = xorfs_write_sparse(fd, data, size, offset - output->offset);
+      close(fd);
+   }
+
+   free(path);
+   return return_value;
+}
+
+int xorfs_tool_scan(int argc, char *argv[])
+{
+   struct xorfs_scan_output output = { argv[3], 0 };
+   off_t length = 0;
+   int return_value = 1;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   // The whole backups by default
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (!source_file->is_duplicate && strcmp(source_file->backup.name, argv[2]) == 0 && source_file->backup.size > length)
+      {
+         length = source_file->backup.size;
+      }
+   }
+
+   if (argc > 4)
+   {
+      output.offset = strtoll(argv[4], NULL, 0);
+      length = argc > 5 ? strtoll(argv[5], NULL, 0) : length - output.offset;
+   }
+
+   if (length <= 0 || output.offset < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backups of '%s' in the range\n", argv[2]);
+      goto cleanup;
+   }
+
+   // Create the output files, each as long as its backup in the range
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (source_file->is_duplicate || strcmp(source_file->backup.name, argv[2]) != 0)
+      {
+         continue;
+      }
+
+      char file_name[NAME_MAX + 1];
+      char *path = NULL;
+      off_t end = output.offset + length < source_file->backup.size ? output.offset + length : source_file->backup.size;
+
+      xorfs_get_output_file_name(source_file, file_name);
+      if (asprintf(&path, "%s/%s", output.directory_path, file_name) < 0)
+      {
+         goto cleanup;
+      }
+
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+      if (fd < 0 || ftruncate(fd, end > output.offset ? end - output.offset : 0) != 0)
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to create '%s': %s\n", path, strerror(errno));
+         if (fd >= 0)
+         {
+            close(fd);
+         }
+
+         free(path);
+         goto cleanup;
+      }
+
+      close(fd);
+      free(path);
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Scanning %li bytes from offset %li of backups %s\n", length, output.offset, argv[2]);
+
+   int scan_result = xorfs_scan_backup_set(argv[2], output.offset, length, xorfs_write_scanned_data, &output);
+   if (scan_result != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to scan backups %s: %s\n", argv[2], strerror(-scan_result));
+   }
+   else
+   {
+      return_value = 0;
+   }
+
+   cleanup:
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/*
+ * Guest filesystems
+ *
+ * Read-only parser of ext4 (and ext2/ext3) in a backup, on the whole disk
+ * or in a partition of an MBR or GPT partition table. It knows which blocks
+ * are in use and where the blocks of a file are, so extraction reconstructs
+ * just those through the chain.
+ */
+
+struct xorfs_ext4 {
+   struct xorfs_source_file *source_file; // Backup with the filesystem
+   off_t offset; // Of the filesystem in the backup
+   unsigned int block_size;
+   uint64_t block_count;
+   uint32_t first_data_block;
+   uint32_t blocks_per_group;
+   uint32_t inodes_per_group;
+   unsigned int inode_size;
+   unsigned int group_count;
+   unsigned int group_descriptor_size;
+   unsigned int metadata_block_count; // Superblock, group descriptors and reserved ones, in groups with a superblock copy
+   int has_sparse_superblocks;
+   unsigned char *group_descriptors;
+   unsigned char *bitmap; // Block bitmap of one group
+   unsigned int bitmap_group; // Group of the bitmap, group_count if none
+};
+
+/**
+ * Called for every extent of a file; disk block 0 is a hole
+ */
+typedef int (*xorfs_ext4_extent_function)(struct xorfs_ext4 *ext4, uint64_t file_block, uint64_t disk_block, uint64_t count, void *context);
+
+uint16_t xorfs_get_le16(const unsigned char *data)
+{
+   return data[0] | data[1] << 8;
+}
+
+uint32_t xorfs_get_le32(const unsigned char *data)
+{
+   return xorfs_get_le16(data) | (uint32_t) xorfs_get_le16(data + 2) << 16;
+}
+
+uint64_t xorfs_get_le64(const unsigned char *data)
+{
+   return xorfs_get_le32(data) | (uint64_t) xorfs_get_le32(data + 4) << 32;
+}
+
+/**
+ * Read a range of the filesystem, all of it or fail
+ */
+int xorfs_read_ext4(struct xorfs_ext4 *ext4, void *buffer, off_t offset, size_t size)
+{
+   int read_bytes = xorfs_read_backup_streamed(ext4->source_file, buffer, ext4->offset + offset, size);
+   if (read_bytes < 0)
+   {
+      return read_bytes;
+   }
+
+   if (read_bytes != size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Filesystem in %s-%i is past the end of the backup\n", ext4->source_file->backup.name, ext4->source_file->backup.number);
+      return -EIO;
+   }
+
+   return 0;
+}
+
+int xorfs_is_ext4_at(struct xorfs_source_file *source_file, off_t offset)
+{
+   unsigned char magic[2];
+
+   return xorfs_read_backup(source_file, (char *) magic, offset + XORFS_EXT4_SUPERBLOCK_OFFSET + 0x38, sizeof magic) == sizeof magic
+      && xorfs_get_le16(magic) == XORFS_EXT4_MAGIC;
+}
+
+/**
+ * Offset of the filesystem in the backup - the whole disk, or the first
+ * partition with one; -1 if none
+ */
+off_t xorfs_find_ext4(struct xorfs_source_file *source_file)
+{
+   unsigned char sector[XORFS_SECTOR_SIZE];
+
+   if (xorfs_is_ext4_at(source_file, 0))
+   {
+      return 0;
+   }
+
+   // MBR partition table, or a protective one of GPT
+   if (xorfs_read_backup(source_file, (char *) sector, 0, sizeof sector) != sizeof sector || sector[510] != 0x55 || sector[511] != 0xAA)
+   {
+      return -1;
+   }
+
+   for (int index = 0; index < 4; index++)
+   {
+      const unsigned char *entry = sector + 446 + index * 16;
+      off_t offset = (off_t) xorfs_get_le32(entry + 8) * XORFS_SECTOR_SIZE;
+
+      if (entry[4] != 0 && entry[4] != 0xEE && offset > 0 && xorfs_is_ext4_at(source_file, offset))
+      {
+         return offset;
+      }
+   }
+
+   // GPT
+   if (xorfs_read_backup(source_file, (char *) sector, XORFS_SECTOR_SIZE, sizeof sector) != sizeof sector || memcmp(sector, "EFI PART", 8) != 0)
+   {
+      return -1;
+   }
+
+   uint64_t entries_offset = xorfs_get_le64(sector + 72) * XORFS_SECTOR_SIZE;
+   uint32_t entry_count = xorfs_get_le32(sector + 80);
+   uint32_t entry_size = xorfs_get_le32(sector + 84);
+
+   for (uint32_t index = 0; index < entry_count && index < XORFS_GPT_MAXIMUM_ENTRY_COUNT && entry_size >= 128 && entry_size <= sizeof sector; index++)
+   {
+      unsigned char entry[XORFS_SECTOR_SIZE];
+      if (xorfs_read_backup(source_file, (char *) entry, entries_offset + (off_t) index * entry_size, entry_size) != entry_size)
+      {
+         return -1;
+      }
+
+      off_t offset = (off_t) xorfs_get_le64(entry + 32) * XORFS_SECTOR_SIZE;
+      if (offset > 0 && xorfs_is_ext4_at(source_file, offset))
+      {
+         return offset;
+      }
+   }
+
+   return -1;
+}
+
+void xorfs_close_ext4(struct xorfs_ext4 *ext4)
+{
+   free(ext4->group_descriptors);
+   free(ext4->bitmap);
+   ext4->group_descriptors = NULL;
+   ext4->bitmap = NULL;
+}
+
+int xorfs_open_ext4(struct xorfs_source_file *source_file, struct xorfs_ext4 *ext4)
+{
+   unsigned char superblock[1024];
+   int return_value = 0;
+
+   *ext4 = (struct xorfs_ext4) { source_file, xorfs_find_ext4(source_file) };
+   if (ext4->offset < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No ext4 filesystem in %s-%i\n", source_file->backup.name, source_file->backup.number);
+      return -EINVAL;
+   }
+
+   return_value = xorfs_read_ext4(ext4, superblock, XORFS_EXT4_SUPERBLOCK_OFFSET, sizeof superblock);
+   if (return_value != 0)
+   {
+      return return_value;
+   }
+
+   uint32_t log_block_size = xorfs_get_le32(superblock + 0x18);
+   uint32_t incompatible_features = xorfs_get_le32(superblock + 0x60);
+   int is_64bit = (incompatible_features & XORFS_EXT4_FEATURE_64BIT) != 0;
+
+   ext4->block_size = 1024 << (log_block_size < 7 ? log_block_size : 0);
+   ext4->block_count = xorfs_get_le32(superblock + 0x4) | (is_64bit ? (uint64_t) xorfs_get_le32(superblock + 0x150) << 32 : 0);
+   ext4->first_data_block = xorfs_get_le32(superblock + 0x14);
+   ext4->blocks_per_group = xorfs_get_le32(superblock + 0x20);
+   ext4->inodes_per_group = xorfs_get_le32(superblock + 0x28);
+   ext4->inode_size = xorfs_get_le32(superblock + 0x4C) == 0 ? 128 : xorfs_get_le16(superblock + 0x58);
+   ext4->group_descriptor_size = is_64bit ? xorfs_get_le16(superblock + 0xFE) : 32;
+   ext4->has_sparse_superblocks = (xorfs_get_le32(superblock + 0x64) & XORFS_EXT4_FEATURE_SPARSE_SUPER) != 0;
+
+   if (log_block_size >= 7 || ext4->blocks_per_group == 0 || ext4->blocks_per_group > ext4->block_size * 8 || ext4->inodes_per_group == 0
+      || ext4->inode_size < 128 || ext4->group_descriptor_size < 32 || ext4->block_count <= ext4->first_data_block)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Invalid ext4 superblock in %s-%i\n", source_file->backup.name, source_file->backup.number);
+      return -EINVAL;
+   }
+
+   if (incompatible_features & XORFS_EXT4_FEATURE_META_BG)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "ext4 filesystem in %s-%i uses meta_bg, which is not supported\n", source_file->backup.name, source_file->backup.number);
+      return -ENOTSUP;
+   }
+
+   ext4->group_count = (ext4->block_count - ext4->first_data_block + ext4->blocks_per_group - 1) / ext4->blocks_per_group;
+   ext4->bitmap_group = ext4->group_count;
+
+   // Group descriptors follow the superblock
+   size_t group_descriptors_size = (size_t) ext4->group_count * ext4->group_descriptor_size;
+   size_t group_descriptor_block_count = (group_descriptors_size + ext4->block_size - 1) / ext4->block_size;
+
+   ext4->metadata_block_count = 1 + group_descriptor_block_count + xorfs_get_le16(superblock + 0xCE);
+   ext4->group_descriptors = malloc(group_descriptors_size);
+   ext4->bitmap = malloc(ext4->block_size);
+   if (ext4->group_descriptors == NULL || ext4->bitmap == NULL)
+   {
+      xorfs_close_ext4(ext4);
+      return -ENOMEM;
+   }
+
+   return_value = xorfs_read_ext4(ext4, ext4->group_descriptors, (off_t) (ext4->first_data_block + 1) * ext4->block_size, group_descriptors_size);
+   if (return_value != 0)
+   {
+      xorfs_close_ext4(ext4);
+      return return_value;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "ext4 filesystem at offset %li of %s-%i, %lu blocks of %u bytes\n",
+      ext4->offset, source_file->backup.name, source_file->backup.number, ext4->block_count, ext4->block_size);
+   return 0;
+}
+
+/**
+ * A field of a group descriptor, with the high half of 64-bit filesystems
+ */
+uint64_t xorfs_get_ext4_group_block(struct xorfs_ext4 *ext4, unsigned int group, unsigned int low_offset, unsigned int high_offset)
+{
+   const unsigned char *descriptor = ext4->group_descriptors + (size_t) group * ext4->group_descriptor_size;
+
+   return xorfs_get_le32(descriptor + low_offset) | (ext4->group_descriptor_size >= 64 ? (uint64_t) xorfs_get_le32(descriptor + high_offset) << 32 : 0);
+}
+
+int xorfs_has_ext4_superblock_copy(struct xorfs_ext4 *ext4, unsigned int group)
+{
+   if (!ext4->has_sparse_superblocks || group <= 1)
+   {
+      return 1;
+   }
+
+   // Powers of 3, 5 and 7
+   for (unsigned int base = 3; base <= 7; base += 2)
+   {
+      unsigned int power = base;
+      while (power < group)
+      {
+         power *= base;
+      }
+
+      if (power == group)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Set the bits of blocks from `first` to `last` (excluded) which are in the
+ * cached group
+ */
+void xorfs_mark_ext4_blocks(struct xorfs_ext4 *ext4, uint64_t first, uint64_t last)
+{
+   uint64_t group_start = ext4->first_data_block + (uint64_t) ext4->bitmap_group * ext4->blocks_per_group;
+
+   for (uint64_t block = first > group_start ? first : group_start; block < last && block < group_start + ext4->blocks_per_group; block++)
+   {
+      ext4->bitmap[(block - group_start) / 8] |= 1 << (block - group_start) % 8;
+   }
+}
+
+/**
+ * 1 if the block holds data or metadata, 0 if free, or a negative error
+ */
+int xorfs_is_ext4_block_used(struct xorfs_ext4 *ext4, uint64_t block)
+{
+   if (block < ext4->first_data_block)
+   {
+      return 1;
+   }
+
+   unsigned int group = (block - ext4->first_data_block) / ext4->blocks_per_group;
+   if (group >= ext4->group_count)
+   {
+      return 0;
+   }
+
+   if (group != ext4->bitmap_group)
+   {
+      const unsigned char *descriptor = ext4->group_descriptors + (size_t) group * ext4->group_descriptor_size;
+
+      ext4->bitmap_group = ext4->group_count;
+
+      if (xorfs_get_le16(descriptor + 0x12) & XORFS_EXT4_GROUP_BLOCK_UNINIT)
+      // Bitmap not written yet, only metadata is used - its own, and that of any group (flex_bg) placed in it
+      {
+         uint64_t group_start = ext4->first_data_block + (uint64_t) group * ext4->blocks_per_group;
+         uint64_t inode_table_block_count = ((uint64_t) ext4->inodes_per_group * ext4->inode_size + ext4->block_size - 1) / ext4->block_size;
+
+         memset(ext4->bitmap, 0, ext4->block_size);
+         ext4->bitmap_group = group;
+
+         if (xorfs_has_ext4_superblock_copy(ext4, group))
+         {
+            xorfs_mark_ext4_blocks(ext4, group_start, group_start + ext4->metadata_block_count);
+         }
+
+         for (unsigned int other_group = 0; other_group < ext4->group_count; other_group++)
+         {
+            uint64_t block_bitmap = xorfs_get_ext4_group_block(ext4, other_group, 0x0, 0x20);
+            uint64_t inode_bitmap = xorfs_get_ext4_group_block(ext4, other_group, 0x4, 0x24);
+            uint64_t inode_table = xorfs_get_ext4_group_block(ext4, other_group, 0x8, 0x28);
+
+            xorfs_mark_ext4_blocks(ext4, block_bitmap, block_bitmap + 1);
+            xorfs_mark_ext4_blocks(ext4, inode_bitmap, inode_bitmap + 1);
+            xorfs_mark_ext4_blocks(ext4, inode_table, inode_table + inode_table_block_count);
+         }
+      }
+      else
+      {
+         uint64_t bitmap_block = xorfs_get_ext4_group_block(ext4, group, 0x0, 0x20);
+         int return_value = xorfs_read_ext4(ext4, ext4->bitmap, (off_t) bitmap_block * ext4->block_size, ext4->block_size);
+         if (return_value != 0)
+         {
+            return return_value;
+         }
+
+         ext4->bitmap_group = group;
+      }
+   }
+
+   uint32_t index = (block - ext4->first_data_block) % ext4->blocks_per_group;
+   return (ext4->bitmap[index / 8] >> index % 8) & 1;
+}
+
+int xorfs_read_ext4_inode(struct xorfs_ext4 *ext4, uint32_t number, unsigned char inode[XORFS_EXT4_INODE_READ_SIZE])
+{
+   unsigned int group = (number - 1) / ext4->inodes_per_group;
+
+   if (number == 0 || group >= ext4->group_count)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Invalid inode number %u\n", number);
+      return -EIO;
+   }
+
+   uint64_t inode_table = xorfs_get_ext4_group_block(ext4, group, 0x8, 0x28);
+   off_t offset = (off_t) inode_table * ext4->block_size + (off_t) ((number - 1) % ext4->inodes_per_group) * ext4->inode_size;
+
+   return xorfs_read_ext4(ext4, inode, offset, XORFS_EXT4_INODE_READ_SIZE);
+}
+
+uint64_t xorfs_get_ext4_inode_size(const unsigned char inode[XORFS_EXT4_INODE_READ_SIZE])
+{
+   return xorfs_get_le32(inode + 0x4) | (uint64_t) xorfs_get_le32(inode + 0x6C) << 32;
+}
+
+/**
+ * Walk a node of an extent tree
+ */
+int xorfs_walk_ext4_extent_node(struct xorfs_ext4 *ext4, const unsigned char *node, size_t node_size, unsigned int level, xorfs_ext4_extent_function function, void *context)
+{
+   unsigned int entry_count = xorfs_get_le16(node + 2);
+   unsigned int depth = xorfs_get_le16(node + 6);
+   int return_value = 0;
+
+   if (xorfs_get_le16(node) != XORFS_EXT4_EXTENT_MAGIC || depth >= XORFS_EXT4_MAXIMUM_EXTENT_DEPTH || level++ >= XORFS_EXT4_MAXIMUM_EXTENT_DEPTH || 12 + entry_count * 12 > node_size)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Invalid ext4 extent tree\n");
+      return -EIO;
+   }
+
+   for (unsigned int index = 0; index < entry_count && return_value == 0; index++)
+   {
+      const unsigned char *entry = node + 12 + index * 12;
+
+      if (depth == 0)
+      // Leaf - uninitialized extents (longer than 32768 blocks) read as zeros
+      {
+         uint32_t length = xorfs_get_le16(entry + 4);
+         uint64_t start = xorfs_get_le32(entry + 8) | (uint64_t) xorfs_get_le16(entry + 6) << 32;
+
+         if (length > XORFS_EXT4_MAXIMUM_EXTENT_LENGTH)
+         {
+            return_value = function(ext4, xorfs_get_le32(entry), 0, length - XORFS_EXT4_MAXIMUM_EXTENT_LENGTH, context);
+         }
+         else
+         {
+            return_value = function(ext4, xorfs_get_le32(entry), start, length, context);
+         }
+      }
+      else
+      // Index
+      {
+         uint64_t leaf = xorfs_get_le32(entry + 4) | (uint64_t) xorfs_get_le16(entry + 8) << 32;
+         unsigned char *child = malloc(ext4->block_size);
+         if (child == NULL)
+         {
+            return -ENOMEM;
+         }
+
+         return_value = xorfs_read_ext4(ext4, child, (off_t) leaf * ext4->block_size, ext4->block_size);
+         if (return_value == 0)
+         {
+            return_value = xorfs_walk_ext4_extent_node(ext4, child, ext4->block_size, level, function, context);
+         }
+
+         free(child);
+      }
+   }
+
+   return return_value;
+}
+
+/**
+ * Walk an indirect block of a block-mapped file (ext2/ext3)
+ */
+int xorfs_walk_ext4_indirect_block(struct xorfs_ext4 *ext4, uint64_t block, unsigned int level, uint64_t *file_block, xorfs_ext4_extent_function function, void *context)
+{
+   uint64_t covered_block_count = 1;
+   for (unsigned int index = 0; index < level; index++)
+   {
+      covered_block_count *= ext4->block_size / 4;
+   }
+
+   if (block == 0)
+   {
+      *file_block += covered_block_count;
+      return 0;
+   }
+
+   if (level == 0)
+   {
+      return function(ext4, (*file_block)++, block, 1, context);
+   }
+
+   unsigned char *pointers = malloc(ext4->block_size);
+   if (pointers == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   int return_value = xorfs_read_ext4(ext4, pointers, (off_t) block * ext4->block_size, ext4->block_size);
+   for (unsigned int index = 0; index < ext4->block_size / 4 && return_value == 0; index++)
+   {
+      return_value = xorfs_walk_ext4_indirect_block(ext4, xorfs_get_le32(pointers + index * 4), level - 1, file_block, function, context);
+   }
+
+   free(pointers);
+   return return_value;
+}
+
+/**
+ * Pass every extent of the file to `function`, in the order of file blocks
+ */
+int xorfs_walk_ext4_extents(struct xorfs_ext4 *ext4, const unsigned char inode[XORFS_EXT4_INODE_READ_SIZE], xorfs_ext4_extent_function function, void *context)
+{
+   uint32_t flags = xorfs_get_le32(inode + 0x20);
+   const unsigned char *blocks = inode + 0x28;
+
+   if (flags & (XORFS_EXT4_INODE_INLINE_DATA | XORFS_EXT4_INODE_ENCRYPTED))
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Inline or encrypted data of ext4 files is not supported\n");
+      return -ENOTSUP;
+   }
+
+   if (flags & XORFS_EXT4_INODE_EXTENTS)
+   {
+      return xorfs_walk_ext4_extent_node(ext4, blocks, 60, 0, function, context);
+   }
+
+   // Twelve direct blocks, then single, double and triple indirect ones
+   uint64_t file_block = 0;
+   int return_value = 0;
+
+   for (unsigned int index = 0; index < 15 && return_value == 0; index++)
+   {
+      return_value = xorfs_walk_ext4_indirect_block(ext4, xorfs_get_le32(blocks + index * 4), index < 12 ? 0 : index - 11, &file_block, function, context);
+   }
+
+   return return_value;
+}
+
+struct xorfs_ext4_lookup {
+   const char *name;
+   size_t name_length;
+   uint64_t directory_size;
+   uint32_t found_inode;
+};
+
+int xorfs_find_ext4_directory_entry(struct xorfs_ext4 *ext4, uint64_t file_block, uint64_t disk_block, uint64_t count, void *context)
+{
+   struct xorfs_ext4_lookup *lookup = context;
+   unsigned char *block = malloc(ext4->block_size);
+   int return_value = 0;
+
+   if (block == NULL)
+   {
+      return -ENOMEM;
+   }
+
+   // Hash tree nodes look like empty entries, so all blocks are just searched
+   for (uint64_t index = 0; index < count && disk_block != 0 && lookup->found_inode == 0 && return_value == 0; index++)
+   {
+      if ((file_block + index) * ext4->block_size >= lookup->directory_size)
+      {
+         break;
+      }
+
+      return_value = xorfs_read_ext4(ext4, block, (off_t) (disk_block + index) * ext4->block_size, ext4->block_size);
+
+      for (unsigned int position = 0; return_value == 0 && position + 8 <= ext4->block_size; )
+      {
+         const unsigned char *entry = block + position;
+         unsigned int record_length = xorfs_get_le16(entry + 4);
+         unsigned int name_length = entry[6];
+
+         if (record_length < 8 || position + record_length > ext4->block_size)
+         {
+            break;
+         }
+
+         if (xorfs_get_le32(entry) != 0 && name_length == lookup->name_length && 8 + name_length <= record_length && memcmp(entry + 8, lookup->name, name_length) == 0)
+         {
+            lookup->found_inode = xorfs_get_le32(entry);
+            break;
+         }
+
+         position += record_length;
+      }
+   }
+
+   free(block);
+   return return_value;
+}
+
+/**
+ * Inode of the file at the path, or a negative error
+ */
+int64_t xorfs_find_ext4_file(struct xorfs_ext4 *ext4, const char *path, unsigned char inode[XORFS_EXT4_INODE_READ_SIZE])
+{
+   uint32_t number = XORFS_EXT4_ROOT_INODE;
+   int return_value = xorfs_read_ext4_inode(ext4, number, inode);
+
+   while (return_value == 0)
+   {
+      while (*path == '/')
+      {
+         path++;
+      }
+
+      if (*path == '\0')
+      {
+         return number;
+      }
+
+      if ((xorfs_get_le16(inode) & S_IFMT) != S_IFDIR)
+      {
+         return -ENOTDIR;
+      }
+
+      struct xorfs_ext4_lookup lookup = { path, strcspn(path, "/"), xorfs_get_ext4_inode_size(inode), 0 };
+
+      return_value = xorfs_walk_ext4_extents(ext4, inode, xorfs_find_ext4_directory_entry, &lookup);
+      if (return_value == 0 && lookup.found_inode == 0)
+      {
+         return -ENOENT;
+      }
+
+      if (return_value == 0)
+      {
+         number = lookup.found_inode;
+         path += lookup.name_length;
+         return_value = xorfs_read_ext4_inode(ext4, number, inode);
+      }
+   }
+
+   return return_value;
+}
+
+struct xorfs_ext4_file_output {
+   int fd;
+   uint64_t size;
+   char *buffer; // XORFS_GUEST_CHUNK_SIZE
+};
+
+int xorfs_write_ext4_extent(struct xorfs_ext4 *ext4, uint64_t file_block, uint64_t disk_block, uint64_t count, void *context)
+{
+   struct xorfs_ext4_file_output *output = context;
+   uint64_t offset = file_block * ext4->block_size;
+   uint64_t end = (file_block + count) * ext4->block_size;
+
+   if (disk_block == 0)
+   {
+      return 0;
+   }
+
+   end = end < output->size ? end : output->size;
+
+   for (uint64_t position = offset; position < end; position += XORFS_GUEST_CHUNK_SIZE)
+   {
+      size_t size = end - position < XORFS_GUEST_CHUNK_SIZE ? end - position : XORFS_GUEST_CHUNK_SIZE;
+      int return_value = xorfs_read_ext4(ext4, output->buffer, (off_t) disk_block * ext4->block_size + (position - offset), size);
+
+      if (return_value == 0)
+      {
+         return_value = xorfs_write_sparse(output->fd, output->buffer, size, position);
+      }
+
+      if (return_value != 0)
+      {
+         return return_value;
+      }
+   }
+
+   return 0;
+}
+
+int xorfs_tool_extract_file(int argc, char *argv[])
+{
+   struct xorfs_source_file *source_file;
+   struct xorfs_ext4 ext4 = { NULL };
+   struct xorfs_ext4_file_output output = { -1, 0, malloc(XORFS_GUEST_CHUNK_SIZE) };
+   unsigned char inode[XORFS_EXT4_INODE_READ_SIZE];
+   int return_value = 1;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      free(output.buffer);
+      return 1;
+   }
+
+   source_file = xorfs_get_source_file_by_file_name(argv[2]);
+   if (source_file == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backup '%s'\n", argv[2]);
+      goto cleanup;
+   }
+
+   if (output.buffer == NULL || xorfs_open_ext4(source_file, &ext4) != 0)
+   {
+      goto cleanup;
+   }
+
+   int64_t number = xorfs_find_ext4_file(&ext4, argv[3], inode);
+   if (number < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to find '%s' in %s: %s\n", argv[3], argv[2], strerror(-number));
+      goto cleanup;
+   }
+
+   if ((xorfs_get_le16(inode) & S_IFMT) != S_IFREG)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "'%s' in %s is not a regular file\n", argv[3], argv[2]);
+      goto cleanup;
+   }
+
+   output.size = xorfs_get_ext4_inode_size(inode);
+   output.fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+   if (output.fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to create '%s': %s\n", argv[4], strerror(errno));
+      goto cleanup;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Extracting '%s' (inode %li, %lu bytes) of %s\n", argv[3], number, output.size, argv[2]);
+
+   int walk_result = xorfs_walk_ext4_extents(&ext4, inode, xorfs_write_ext4_extent, &output);
+   if (walk_result != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to extract '%s': %s\n", argv[3], strerror(-walk_result));
+   }
+   else if (ftruncate(output.fd, output.size) == 0)
+   {
+      return_value = 0;
+   }
+
+   cleanup:
+   if (output.fd >= 0 && close(output.fd) != 0)
+   {
+      return_value = 1;
+   }
+
+   xorfs_close_ext4(&ext4);
+   free(output.buffer);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Write a backup with the free blocks of its filesystem left as holes
+ *
+ * Only blocks in use are reconstructed, the rest of the disk (partition
+ * table, other partitions) is copied whole.
+ */
+int xorfs_tool_extract_used(int argc, char *argv[])
+{
+   struct xorfs_source_file *source_file;
+   struct xorfs_ext4 ext4 = { NULL };
+   char *buffer = malloc(XORFS_GUEST_CHUNK_SIZE);
+   int output_fd = -1;
+   int return_value = 1;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      free(buffer);
+      return 1;
+   }
+
+   source_file = xorfs_get_source_file_by_file_name(argv[2]);
+   if (source_file == NULL)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backup '%s'\n", argv[2]);
+      goto cleanup;
+   }
+
+   if (buffer == NULL || xorfs_open_ext4(source_file, &ext4) != 0)
+   {
+      goto cleanup;
+   }
+
+   output_fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, XORFS_FILE_PERMISSIONS);
+   if (output_fd < 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to create '%s': %s\n", argv[3], strerror(errno));
+      goto cleanup;
+   }
+
+   off_t filesystem_end = ext4.offset + (off_t) ext4.block_count * ext4.block_size;
+   off_t used_size = 0;
+
+   for (off_t offset = 0; offset < source_file->backup.size; offset += XORFS_GUEST_CHUNK_SIZE)
+   {
+      size_t size = source_file->backup.size - offset < XORFS_GUEST_CHUNK_SIZE ? source_file->backup.size - offset : XORFS_GUEST_CHUNK_SIZE;
+
+      memset(buffer, 0, size);
+
+      // Runs of bytes to reconstruct - outside of the filesystem all, inside used blocks (block-aligned, as the chunks are)
+      for (off_t position = offset; position < offset + size; )
+      {
+         off_t run_end = position;
+         int is_used = 1;
+
+         if (position >= ext4.offset && position < filesystem_end)
+         {
+            is_used = xorfs_is_ext4_block_used(&ext4, (position - ext4.offset) / ext4.block_size);
+            if (is_used < 0)
+            {
+               goto cleanup;
+            }
+         }
+
+         while (run_end < offset + size)
+         {
+            if (run_end < ext4.offset || run_end >= filesystem_end)
+            {
+               if (!is_used)
+               {
+                  break;
+               }
+
+               run_end = run_end < ext4.offset && ext4.offset < offset + size ? ext4.offset : offset + size;
+            }
+            else
+            {
+               int is_block_used = xorfs_is_ext4_block_used(&ext4, (run_end - ext4.offset) / ext4.block_size);
+               if (is_block_used < 0)
+               {
+                  goto cleanup;
+               }
+
+               if (is_block_used != is_used)
+               {
+                  break;
+               }
+
+               run_end += ext4.block_size - (run_end - ext4.offset) % ext4.block_size;
+            }
+         }
+
+         run_end = run_end < offset + size ? run_end : offset + size;
+
+         if (is_used)
+         {
+            int read_bytes = xorfs_read_backup_streamed(source_file, buffer + (position - offset), position, run_end - position);
+            if (read_bytes < 0)
+            {
+               xorfs_log(XORFS_LOG_ERROR, "Unable to read %s: %s\n", argv[2], strerror(-read_bytes));
+               goto cleanup;
+            }
+
+            used_size += run_end - position;
+         }
+
+         position = run_end;
+      }
+
+      if (xorfs_write_sparse(output_fd, buffer, size, offset) != 0)
+      {
+         goto cleanup;
+      }
+   }
+
+   if (ftruncate(output_fd, source_file->backup.size) == 0)
+   {
+      xorfs_log(XORFS_LOG_INFO, "Extracted %s, %li of %li bytes in use\n", argv[2], used_size, source_file->backup.size);
+      return_value = 0;
+   }
+
+   cleanup:
+   if (output_fd >= 0 && close(output_fd) != 0)
+   {
+      return_value = 1;
+   }
+
+   xorfs_close_ext4(&ext4);
+   free(buffer);
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/*
+ * Block history index
+ *
+ * Built from the non-zero blocks of the xored images of a set against
+ * their previous backups, so which backups changed a block is looked up
+ * without reading any image. Backups without such an image are compared
+ * with their previous backups in a scan of the set.
+ */
+
+struct xorfs_history_change {
+   struct xorfs_source_file *source_file; // Image of the change against the previous backup, the backup itself if compared
+   struct xorfs_source_file *previous_source_file; // Of the previous backup, NULL for the first one
+   int is_compared; // No image against the previous backup
+   uint64_t *blocks; // Changed, increasing
+   uint64_t block_count;
+   uint64_t allocated_count;
+};
+
+int xorfs_compare_history_changes(const void *first, const void *second)
+{
+   unsigned int first_number = ((const struct xorfs_history_change *) first)->source_file->backup.number;
+   unsigned int second_number = ((const struct xorfs_history_change *) second)->source_file->backup.number;
+
+   return (first_number > second_number) - (first_number < second_number);
+}
+
+int xorfs_add_changed_block(struct xorfs_history_change *change, uint64_t block)
+{
+   if (change->block_count > 0 && change->blocks[change->block_count - 1] == block)
+   {
+      return 0;
+   }
+
+   if (change->block_count == change->allocated_count)
+   {
+      change->allocated_count = change->allocated_count == 0 ? 1024 : change->allocated_count * 2;
+      uint64_t *blocks = realloc(change->blocks, change->allocated_count * sizeof (uint64_t));
+      if (blocks == NULL)
+      {
+         return -ENOMEM;
+      }
+
+      change->blocks = blocks;
+   }
+
+   change->blocks[change->block_count++] = block;
+   return 0;
+}
+
+/**
+ * Find the non-zero blocks of the image of the change
+ */
+int xorfs_find_changed_blocks(struct xorfs_history_change *change, uint32_t block_size, char *buffer, size_t buffer_size)
+{
+   struct xorfs_source_file *source_file = change->source_file;
+   off_t size = source_file->stat.st_size;
+
+   for (off_t offset = 0; offset < size; )
+   {
+      off_t data_offset = xorfs_seek_source_file(source_file, offset, SEEK_DATA);
+      if (data_offset < 0)
+      {
+         break;
+      }
+
+      off_t hole_offset = xorfs_seek_source_file(source_file, data_offset, SEEK_HOLE);
+      if (hole_offset < 0 || hole_offset > size)
+      {
+         hole_offset = size;
+      }
+
+      // Whole blocks, a chunk at a time
+      for (offset = data_offset / block_size * block_size; offset < hole_offset; offset += buffer_size)
+      {
+         int read_bytes = xorfs_read_plain(source_file, buffer, offset, buffer_size);
+         if (read_bytes < 0)
+         {
+            return read_bytes;
+         }
+
+         memset(buffer + read_bytes, 0, buffer_size - read_bytes);
+
+         for (size_t position = 0; position < read_bytes; position += block_size)
+         {
+            const char *block = buffer + position;
+            if (block[0] == 0 && memcmp(block, block + 1, block_size - 1) == 0)
+            {
+               continue;
+            }
+
+            if (xorfs_add_changed_block(change, (offset + position) / block_size) != 0)
+            {
+               return -ENOMEM;
+            }
+         }
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Backups compared with their previous ones, by hashes of the segments of
+ * each chunk of the scan - a block changed if any of its segments did
+ */
+struct xorfs_history_comparison {
+   struct xorfs_history_change *changes;
+   unsigned int change_count;
+   int *slots; // Of the hashes of a backup, by its used source file, -1 if not compared
+   unsigned char (*hashes)[XORFS_HASH_SIZE]; // segment_count for each slot
+   unsigned char zero_hash[XORFS_HASH_SIZE]; // Of a segment of zeros, past the end of a backup
+   char *padded_segment; // The last one of a backup, padded with zeros
+   size_t segment_size; // The block size, at most the chunk size
+   unsigned int segment_count; // In a chunk
+   unsigned int slot_count;
+   uint32_t block_size;
+   off_t offset; // Of the chunk, -1 before the first
+};
+
+/**
+ * Add the blocks of the chunk in which backups differ from the previous ones
+ */
+int xorfs_compare_history_chunk(struct xorfs_history_comparison *comparison)
+{
+   for (unsigned int index = 0; index < comparison->change_count; index++)
+   {
+      struct xorfs_history_change *change = comparison->changes + index;
+      if (!change->is_compared)
+      {
+         continue;
+      }
+
+      unsigned char (*hashes)[XORFS_HASH_SIZE] = comparison->hashes + comparison->slots[change->source_file - xorfs_source_files.files] * comparison->segment_count;
+      unsigned char (*previous_hashes)[XORFS_HASH_SIZE] = change->previous_source_file == NULL ? NULL
+         : comparison->hashes + comparison->slots[change->previous_source_file - xorfs_source_files.files] * comparison->segment_count;
+
+      for (unsigned int segment = 0; segment < comparison->segment_count; segment++)
+      {
+         off_t offset = comparison->offset + (off_t) segment * comparison->segment_size;
+         if (offset >= change->source_file->backup.size)
+         {
+            break;
+         }
+
+         const unsigned char *previous_hash = previous_hashes != NULL ? previous_hashes[segment] : comparison->zero_hash;
+         if (memcmp(hashes[segment], previous_hash, XORFS_HASH_SIZE) != 0 && xorfs_add_changed_block(change, offset / comparison->block_size) != 0)
+         {
+            return -ENOMEM;
+         }
+      }
+   }
+
+   // Backups not scanned in the next chunk are zeros there
+   for (unsigned int segment = 0; segment < comparison->slot_count * comparison->segment_count; segment++)
+   {
+      memcpy(comparison->hashes[segment], comparison->zero_hash, XORFS_HASH_SIZE);
+   }
+
+   return 0;
+}
+
+int xorfs_hash_scanned_segments(struct xorfs_source_file *source_file, const char *data, off_t offset, size_t size, void *context)
+{
+   struct xorfs_history_comparison *comparison = context;
+   int slot = comparison->slots[source_file - xorfs_source_files.files];
+
+   // The scan moved to the next chunk
+   if (offset != comparison->offset)
+   {
+      if (comparison->offset >= 0 && xorfs_compare_history_chunk(comparison) != 0)
+      {
+         return -ENOMEM;
+      }
+
+      comparison->offset = offset;
+   }
+
+   if (slot < 0)
+   {
+      return 0;
+   }
+
+   for (size_t position = 0; position < size; position += comparison->segment_size)
+   {
+      const char *segment = data + position;
+
+      if (size - position < comparison->segment_size)
+      {
+         memcpy(comparison->padded_segment, segment, size - position);
+         memset(comparison->padded_segment + (size - position), 0, comparison->segment_size - (size - position));
+         segment = comparison->padded_segment;
+      }
+
+      xorfs_sha256(segment, comparison->segment_size, comparison->hashes[slot * comparison->segment_count + position / comparison->segment_size]);
+   }
+
+   return 0;
+}
+
+/**
+ * Find the changed blocks of the backups without an image against the
+ * previous backup, comparing them with it in one scan of the set
+ */
+int xorfs_compare_history_changes_by_scan(const char *backup_name, struct xorfs_history_change *changes, unsigned int change_count, uint32_t block_size, off_t length)
+{
+   struct xorfs_history_comparison comparison = { changes, change_count, malloc(xorfs_source_files.count * sizeof (int)) };
+   int return_value = 0;
+
+   comparison.segment_size = block_size < XORFS_TOOL_CHUNK_SIZE ? block_size : XORFS_TOOL_CHUNK_SIZE;
+   comparison.segment_count = XORFS_TOOL_CHUNK_SIZE / comparison.segment_size;
+   comparison.block_size = block_size;
+   comparison.offset = -1;
+   comparison.padded_segment = calloc(1, comparison.segment_size);
+   if (comparison.slots == NULL || comparison.padded_segment == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   xorfs_sha256(comparison.padded_segment, comparison.segment_size, comparison.zero_hash);
+
+   // Slots of the compared backups and of their previous ones
+   for (unsigned int index = 0; index < xorfs_source_files.count; index++)
+   {
+      comparison.slots[index] = -1;
+   }
+
+   for (unsigned int index = 0; index < change_count; index++)
+   {
+      struct xorfs_source_file *source_files[2] = { changes[index].source_file, changes[index].previous_source_file };
+
+      for (int file = 0; file < 2 && changes[index].is_compared; file++)
+      {
+         if (source_files[file] != NULL && comparison.slots[source_files[file] - xorfs_source_files.files] < 0)
+         {
+            comparison.slots[source_files[file] - xorfs_source_files.files] = comparison.slot_count++;
+         }
+      }
+   }
+
+   comparison.hashes = malloc((size_t) comparison.slot_count * comparison.segment_count * XORFS_HASH_SIZE);
+   if (comparison.hashes == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   for (unsigned int segment = 0; segment < comparison.slot_count * comparison.segment_count; segment++)
+   {
+      memcpy(comparison.hashes[segment], comparison.zero_hash, XORFS_HASH_SIZE);
+   }
+
+   return_value = xorfs_scan_backup_set(backup_name, 0, length, xorfs_hash_scanned_segments, &comparison);
+   if (return_value == 0 && comparison.offset >= 0)
+   {
+      return_value = xorfs_compare_history_chunk(&comparison);
+   }
+
+   cleanup:
+   free(comparison.slots);
+   free(comparison.hashes);
+   free(comparison.padded_segment);
+   return return_value;
+}
+
+/**
+ * Write the block history index of the set
+ */
+int xorfs_build_history(const char *backup_name, uint32_t block_size)
+{
+   struct xorfs_history_change *changes = calloc(xorfs_source_files.count, sizeof (struct xorfs_history_change));
+   size_t buffer_size = block_size > XORFS_TOOL_CHUNK_SIZE ? block_size : XORFS_TOOL_CHUNK_SIZE;
+   char *buffer = malloc(buffer_size);
+   uint64_t *offsets = NULL;
+   uint32_t *numbers = NULL;
+   char *file_name = NULL;
+   char *temporary_path = NULL;
+   unsigned int change_count = 0;
+   unsigned int compared_count = 0;
+   uint64_t block_count = 0;
+   uint64_t entry_count = 0;
+   off_t length = 0;
+   int return_value = 0;
+   int fd = -1;
+
+   if (changes == NULL || buffer == NULL || asprintf(&file_name, "%s%s", backup_name, XORFS_HISTORY_FILE_EXTENSION) < 0)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   // A change for every backup of the set
+   for (int index = 0; index < xorfs_source_files.count; index++)
+   {
+      struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+      if (source_file->is_duplicate || strcmp(source_file->backup.name, backup_name) != 0)
+      {
+         continue;
+      }
+
+      uint64_t backup_block_count = (source_file->backup.size + block_size - 1) / block_size;
+      block_count = backup_block_count > block_count ? backup_block_count : block_count;
+      length = source_file->backup.size > length ? source_file->backup.size : length;
+      changes[change_count++].source_file = source_file;
+   }
+
+   if (change_count == 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No backups of '%s'\n", backup_name);
+      return_value = -ENOENT;
+      goto cleanup;
+   }
+
+   qsort(changes, change_count, sizeof (struct xorfs_history_change), xorfs_compare_history_changes);
+
+   for (unsigned int index = 1; index < change_count; index++)
+   {
+      changes[index].previous_source_file = changes[index - 1].source_file;
+   }
+
+   // Image against the previous backup (a plain one for the first backup), otherwise compared with it
+   for (unsigned int index = 0; index < change_count; index++)
+   {
+      struct xorfs_history_change *change = changes + index;
+      unsigned int previous_number = change->previous_source_file != NULL ? change->previous_source_file->backup.number : 0;
+
+      change->is_compared = 1;
+
+      for (int other_index = 0; other_index < xorfs_source_files.count && change->is_compared; other_index++)
+      {
+         struct xorfs_source_file *other_source_file = xorfs_source_files.files + other_index;
+         if (other_source_file->backup.set == change->source_file->backup.set && other_source_file->backup.number == change->source_file->backup.number
+             && other_source_file->backup.xor_against_number == previous_number)
+         {
+            change->source_file = other_source_file;
+            change->is_compared = 0;
+         }
+      }
+
+      compared_count += change->is_compared;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Indexing history of %u backups of %s, %lu blocks of %u bytes\n", change_count, backup_name, block_count, block_size);
+
+   for (unsigned int index = 0; index < change_count && return_value == 0; index++)
+   {
+      if (!changes[index].is_compared)
+      {
+         return_value = xorfs_find_changed_blocks(changes + index, block_size, buffer, buffer_size);
+      }
+   }
+
+   if (return_value == 0 && compared_count > 0)
+   {
+      xorfs_log(XORFS_LOG_INFO, "Comparing %u backups without an image against the previous backup\n", compared_count);
+      return_value = xorfs_compare_history_changes_by_scan(backup_name, changes, change_count, block_size, length);
+   }
+
+   for (unsigned int index = 0; index < change_count; index++)
+   {
+      entry_count += changes[index].block_count;
+   }
+
+   if (return_value != 0)
+   {
+      goto cleanup;
+   }
+
+   // Offsets by counts of changes of each block, then numbers in order of backups
+   offsets = calloc(block_count + 1, sizeof (uint64_t));
+   numbers = malloc(entry_count * sizeof (uint32_t) + 1);
+   if (offsets == NULL || numbers == NULL)
+   {
+      return_value = -ENOMEM;
+      goto cleanup;
+   }
+
+   for (unsigned int index = 0; index < change_count; index++)
+   {
+      for (uint64_t block = 0; block < changes[index].block_count; block++)
+      {
+         offsets[changes[index].blocks[block] + 1]++;
+      }
+   }
+
+   for (uint64_t block = 0; block < block_count; block++)
+   {
+      offsets[block + 1] += offsets[block];
+   }
+
+   for (unsigned int index = 0; index < change_count; index++)
+   {
+      for (uint64_t block = 0; block < changes[index].block_count; block++)
+      {
+         numbers[offsets[changes[index].blocks[block]]++] = htole32(changes[index].source_file->backup.number);
+      }
+   }
+
+   // Filling moved every offset to the next block
+   for (uint64_t block = block_count; block > 0; block--)
+   {
+      offsets[block] = htole64(offsets[block - 1]);
+   }
+
+   offsets[0] = 0;
+
+   fd = xorfs_create_temporary_file(file_name, &temporary_path);
+   if (fd < 0)
+   {
+      return_value = -EIO;
+      goto cleanup;
+   }
+
+   {
+      struct xorfs_history_header header;
+      size_t offsets_size = (block_count + 1) * sizeof (uint64_t);
+
+      memset(&header, 0, sizeof header);
+      memcpy(header.magic, XORFS_HISTORY_MAGIC, sizeof header.magic);
+      header.version = htole32(XORFS_HISTORY_VERSION);
+      header.block_size = htole32(block_size);
+      header.block_count = htole64(block_count);
+      header.entry_count = htole64(entry_count);
+      header.last_number = htole32(changes[change_count - 1].source_file->backup.number);
+
+      if (pwrite(fd, &header, sizeof header, 0) != sizeof header
+          || pwrite(fd, offsets, offsets_size, sizeof header) != offsets_size
+          || pwrite(fd, numbers, entry_count * sizeof (uint32_t), sizeof header + offsets_size) != entry_count * sizeof (uint32_t))
+      {
+         xorfs_log(XORFS_LOG_ERROR, "Unable to write '%s': %s\n", temporary_path, strerror(errno));
+         unlink(temporary_path);
+         free(temporary_path);
+         close(fd);
+         return_value = -EIO;
+         goto cleanup;
+      }
+   }
+
+   return_value = xorfs_commit_temporary_file(fd, temporary_path, file_name);
+   if (return_value == 0)
+   {
+      xorfs_log(XORFS_LOG_INFO, "Written '%s', %lu changed blocks\n", file_name, entry_count);
+   }
+
+   cleanup:
+   for (unsigned int index = 0; changes != NULL && index < change_count; index++)
+   {
+      free(changes[index].blocks);
+   }
+
+   free(changes);
+   free(buffer);
+   free(offsets);
+   free(numbers);
+   free(file_name);
+   return return_value;
+}
+
+int xorfs_tool_history(int argc, char *argv[])
+{
+   long block_size = argc > 3 ? atol(argv[3]) : XORFS_HISTORY_DEFAULT_BLOCK_SIZE;
+   int return_value;
+
+   if (block_size < 512 || block_size > (1 << 24) || (block_size & (block_size - 1)) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Block size must be a power of two between 512 B and 16 MiB\n");
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   return_value = xorfs_build_history(argv[2], block_size) == 0 ? 0 : 1;
+   if (return_value != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to index history of '%s'\n", argv[2]);
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Print numbers of backups which changed the block at the offset
+ */
+int xorfs_tool_history_query(int argc, char *argv[])
+{
+   off_t offset = strtoll(argv[3], NULL, 0);
+   int return_value = 1;
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   for (unsigned int set = 0; set < xorfs_source_files.history_count; set++)
+   {
+      const struct xorfs_history *history = xorfs_source_files.histories + set;
+      if (strcmp(xorfs_backup_sets.sets[set].name, argv[2]) != 0 || history->mapping == NULL)
+      {
+         continue;
+      }
+
+      uint64_t count = xorfs_get_block_history(history, offset, NULL, 0);
+      uint32_t *numbers = malloc(count * sizeof (uint32_t) + 1);
+      if (numbers != NULL)
+      {
+         xorfs_get_block_history(history, offset, numbers, count);
+         for (uint64_t index = 0; index < count; index++)
+         {
+            printf(index == 0 ? "%u" : " %u", numbers[index]);
+         }
+
+         printf("\n");
+         free(numbers);
+         return_value = 0;
+      }
+   }
+
+   if (return_value != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "No block history index of '%s'\n", argv[2]);
+   }
+
+   xorfs_close_source_files();
+   return return_value;
+}
+
+/**
+ * Answer XORFS_IOCTL_BLOCK_HISTORY from the index of the set of the backup
+ */
+static int xorfs_operation_ioctl( const char *path, int command, void *argument, struct fuse_file_info *fi, unsigned int flags, void *data )
+{
+   xorfs_log(XORFS_LOG_DEBUG, "Operation ioctl on '%s', command %x\n", path, command);
+
+   if ((unsigned int) command != XORFS_IOCTL_BLOCK_HISTORY || (flags & FUSE_IOCTL_COMPAT))
+   {
+      return -ENOTTY;
+   }
+
+   unsigned int epoch_parity = xorfs_enter_catalog();
+   struct xorfs_source_files *catalog = __atomic_load_n(&xorfs_catalog, __ATOMIC_ACQUIRE);
+   struct xorfs_source_file *source_file = xorfs_get_source_file_by_file_name(path + 1);
+   struct xorfs_block_history *block_history = data;
+   int return_value = 0;
+
+   if (source_file == NULL)
+   {
+      return_value = -ENOENT;
+   }
+   else if (source_file->backup.set >= catalog->history_count || catalog->histories[source_file->backup.set].mapping == NULL)
+   {
+      return_value = -ENODATA;
+   }
+   else
+   {
+      const struct xorfs_history *history = catalog->histories + source_file->backup.set;
+      uint64_t count = xorfs_get_block_history(history, block_history->offset, block_history->numbers, XORFS_HISTORY_MAXIMUM_QUERY_COUNT);
+
+      block_history->count = count > UINT32_MAX ? UINT32_MAX : count;
+      block_history->last_number = history->last_number;
+      block_history->block_size = history->block_size;
+   }
+
+   xorfs_leave_catalog(epoch_parity);
+   return return_value;
+}
+
+/*
+ * NBD server
+ *
+ * Serves every backup as a read-only export named like its output file
+ * (`db-5.dat`) over a Unix socket, following the NBD protocol with the fixed
+ * newstyle handshake, structured replies and the base:allocation metadata
+ * context. Clients can attach it directly (qemu, nbd-client) instead of
+ * a loop device over the mounted file.
+ *
+ * Each connection is served by several threads which take turns reading
+ * requests, so a connection has that many requests in flight, and replies
+ * may come out of order. Backups never change, so clients may open any
+ * number of connections to one export (multi-conn).
+ */
+
+enum xorfs_nbd_option {
+   XORFS_NBD_OPTION_EXPORT_NAME = 1,
+   XORFS_NBD_OPTION_ABORT = 2,
+   XORFS_NBD_OPTION_LIST = 3,
+   XORFS_NBD_OPTION_INFO = 6,
+   XORFS_NBD_OPTION_GO = 7,
+   XORFS_NBD_OPTION_STRUCTURED_REPLY = 8,
+   XORFS_NBD_OPTION_LIST_META_CONTEXT = 9,
+   XORFS_NBD_OPTION_SET_META_CONTEXT = 10,
+};
+
+enum xorfs_nbd_option_reply_type {
+   XORFS_NBD_REPLY_ACK = 1,
+   XORFS_NBD_REPLY_SERVER = 2,
+   XORFS_NBD_REPLY_INFO = 3,
+   XORFS_NBD_REPLY_META_CONTEXT = 4,
+   XORFS_NBD_REPLY_ERROR_UNSUPPORTED = 0x80000001,
+   XORFS_NBD_REPLY_ERROR_INVALID = 0x80000003,
+   XORFS_NBD_REPLY_ERROR_UNKNOWN = 0x80000006,
+};
+
+enum xorfs_nbd_info {
+   XORFS_NBD_INFO_EXPORT = 0,
+   XORFS_NBD_INFO_BLOCK_SIZE = 3,
+};
+
+enum xorfs_nbd_flag {
+   XORFS_NBD_FLAG_FIXED_NEWSTYLE = 1 << 0, // Handshake
+   XORFS_NBD_FLAG_NO_ZEROES = 1 << 1, // Handshake
+   XORFS_NBD_FLAG_HAS_FLAGS = 1 << 0, // Transmission
+   XORFS_NBD_FLAG_READ_ONLY = 1 << 1,
+   XORFS_NBD_FLAG_SEND_FLUSH = 1 << 2,
+   XORFS_NBD_FLAG_SEND_DF = 1 << 7,
+   XORFS_NBD_FLAG_CAN_MULTI_CONN = 1 << 8,
+   XORFS_NBD_FLAG_SEND_CACHE = 1 << 10,
+};
+
+enum xorfs_nbd_command {
+   XORFS_NBD_COMMAND_READ = 0,
+   XORFS_NBD_COMMAND_WRITE = 1,
+   XORFS_NBD_COMMAND_DISCONNECT = 2,
+   XORFS_NBD_COMMAND_FLUSH = 3,
+   XORFS_NBD_COMMAND_CACHE = 5,
+   XORFS_NBD_COMMAND_BLOCK_STATUS = 7,
+};
+
+enum xorfs_nbd_command_flag {
+   XORFS_NBD_COMMAND_FLAG_DF = 1 << 2, // Read in one chunk
+   XORFS_NBD_COMMAND_FLAG_REQ_ONE = 1 << 3, // One extent of block status
+};
+
+enum xorfs_nbd_reply_type {
+   XORFS_NBD_REPLY_TYPE_NONE = 0,
+   XORFS_NBD_REPLY_TYPE_OFFSET_DATA = 1,
+   XORFS_NBD_REPLY_TYPE_OFFSET_HOLE = 2,
+   XORFS_NBD_REPLY_TYPE_BLOCK_STATUS = 5,
+   XORFS_NBD_REPLY_TYPE_ERROR = 0x8001,
+};
+
+#define XORFS_NBD_REPLY_FLAG_DONE 1
+#define XORFS_NBD_STATE_HOLE 1
+#define XORFS_NBD_STATE_ZERO 2
+
+// Numbers are big-endian
+struct xorfs_nbd_option_request {
+   uint64_t magic;
+   uint32_t option;
+   uint32_t length;
+} __attribute__ ((packed));
+
+struct xorfs_nbd_option_reply {
+   uint64_t magic;
+   uint32_t option;
+   uint32_t type;
+   uint32_t length;
+} __attribute__ ((packed));
+
+struct xorfs_nbd_request {
+   uint32_t magic;
+   uint16_t flags;
+   uint16_t type;
+   uint64_t cookie;
+   uint64_t offset;
+   uint32_t length;
+} __attribute__ ((packed));
+
+struct xorfs_nbd_simple_reply {
+   uint32_t magic;
+   uint32_t error;
+   uint64_t cookie;
+} __attribute__ ((packed));
+
+struct xorfs_nbd_structured_reply {
+   uint32_t magic;
+   uint16_t flags;
+   uint16_t type;
+   uint64_t cookie;
+   uint32_t length;
+} __attribute__ ((packed));
+
+struct xorfs_nbd_connection {
+   int fd;
+   pthread_mutex_t read_mutex; // Reading of requests
+   pthread_mutex_t write_mutex; // Writing of replies
+   struct xorfs_source_file *source_file; // The export
+   int structured_replies;
+   int base_allocation; // Metadata context selected
+   int is_closing;
+   int thread_count; // Threads still serving
+};
+
+int xorfs_nbd_thread_count = XORFS_NBD_CONNECTION_THREAD_COUNT;
+volatile sig_atomic_t xorfs_nbd_is_stopping = 0;
+
+int xorfs_nbd_receive(int fd, void *buffer, size_t size)
+{
+   for (size_t done = 0; done < size; )
+   {
+      ssize_t result = recv(fd, (char *) buffer + done, size - done, 0);
+      if (result <= 0 && !(result < 0 && errno == EINTR))
+      {
+         return -1;
+      }
+
+      done += result > 0 ? result : 0;
+   }
+
+   return 0;
+}
+
+int xorfs_nbd_send(int fd, const void *buffer, size_t size)
+{
+   for (size_t done = 0; done < size; )
+   {
+      ssize_t result = send(fd, (const char *) buffer + done, size - done, MSG_NOSIGNAL);
+      if (result < 0 && errno != EINTR)
+      {
+         return -1;
+      }
+
+      done += result > 0 ? result : 0;
+   }
+
+   return 0;
+}
+
+/**
+ * NBD error number for an errno
+ */
+uint32_t xorfs_nbd_error(int error)
+{
+   switch (error)
+   {
+      case EPERM: return 1;
+      case ENOMEM: return 12;
+      case EINVAL: return 22;
+      case EOVERFLOW: return 75;
+      default: return 5; // EIO
+   }
+}
+
+int xorfs_nbd_send_option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t length)
+{
+   struct xorfs_nbd_option_reply reply = { htobe64(XORFS_NBD_OPTION_REPLY_MAGIC), htobe32(option), htobe32(type), htobe32(length) };
+
+   return xorfs_nbd_send(fd, &reply, sizeof reply) != 0 || xorfs_nbd_send(fd, data, length) != 0 ? -1 : 0;
+}
+
+uint16_t xorfs_nbd_get_transmission_flags(struct xorfs_nbd_connection *connection)
+{
+   uint16_t flags = XORFS_NBD_FLAG_HAS_FLAGS | XORFS_NBD_FLAG_READ_ONLY | XORFS_NBD_FLAG_SEND_FLUSH | XORFS_NBD_FLAG_CAN_MULTI_CONN | XORFS_NBD_FLAG_SEND_CACHE;
+   return connection->structured_replies ? flags | XORFS_NBD_FLAG_SEND_DF : flags;
+}
+
+struct xorfs_source_file* xorfs_nbd_find_export(const char *name)
+{
+   struct xorfs_source_file *source_file = xorfs_get_source_file_by_file_name(name);
+
+   if (source_file == NULL)
+   {
+      xorfs_log(XORFS_LOG_NOTICE, "NBD client asked for unknown export '%s'\n", name);
+   }
+
+   return source_file;
+}
+
+/**
+ * Handle options of a client (the handshake)
+ *
+ * Returns 0 when an export is chosen and transmission starts, -1 to close.
+ */
+int xorfs_nbd_negotiate(struct xorfs_nbd_connection *connection)
+{
+   int fd = connection->fd;
+   int no_zeroes;
+   char *data = NULL;
+   int return_value = -1;
+
+   // Greeting
+   {
+      struct {
+         uint64_t magic;
+         uint64_t option_magic;
+         uint16_t flags;
+      } __attribute__ ((packed)) greeting = { htobe64(XORFS_NBD_MAGIC), htobe64(XORFS_NBD_OPTION_MAGIC), htobe16(XORFS_NBD_FLAG_FIXED_NEWSTYLE | XORFS_NBD_FLAG_NO_ZEROES) };
+      uint32_t client_flags;
+
+      if (xorfs_nbd_send(fd, &greeting, sizeof greeting) != 0 || xorfs_nbd_receive(fd, &client_flags, sizeof client_flags) != 0)
+      {
+         return -1;
+      }
+
+      client_flags = be32toh(client_flags);
+      no_zeroes = (client_flags & XORFS_NBD_FLAG_NO_ZEROES) != 0;
+
+      if (!(client_flags & XORFS_NBD_FLAG_FIXED_NEWSTYLE))
+      {
+         xorfs_log(XORFS_LOG_NOTICE, "NBD client does not support the fixed newstyle handshake\n");
+         return -1;
+      }
+   }
+
+   // Options
+   while (1)
+   {
+      struct xorfs_nbd_option_request request;
+
+      if (xorfs_nbd_receive(fd, &request, sizeof request) != 0 || be64toh(request.magic) != XORFS_NBD_OPTION_MAGIC)
+      {
+         break;
+      }
+
+      uint32_t option = be32toh(request.option);
+      uint32_t length = be32toh(request.length);
+
+      if (length > XORFS_NBD_MAXIMUM_OPTION_LENGTH)
+      {
+         xorfs_log(XORFS_LOG_NOTICE, "NBD client sent option %u of %u bytes, too long\n", option, length);
+         break;
+      }
+
+      free(data);
+      data = malloc(length + 1);
+      if (data == NULL || xorfs_nbd_receive(fd, data, length) != 0)
+      {
+         break;
+      }
+
+      data[length] = '\0';
+
+      if (option == XORFS_NBD_OPTION_EXPORT_NAME)
+      // Choose export, old way without replies
+      {
+         struct {
+            uint64_t size;
+            uint16_t flags;
+            char zeroes[124];
+         } __attribute__ ((packed)) reply;
+
+         connection->source_file = xorfs_nbd_find_export(data);
+         if (connection->source_file == NULL)
+         {
+            break;
+         }
+
+         memset(&reply, 0, sizeof reply);
+         reply.size = htobe64(connection->source_file->backup.size);
+         reply.flags = htobe16(xorfs_nbd_get_transmission_flags(connection));
+
+         return_value = xorfs_nbd_send(fd, &reply, no_zeroes ? sizeof reply - sizeof reply.zeroes : sizeof reply);
+         break;
+      }
+      else if (option == XORFS_NBD_OPTION_ABORT)
+      {
+         xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ACK, NULL, 0);
+         break;
+      }
+      else if (option == XORFS_NBD_OPTION_LIST)
+      {
+         int failed = 0;
+
+         for (int index = 0; index < xorfs_source_files.count && !failed; index++)
+         {
+            struct xorfs_source_file *source_file = xorfs_source_files.files + index;
+            char entry[sizeof (uint32_t) + NAME_MAX + 1];
+
+            if (source_file->is_duplicate)
+            {
+               continue;
+            }
+
+            xorfs_get_output_file_name(source_file, entry + sizeof (uint32_t));
+            uint32_t name_length = strlen(entry + sizeof (uint32_t));
+            *((uint32_t *) entry) = htobe32(name_length);
+            failed = xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_SERVER, entry, sizeof (uint32_t) + name_length);
+         }
+
+         if (failed || xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ACK, NULL, 0) != 0)
+         {
+            break;
+         }
+      }
+      else if (option == XORFS_NBD_OPTION_STRUCTURED_REPLY)
+      {
+         connection->structured_replies = 1;
+
+         if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ACK, NULL, 0) != 0)
+         {
+            break;
+         }
+      }
+      else if (option == XORFS_NBD_OPTION_LIST_META_CONTEXT || option == XORFS_NBD_OPTION_SET_META_CONTEXT)
+      // Only base:allocation - holes of the backup
+      {
+         const char *context_name = "base:allocation";
+         uint32_t name_length, query_count;
+         uint32_t reply_type = XORFS_NBD_REPLY_ACK;
+         int is_selected = 0;
+         size_t position;
+
+         if (length < 2 * sizeof (uint32_t) || (option == XORFS_NBD_OPTION_SET_META_CONTEXT && !connection->structured_replies))
+         {
+            reply_type = XORFS_NBD_REPLY_ERROR_INVALID;
+         }
+         else
+         {
+            name_length = be32toh(*((uint32_t *) data));
+            position = sizeof (uint32_t) + name_length;
+
+            if (name_length > length - 2 * sizeof (uint32_t))
+            {
+               reply_type = XORFS_NBD_REPLY_ERROR_INVALID;
+            }
+            else
+            {
+               char name[NAME_MAX + 1];
+
+               snprintf(name, sizeof name, "%.*s", (int) name_length, data + sizeof (uint32_t));
+               query_count = be32toh(*((uint32_t *) (data + position)));
+               position += sizeof (uint32_t);
+
+               if (xorfs_nbd_find_export(name) == NULL)
+               {
+                  reply_type = XORFS_NBD_REPLY_ERROR_UNKNOWN;
+               }
+
+               // Listing everything
+               is_selected = (option == XORFS_NBD_OPTION_LIST_META_CONTEXT && query_count == 0);
+
+               for (uint32_t query = 0; query < query_count && reply_type == XORFS_NBD_REPLY_ACK; query++)
+               {
+                  // Fewer queries than counted
+                  if (position + sizeof (uint32_t) > length)
+                  {
+                     reply_type = XORFS_NBD_REPLY_ERROR_INVALID;
+                     break;
+                  }
+
+                  uint32_t query_length = be32toh(*((uint32_t *) (data + position)));
+                  if (query_length > length - position - sizeof (uint32_t))
+                  {
+                     reply_type = XORFS_NBD_REPLY_ERROR_INVALID;
+                     break;
+                  }
+
+                  const char *query_string = data + position + sizeof (uint32_t);
+                  if ((query_length == strlen(context_name) && memcmp(query_string, context_name, query_length) == 0)
+                      || (option == XORFS_NBD_OPTION_LIST_META_CONTEXT && query_length == 5 && memcmp(query_string, "base:", 5) == 0))
+                  {
+                     is_selected = 1;
+                  }
+
+                  position += sizeof (uint32_t) + query_length;
+               }
+            }
+         }
+
+         if (reply_type == XORFS_NBD_REPLY_ACK && option == XORFS_NBD_OPTION_SET_META_CONTEXT)
+         {
+            connection->base_allocation = is_selected;
+         }
+
+         if (reply_type == XORFS_NBD_REPLY_ACK && is_selected)
+         {
+            char context[sizeof (uint32_t) + 16];
+
+            *((uint32_t *) context) = htobe32(XORFS_NBD_BASE_ALLOCATION_CONTEXT_ID);
+            memcpy(context + sizeof (uint32_t), context_name, strlen(context_name));
+
+            if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_META_CONTEXT, context, sizeof (uint32_t) + strlen(context_name)) != 0)
+            {
+               break;
+            }
+         }
+
+         if (xorfs_nbd_send_option_reply(fd, option, reply_type, NULL, 0) != 0)
+         {
+            break;
+         }
+      }
+      else if (option == XORFS_NBD_OPTION_INFO || option == XORFS_NBD_OPTION_GO)
+      {
+         uint32_t name_length = length >= sizeof (uint32_t) ? be32toh(*((uint32_t *) data)) : UINT32_MAX;
+         struct xorfs_source_file *source_file = NULL;
+         int wants_block_size = 0;
+
+         if (length < sizeof (uint32_t) + sizeof (uint16_t) || name_length > length - sizeof (uint32_t) - sizeof (uint16_t) || name_length > NAME_MAX)
+         {
+            if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ERROR_INVALID, NULL, 0) != 0)
+            {
+               break;
+            }
+
+            continue;
+         }
+
+         // Requested information
+         {
+            char name[NAME_MAX + 1];
+            size_t position = sizeof (uint32_t) + name_length;
+            uint16_t request_count = be16toh(*((uint16_t *) (data + position)));
+
+            position += sizeof (uint16_t);
+            for (uint16_t request = 0; request < request_count && position + sizeof (uint16_t) <= length; request++, position += sizeof (uint16_t))
+            {
+               wants_block_size |= be16toh(*((uint16_t *) (data + position))) == XORFS_NBD_INFO_BLOCK_SIZE;
+            }
+
+            snprintf(name, sizeof name, "%.*s", (int) name_length, data + sizeof (uint32_t));
+            source_file = xorfs_nbd_find_export(name);
+         }
+
+         if (source_file == NULL)
+         {
+            if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ERROR_UNKNOWN, NULL, 0) != 0)
+            {
+               break;
+            }
+
+            continue;
+         }
+
+         struct {
+            uint16_t type;
+            uint64_t size;
+            uint16_t flags;
+         } __attribute__ ((packed)) export_info = { htobe16(XORFS_NBD_INFO_EXPORT), htobe64(source_file->backup.size), htobe16(xorfs_nbd_get_transmission_flags(connection)) };
+
+         struct {
+            uint16_t type;
+            uint32_t minimum;
+            uint32_t preferred;
+            uint32_t maximum;
+         } __attribute__ ((packed)) block_size_info = { htobe16(XORFS_NBD_INFO_BLOCK_SIZE), htobe32(1), htobe32(XORFS_SPARSE_BLOCK_SIZE), htobe32(XORFS_NBD_MAXIMUM_PAYLOAD) };
+
+         if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_INFO, &export_info, sizeof export_info) != 0
+             || (wants_block_size && xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_INFO, &block_size_info, sizeof block_size_info) != 0)
+             || xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ACK, NULL, 0) != 0)
+         {
+            break;
+         }
+
+         if (option == XORFS_NBD_OPTION_GO)
+         {
+            connection->source_file = source_file;
+            return_value = 0;
+            break;
+         }
+      }
+      else
+      {
+         if (xorfs_nbd_send_option_reply(fd, option, XORFS_NBD_REPLY_ERROR_UNSUPPORTED, NULL, 0) != 0)
+         {
+            break;
+         }
+      }
+   }
+
+   free(data);
+   return return_value;
+}
+
+/**
+ * Send a chunk of a structured reply
+ */
+int xorfs_nbd_send_chunk(struct xorfs_nbd_connection *connection, uint64_t cookie, uint16_t flags, uint16_t type, const void *header, size_t header_size, const void *data, size_t data_size)
+{
+   struct xorfs_nbd_structured_reply reply = { htobe32(XORFS_NBD_STRUCTURED_REPLY_MAGIC), htobe16(flags), htobe16(type), cookie, htobe32(header_size + data_size) };
+   int return_value;
+
+   pthread_mutex_lock(&connection->write_mutex);
+   return_value = xorfs_nbd_send(connection->fd, &reply, sizeof reply) != 0
+                  || xorfs_nbd_send(connection->fd, header, header_size) != 0
+                  || xorfs_nbd_send(connection->fd, data, data_size) != 0 ? -1 : 0;
+   pthread_mutex_unlock(&connection->write_mutex);
+
+   return return_value;
+}
+
+/**
+ * Send a simple reply, or a structured one for reads and block status
+ */
+int xorfs_nbd_send_reply(struct xorfs_nbd_connection *connection, const struct xorfs_nbd_request *request, int error, const void *data, size_t data_size)
+{
+   uint16_t type = be16toh(request->type);
+   int return_value;
+
+   if (connection->structured_replies && (type == XORFS_NBD_COMMAND_READ || type == XORFS_NBD_COMMAND_BLOCK_STATUS))
+   {
+      struct {
+         uint32_t error;
+         uint16_t message_length;
+      } __attribute__ ((packed)) error_header = { htobe32(xorfs_nbd_error(error)), 0 };
+
+      return error != 0
+             ? xorfs_nbd_send_chunk(connection, request->cookie, XORFS_NBD_REPLY_FLAG_DONE, XORFS_NBD_REPLY_TYPE_ERROR, &error_header, sizeof error_header, NULL, 0)
+             : xorfs_nbd_send_chunk(connection, request->cookie, XORFS_NBD_REPLY_FLAG_DONE, XORFS_NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+   }
+
+   struct xorfs_nbd_simple_reply reply = { htobe32(XORFS_NBD_SIMPLE_REPLY_MAGIC), htobe32(error != 0 ? xorfs_nbd_error(error) : 0), request->cookie };
+
+   pthread_mutex_lock(&connection->write_mutex);
+   return_value = xorfs_nbd_send(connection->fd, &reply, sizeof reply) != 0 || xorfs_nbd_send(connection->fd, data, error == 0 ? data_size : 0) != 0 ? -1 : 0;
+   pthread_mutex_unlock(&connection->write_mutex);
+
+   return return_value;
+}
+
+/**
+ * Read a range of the backup for a client
+ *
+ * With structured replies, holes of the whole chain are sent as hole
+ * chunks - not read, and not sent as zeros.
+ */
+int xorfs_nbd_read(struct xorfs_nbd_connection *connection, const struct xorfs_nbd_request *request, char *buffer)
+{
+   struct xorfs_source_file *source_file = connection->source_file;
+   off_t offset = be64toh(request->offset);
+   size_t length = be32toh(request->length);
+   int one_chunk = !connection->structured_replies || (be16toh(request->flags) & XORFS_NBD_COMMAND_FLAG_DF);
+
+   if (one_chunk)
+   {
+      int read_bytes = xorfs_read_backup_streamed(source_file, buffer, offset, length);
+      if (read_bytes >= 0 && read_bytes < length)
+      {
+         memset(buffer + read_bytes, 0, length - read_bytes);
+      }
+
+      if (!connection->structured_replies || read_bytes < 0)
+      {
+         return xorfs_nbd_send_reply(connection, request, read_bytes < 0 ? -read_bytes : 0, buffer, length);
+      }
+
+      uint64_t chunk_offset = htobe64(offset);
+      return xorfs_nbd_send_chunk(connection, request->cookie, XORFS_NBD_REPLY_FLAG_DONE, XORFS_NBD_REPLY_TYPE_OFFSET_DATA, &chunk_offset, sizeof chunk_offset, buffer, length);
+   }
+
+   for (size_t position = 0; position < length; )
+   {
+      int is_hole;
+      off_t extent_length = xorfs_get_backup_extent(source_file, offset + position, length - position, &is_hole);
+
+      if (is_hole)
+      {
+         struct {
+            uint64_t offset;
+            uint32_t length;
+         } __attribute__ ((packed)) hole = { htobe64(offset + position), htobe32(extent_length) };
+
+         if (xorfs_nbd_send_chunk(connection, request->cookie, 0, XORFS_NBD_REPLY_TYPE_OFFSET_HOLE, &hole, sizeof hole, NULL, 0) != 0)
+         {
+            return -1;
+         }
+      }
+      else
+      {
+         uint64_t chunk_offset = htobe64(offset + position);
+         int read_bytes = xorfs_read_backup_streamed(source_file, buffer, offset + position, extent_length);
+         if (read_bytes < 0)
+         {
+            return xorfs_nbd_send_reply(connection, request, -read_bytes, NULL, 0);
+         }
 
-                               backup_info->name = new_memory;
+         memset(buffer + read_bytes, 0, extent_length - read_bytes);
 
-                               // Copy the string
-                               strncpy(backup_info->name, new_source_file->name, name_end_offset);
+         if (xorfs_nbd_send_chunk(connection, request->cookie, 0, XORFS_NBD_REPLY_TYPE_OFFSET_DATA, &chunk_offset, sizeof chunk_offset, buffer, extent_length) != 0)
+         {
+            return -1;
+         }
+      }
 
-                               // Write null byte
-                               backup_info->name[name_end_offset] = '\0';
-                            }
-                         }
+      position += extent_length;
+   }
 
-                         // Read first number
-                         {
-                            unsigned long int number = 0;
-                            number = strtol(new_source_file->name + first_number_offset, &xOrDot, 10);
-                            // No error checking - there is a number at the beginning of the string here, always
+   return xorfs_nbd_send_reply(connection, request, 0, NULL, 0);
+}
 
-                            backup_info->number = (int) number;
-                         }
+/**
+ * Send extents of holes and data of the backup (base:allocation)
+ */
+int xorfs_nbd_block_status(struct xorfs_nbd_connection *connection, const struct xorfs_nbd_request *request)
+{
+   struct {
+      uint32_t context_id;
+      uint32_t extents[2 * XORFS_NBD_MAXIMUM_EXTENT_COUNT]; // Length, flags
+   } __attribute__ ((packed)) status;
+   off_t offset = be64toh(request->offset);
+   size_t length = be32toh(request->length);
+   int extent_count = 0;
+   int maximum_extent_count = (be16toh(request->flags) & XORFS_NBD_COMMAND_FLAG_REQ_ONE) ? 1 : XORFS_NBD_MAXIMUM_EXTENT_COUNT;
 
-                         // Then the rest of the name
-                         {
-                            if (*xOrDot == 'x')
-                            {
-                               // Read second number
-                               {
-                                  unsigned long int number = 0;
-                                  errno = 0;
-                                  number = strtol(xOrDot + 1, &dot, 10);
-                                  if (errno != 0)
-                                  {
-                                     xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': Cannot read second number after 'x'\n", new_source_file->name);
-                                     return_value = 5;
-                                     goto failure_close_files;
-                                  }
+   if (!connection->base_allocation)
+   {
+      return xorfs_nbd_send_reply(connection, request, EINVAL, NULL, 0);
+   }
 
-                                  backup_info->xor_against_number = (int) number;
-                               }
-                            }
-                            else if (*xOrDot == '.')
-                            {
-                               // This is a plain image file
-                               backup_info->xor_against_number = 0;
-                               backup_info->xor_against_source_file = NULL;
-                               dot = xOrDot;
-                            }
-                            else
-                            {
-                               xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': No 'x' or '.' after the first number\n", new_source_file->name);
-                               return_value = 5;
-                               goto failure_close_files;
-                            }
-                         }
+   status.context_id = htobe32(XORFS_NBD_BASE_ALLOCATION_CONTEXT_ID);
 
-                         // Verify that we ended on a '.'
-                         if (*dot != '.')
-                         {
-                            xorfs_log(XORFS_LOG_ERROR, "Malformed backup file name '%s': Dot not found when expected\n", new_source_file->name);
-                            return_value = 5;
-                            goto failure_close_files;
-                         }
+   for (size_t position = 0; position < length && extent_count < maximum_extent_count; extent_count++)
+   {
+      int is_hole;
+      off_t extent_length = xorfs_get_backup_extent(connection->source_file, offset + position, length - position, &is_hole);
 
-                         // Construct output file name
-                         {
-                            char *output_file_name = strdup(file_name);
-                            if (output_file_name == NULL)
-                            {
-                               xorfs_log(XORFS_LOG_ERROR, "Unable to allocate memory: %s\n", strerror(errno));
-                               return_value = 5;
-                               goto failure_close_files;
-                            }
+      status.extents[2 * extent_count] = htobe32(extent_length);
+      status.extents[2 * extent_count + 1] = htobe32(is_hole ? XORFS_NBD_STATE_HOLE | XORFS_NBD_STATE_ZERO : 0);
+      position += extent_length;
+   }
 
-                            // Overwrite the string after first number with ".dat"
-                            int offset_of_dot_or_x = (xOrDot - new_source_file->name);
-                            strcpy(output_file_name + offset_of_dot_or_x, ".dat");
+   return xorfs_nbd_send_chunk(connection, request->cookie, XORFS_NBD_REPLY_FLAG_DONE, XORFS_NBD_REPLY_TYPE_BLOCK_STATUS, &status, sizeof (uint32_t) * (1 + 2 * extent_count), NULL, 0);
+}
 
-                            backup_info->output_file_name = output_file_name;
-                         }
-                      }
+/**
+ * Serve requests of a connection, one of its threads
+ */
+void* xorfs_nbd_serve(void *data)
+{
+   struct xorfs_nbd_connection *connection = data;
+   char *buffer = NULL;
+   size_t buffer_size = 0;
 
-                      // Copy from stat structure
-                      backup_info->time = new_source_file->stat.st_mtime;
-                   }
-               }
-           }
-       }
-    }
+   while (1)
+   {
+      struct xorfs_nbd_request request;
+      int received;
 
-    // Check backup links and fill the pointers
-    {
-       struct xorfs_source_file* source_file;
+      // Take a request, the next thread takes the next one
+      pthread_mutex_lock(&connection->read_mutex);
+      received = !connection->is_closing && xorfs_nbd_receive(connection->fd, &request, sizeof request) == 0 && be32toh(request.magic) == XORFS_NBD_REQUEST_MAGIC;
 
-       for (int index = 0; index < xorfs_source_files.count; index++)
-       {
-          source_file = xorfs_source_files.files + index;
+      // Payload of writes is not used, only skipped
+      if (received && be16toh(request.type) == XORFS_NBD_COMMAND_WRITE)
+      {
+         char skipped[XORFS_SPARSE_BLOCK_SIZE];
 
-          if (source_file->backup.xor_against_number == 0)
-          // Is plain image file
-          {
-             // Do nothing
-             source_file->backup.xor_against_source_file = NULL;
-          }
-          else
-          // Is xored image file
-          {
-             struct xorfs_source_file* xor_against_source_file = get_source_file_by_backup_name_and_number(source_file->backup.name, source_file->backup.xor_against_number);
+         for (uint32_t left = be32toh(request.length); left > 0 && received; left -= left < sizeof skipped ? left : sizeof skipped)
+         {
+            received = xorfs_nbd_receive(connection->fd, skipped, left < sizeof skipped ? left : sizeof skipped) == 0;
+         }
+      }
 
-             if (xor_against_source_file != NULL)
-             {
-                source_file->backup.xor_against_source_file = xor_against_source_file;
-             }
-             else
-             {
-                xorfs_log(XORFS_LOG_ERROR, "Backup %s-%i is xored against backup %i, but that is missing\n", source_file->backup.name, source_file->backup.number, source_file->backup.xor_against_number);
-                return_value = 6;
-                goto failure_close_files;
-             }
-          }
-       }
-    }
+      pthread_mutex_unlock(&connection->read_mutex);
 
-    // Success
-    return 0;
+      if (!received)
+      {
+         break;
+      }
 
-    // Fail procedure
-    failure_close_files:
-    xorfs_close_source_files();
-    failure_closedir:
-    closedir(source_directory);
-    failure_return:
-    return return_value;
+      uint16_t type = be16toh(request.type);
+      off_t offset = be64toh(request.offset);
+      uint32_t length = be32toh(request.length);
+      int result;
+
+      if (type == XORFS_NBD_COMMAND_DISCONNECT)
+      {
+         // Other threads get no more requests
+         connection->is_closing = 1;
+         shutdown(connection->fd, SHUT_RD);
+         break;
+      }
+      else if ((type == XORFS_NBD_COMMAND_READ || type == XORFS_NBD_COMMAND_BLOCK_STATUS || type == XORFS_NBD_COMMAND_CACHE)
+               && (offset < 0 || offset + length > connection->source_file->backup.size))
+      {
+         result = xorfs_nbd_send_reply(connection, &request, EINVAL, NULL, 0);
+      }
+      else if (type == XORFS_NBD_COMMAND_READ && length > XORFS_NBD_MAXIMUM_PAYLOAD)
+      {
+         result = xorfs_nbd_send_reply(connection, &request, EOVERFLOW, NULL, 0);
+      }
+      else if (type == XORFS_NBD_COMMAND_READ)
+      {
+         if (length > buffer_size)
+         {
+            free(buffer);
+            buffer_size = length;
+            buffer = malloc(buffer_size);
+         }
+
+         result = buffer == NULL ? xorfs_nbd_send_reply(connection, &request, ENOMEM, NULL, 0) : xorfs_nbd_read(connection, &request, buffer);
+
+         if (buffer == NULL)
+         {
+            buffer_size = 0;
+         }
+      }
+      else if (type == XORFS_NBD_COMMAND_BLOCK_STATUS)
+      {
+         result = xorfs_nbd_block_status(connection, &request);
+      }
+      else if (type == XORFS_NBD_COMMAND_FLUSH || type == XORFS_NBD_COMMAND_CACHE)
+      {
+         // Nothing is written, nothing is kept aside
+         result = xorfs_nbd_send_reply(connection, &request, 0, NULL, 0);
+      }
+      else
+      {
+         result = xorfs_nbd_send_reply(connection, &request, type == XORFS_NBD_COMMAND_WRITE ? EPERM : EINVAL, NULL, 0);
+      }
+
+      if (result != 0)
+      {
+         connection->is_closing = 1;
+         shutdown(connection->fd, SHUT_RDWR);
+         break;
+      }
+   }
+
+   free(buffer);
+
+   // The last thread closes the connection
+   if (__atomic_sub_fetch(&connection->thread_count, 1, __ATOMIC_ACQ_REL) == 0)
+   {
+      xorfs_log(XORFS_LOG_INFO, "NBD connection to backup %s-%i closed\n", connection->source_file->backup.name, connection->source_file->backup.number);
+      close(connection->fd);
+      pthread_mutex_destroy(&connection->read_mutex);
+      pthread_mutex_destroy(&connection->write_mutex);
+      free(connection);
+   }
+
+   return NULL;
+}
+
+/**
+ * Handshake with a client, then start threads serving the connection
+ */
+void* xorfs_nbd_handle_connection(void *data)
+{
+   struct xorfs_nbd_connection *connection = data;
+
+   if (xorfs_nbd_negotiate(connection) != 0)
+   {
+      close(connection->fd);
+      pthread_mutex_destroy(&connection->read_mutex);
+      pthread_mutex_destroy(&connection->write_mutex);
+      free(connection);
+      return NULL;
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "NBD connection to backup %s-%i%s\n", connection->source_file->backup.name, connection->source_file->backup.number, connection->structured_replies ? ", structured replies" : "");
+
+   connection->thread_count = xorfs_nbd_thread_count;
+
+   for (int index = 1; index < xorfs_nbd_thread_count; index++)
+   {
+      pthread_t thread;
+
+      if (pthread_create(&thread, NULL, xorfs_nbd_serve, connection) != 0)
+      {
+         __atomic_sub_fetch(&connection->thread_count, 1, __ATOMIC_ACQ_REL);
+         continue;
+      }
+
+      pthread_detach(thread);
+   }
+
+   return xorfs_nbd_serve(connection);
+}
+
+void xorfs_nbd_stop(int signal_number)
+{
+   xorfs_nbd_is_stopping = 1;
+}
+
+/**
+ * Serve backups over NBD until interrupted
+ */
+int xorfs_tool_nbd(int argc, char *argv[])
+{
+   const char *socket_path = argv[2];
+   struct sockaddr_un address;
+   struct stat socket_stat;
+   int listening_fd = -1;
+
+   if (argc > 3)
+   {
+      xorfs_nbd_thread_count = atoi(argv[3]);
+   }
+
+   if (xorfs_nbd_thread_count < 1 || strlen(socket_path) >= sizeof address.sun_path)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Threads must be at least 1, and socket path shorter than %zu\n", sizeof address.sun_path);
+      return 1;
+   }
+
+   xorfs_source_directory_path = strdup(argv[1]);
+   if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to open source directory and/or files\n");
+      return 1;
+   }
+
+   // Replace a socket left by a previous run
+   if (lstat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode))
+   {
+      unlink(socket_path);
+   }
+
+   memset(&address, 0, sizeof address);
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, socket_path);
+
+   listening_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listening_fd < 0 || bind(listening_fd, (struct sockaddr *) &address, sizeof address) != 0 || listen(listening_fd, SOMAXCONN) != 0)
+   {
+      xorfs_log(XORFS_LOG_ERROR, "Unable to listen on '%s': %s\n", socket_path, strerror(errno));
+      if (listening_fd >= 0) { close(listening_fd); }
+      xorfs_close_source_files();
+      return 1;
+   }
+
+   // Interrupt accept() on SIGINT and SIGTERM
+   {
+      struct sigaction action;
+
+      memset(&action, 0, sizeof action);
+      action.sa_handler = xorfs_nbd_stop;
+      sigaction(SIGINT, &action, NULL);
+      sigaction(SIGTERM, &action, NULL);
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Serving %u source files over NBD on '%s'\n", xorfs_source_files.count, socket_path);
+
+   while (!xorfs_nbd_is_stopping)
+   {
+      int fd = accept(listening_fd, NULL, NULL);
+      if (fd < 0)
+      {
+         if (errno != EINTR)
+         {
+            xorfs_log(XORFS_LOG_ERROR, "Unable to accept NBD connection: %s\n", strerror(errno));
+         }
+
+         continue;
+      }
+
+      struct xorfs_nbd_connection *connection = calloc(1, sizeof (struct xorfs_nbd_connection));
+      pthread_t thread;
+
+      if (connection == NULL)
+      {
+         close(fd);
+         continue;
+      }
+
+      connection->fd = fd;
+      pthread_mutex_init(&connection->read_mutex, NULL);
+      pthread_mutex_init(&connection->write_mutex, NULL);
+
+      if (pthread_create(&thread, NULL, xorfs_nbd_handle_connection, connection) != 0)
+      {
+         close(fd);
+         pthread_mutex_destroy(&connection->read_mutex);
+         pthread_mutex_destroy(&connection->write_mutex);
+         free(connection);
+         continue;
+      }
+
+      pthread_detach(thread);
+   }
+
+   xorfs_log(XORFS_LOG_INFO, "Stopping NBD server\n");
+   close(listening_fd);
+   unlink(socket_path);
+
+   // Connections still open end with the process
+   return 0;
 }
 
+struct xorfs_tool {
+   const char *name;
+   const char *arguments;
+   int minimum_argument_count;
+   int (*function)(int argc, char *argv[]); // argv[0] is the tool name
+};
+
+struct xorfs_tool xorfs_tools[] = {
+   { "compact", "<source directory> <maximum chain depth> [threads]", 2, xorfs_tool_compact },
+   { "merge", "<source directory> <backup name> <backup number>", 3, xorfs_tool_merge },
+   { "rotate", "<source directory> <backup name>", 2, xorfs_tool_rotate },
+   { "skip-deltas", "<source directory> <backup name> [threads]", 2, xorfs_tool_skip_deltas },
+   { "add", "<source directory> <backup name> <image file> [candidate count]", 3, xorfs_tool_add },
+   { "add-changed", "<source directory> <backup name> <image file> <changed block list>", 4, xorfs_tool_add_changed },
+   { "pack", "<source directory> <source file name> [block size]", 2, xorfs_tool_pack },
+   { "compress", "<source directory> <source file name> [none|zstd|lz4] [frame size]", 2, xorfs_tool_compress },
+   { "dedup", "<source directory> <source file name> [block size]", 2, xorfs_tool_dedup },
+   { "extract", "<source directory> <backup file name> [output file]", 2, xorfs_tool_extract },
+   { "scan", "<source directory> <backup name> <output directory> [offset] [length]", 3, xorfs_tool_scan },
+   { "extract-used", "<source directory> <backup file name> <output file>", 3, xorfs_tool_extract_used },
+   { "extract-file", "<source directory> <backup file name> <path> <output file>", 4, xorfs_tool_extract_file },
+   { "history", "<source directory> <backup name> [block size]", 2, xorfs_tool_history },
+   { "history-query", "<source directory> <backup name> <offset>", 3, xorfs_tool_history_query },
+   { "nbd", "<source directory> <socket path> [threads per connection]", 2, xorfs_tool_nbd },
+   { NULL, NULL, 0, NULL }
+};
+
+static struct fuse_operations operations = {
+    .getattr	= xorfs_operation_getattr,
+    .readdir	= xorfs_operation_readdir,
+    .read		= xorfs_operation_read,
+    .read_buf	= xorfs_operation_read_buf,
+    .ioctl		= xorfs_operation_ioctl,
+    .init		= xorfs_operation_init,
+    .destroy	= xorfs_operation_destroy,
+};
 
 int main( int argc, char *argv[] )
 {
     int fuse_main_return_code;
     struct fuse_args fuse_arguments = FUSE_ARGS_INIT(argc, argv);
 
+    // Run an offline tool instead of mounting
+    if (argc >= 2)
+    {
+       for (struct xorfs_tool *tool = xorfs_tools; tool->name != NULL; tool++)
+       {
+          if (strcmp(argv[1], tool->name) == 0)
+          {
+             if (argc - 2 < tool->minimum_argument_count)
+             {
+                fprintf(stderr, "Usage: %s %s %s\n", argv[0], tool->name, tool->arguments);
+                return 1;
+             }
+
+             return tool->function(argc - 1, argv + 1);
+          }
+       }
+    }
+
     xorfs_log(XORFS_LOG_DEBUG, "Starting\n");
 
     // Process arguments
-    fuse_opt_parse(&fuse_arguments, NULL, NULL, xorfs_process_argument);
+    fuse_opt_parse(&fuse_arguments, &xorfs_options, xorfs_option_specification, xorfs_process_argument);
+    xorfs_frame_cache.maximum_size = (size_t) xorfs_options.frame_cache_size * 1024 * 1024;
 
     // Open source files
     if (xorfs_open_source_files(xorfs_source_directory_path) != 0)
@@ -743,11 +10517,53 @@ int main( int argc, char *argv[] )
        return 1;
     }
 
+    // Use checkpoints of the previous mounts
+    if (xorfs_options.checkpoint_directory != NULL && xorfs_load_checkpoints() != 0)
+    {
+       xorfs_close_source_files();
+       return 1;
+    }
+
     // Prepare debug file
     xorfs_debug_file_fd = xorfs_create_debug_file(&xorfs_source_files);
 
-    // Execute fuse main function
-    fuse_main_return_code = fuse_main(fuse_arguments.argc, fuse_arguments.argv, &operations, NULL);
+    // Mount and run fuse as fuse_main() does, keeping the channel to push data to the kernel
+    {
+        int is_multithreaded;
+        int is_foreground;
+
+        fuse_main_return_code = 1;
+        if (fuse_parse_cmdline(&fuse_arguments, &xorfs_mount.mountpoint, &is_multithreaded, &is_foreground) == 0 && xorfs_mount.mountpoint != NULL)
+        {
+            xorfs_mount.channel = fuse_mount(xorfs_mount.mountpoint, &fuse_arguments);
+        }
+
+        if (xorfs_mount.channel != NULL)
+        {
+            xorfs_mount.fuse = fuse_new(xorfs_mount.channel, &fuse_arguments, &operations, sizeof operations, NULL);
+            if (xorfs_mount.fuse == NULL)
+            {
+                fuse_unmount(xorfs_mount.mountpoint, xorfs_mount.channel);
+            }
+        }
+
+        if (xorfs_mount.fuse != NULL)
+        {
+            struct fuse_session *session = fuse_get_session(xorfs_mount.fuse);
+
+            if (fuse_daemonize(is_foreground) == 0 && fuse_set_signal_handlers(session) == 0)
+            {
+                fuse_main_return_code = (is_multithreaded ? fuse_loop_mt(xorfs_mount.fuse) : fuse_loop(xorfs_mount.fuse)) == -1;
+                fuse_remove_signal_handlers(session);
+            }
+
+            fuse_unmount(xorfs_mount.mountpoint, xorfs_mount.channel);
+            fuse_destroy(xorfs_mount.fuse);
+        }
+
+        free(xorfs_mount.mountpoint);
+        fuse_opt_free_args(&fuse_arguments);
+    }
 
     // Cleanup
     {